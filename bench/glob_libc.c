@@ -0,0 +1,22 @@
+/*
+ * glob_libc.c - Reference for bench/glob.sh: expands a pattern with glob(3)
+ *
+ * Usage: glob_libc PATTERN
+ * Prints the number of matches (glob(3) sorts them, like mini_bash).
+ */
+#include <glob.h>
+#include <stdio.h>
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s PATTERN\n", argv[0]);
+        return 2;
+    }
+    glob_t g;
+    int result = glob(argv[1], 0, NULL, &g);
+    printf("%zu\n", result == 0 ? g.gl_pathc : 0);
+    if (result == 0) {
+        globfree(&g);
+    }
+    return 0;
+}
@@ -0,0 +1,45 @@
+#!/bin/bash
+#
+# script_cache.sh - Cold vs. cached startup of a 5,000-line script
+#
+# Generates a script of 1,000 five-line function definitions (a typical
+# helper library), so the run time is dominated by reading and parsing
+# rather than by executing. Each variant is started RUNS times:
+#   cold:   MINI_BASH_NO_CACHE=1 - read() + lex + parse on every start
+#   cached: mmap() of $HOME/.cache/mini_bash/<key>.ast, no parsing
+#
+# Usage: make && bench/script_cache.sh [RUNS]
+
+RUNS=${1:-200}
+SHELL_BIN=${SHELL_BIN:-./mini_bash}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+SCRIPT=$WORK/bench.sh
+
+# 5,000 lines: 1,000 functions of 5 lines each
+for i in $(seq 1 1000); do
+    echo "f$i() {"
+    echo "    v=\"value $i with some words\"; if [ \"\$1\" = x ]; then echo \"\$v\"; fi"
+    echo "    case \$v in *\"value\"*) n=1 ;; *) n=0 ;; esac  # comment"
+    echo "    for w in 1 2 3; do t=\$w; done"
+    echo "}"
+done > "$SCRIPT"
+
+run() {
+    local start end
+    start=$(date +%s%N)
+    for _ in $(seq 1 "$RUNS"); do
+        "$@" "$SCRIPT" > /dev/null
+    done
+    end=$(date +%s%N)
+    echo $(( (end - start) / RUNS / 1000 ))
+}
+
+export HOME=$WORK
+cold=$(MINI_BASH_NO_CACHE=1 run "$SHELL_BIN")
+"$SHELL_BIN" "$SCRIPT" > /dev/null  # Populate the cache
+cached=$(run "$SHELL_BIN")
+
+echo "script: $(wc -l < "$SCRIPT") lines, $(wc -c < "$SCRIPT") bytes, $RUNS runs each"
+echo "cold   (read + parse): ${cold} us/start"
+echo "cached (mmap):         ${cached} us/start"
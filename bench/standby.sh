@@ -0,0 +1,45 @@
+#!/bin/bash
+#
+# standby.sh - Interactive command latency with and without a parked
+#              standby child (-o standby)
+#
+# Drives an interactive mini_bash through a coprocess. For each command
+# it pauses THINK seconds (the user typing), writes the line, and times
+# how long until "Command completed" comes back. With -o standby the
+# fork() happened during the pause, so only the exec and the wait are
+# left on the critical path.
+#
+# FILL_MB grows the shell first (big=$(cat FILE)) so that fork() has
+# page tables worth copying.
+#
+# Usage: make && bench/standby.sh [COMMANDS] [THINK] [FILL_MB]
+
+COMMANDS=${1:-200}
+THINK=${2:-0.02}
+FILL_MB=${3:-0}
+SHELL_BIN=${SHELL_BIN:-./mini_bash}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+export HOME=$WORK
+head -c $((FILL_MB * 1024 * 1024)) /dev/zero | tr '\0' x > "$WORK/fill"
+
+for mode in fork standby; do
+    opts=()
+    [ "$mode" = standby ] && opts=(-o standby)
+    coproc SH { "$SHELL_BIN" "${opts[@]}" 2>&1; }
+    echo "big=\$(cat $WORK/fill)" >&"${SH[1]}"
+    total=0
+    for ((i = 0; i < COMMANDS; i++)); do
+        sleep "$THINK"
+        start=${EPOCHREALTIME/./}
+        echo true >&"${SH[1]}"
+        while read -r line <&"${SH[0]}"; do
+            [[ $line == *"Command completed"* ]] && break
+        done
+        end=${EPOCHREALTIME/./}
+        total=$((total + end - start))
+    done
+    exec {SH[1]}>&-
+    wait "$SH_PID" 2>/dev/null
+    printf '%-8s %6d us/command\n' "$mode" $((total / COMMANDS))
+done
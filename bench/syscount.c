@@ -0,0 +1,71 @@
+/*
+ * syscount.c - Counts the system calls made by one process (not its
+ *              children), for the benchmarks in this directory
+ *
+ * The machine this shell was measured on has no strace or perf, so this
+ * is a minimal ptrace() tracer. Children of the traced program are not
+ * traced (no PTRACE_O_TRACEFORK), so only the shell's own calls count.
+ *
+ * Usage: cc -O2 -o syscount bench/syscount.c
+ *        ./syscount PROGRAM [ARG...]       (report on stderr)
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <linux/ptrace.h>
+
+#define MAX_NR 1024
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s PROGRAM [ARG...]\n", argv[0]);
+        return 2;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        raise(SIGSTOP);
+        execvp(argv[1], argv + 1);
+        perror("execvp");
+        _exit(127);
+    }
+
+    static unsigned long counts[MAX_NR];
+    unsigned long total = 0;
+    int status;
+    waitpid(pid, &status, 0);
+    ptrace(PTRACE_SETOPTIONS, pid, NULL, (void *)(PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL));
+
+    int deliver = 0;
+    while (1) {
+        ptrace(PTRACE_SYSCALL, pid, NULL, (void *)(long)deliver);
+        deliver = 0;
+        if (waitpid(pid, &status, 0) == -1 || WIFEXITED(status) || WIFSIGNALED(status)) {
+            break;
+        }
+        if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+            struct ptrace_syscall_info info;
+            if (ptrace(PTRACE_GET_SYSCALL_INFO, pid, (void *)sizeof(info), &info) > 0 &&
+                info.op == PTRACE_SYSCALL_INFO_ENTRY && info.entry.nr < MAX_NR) {
+                counts[info.entry.nr]++;
+                total++;
+            }
+        } else if (WSTOPSIG(status) != SIGTRAP) {
+            deliver = WSTOPSIG(status);     // A real signal: pass it on
+        }
+    }
+
+    fprintf(stderr, "syscalls: %lu\n", total);
+    for (int nr = 0; nr < MAX_NR; nr++) {
+        if (counts[nr] > 0) {
+            fprintf(stderr, "  nr %3d: %lu\n", nr, counts[nr]);
+        }
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
@@ -0,0 +1,68 @@
+#!/bin/bash
+#
+# uring.sh - System calls and latency per command, with and without
+#            the io_uring backend (-o uring)
+#
+# Script mode: a script of N "true" commands. Interactive mode: the shell
+# reads one line at a time from a coprocess, so every command costs a
+# prompt, a read and a report. System calls of the shell itself are
+# counted with syscount.c for N and 2N commands, so startup cancels out;
+# latency is measured in separate, untraced runs.
+#
+# Usage: make && bench/uring.sh [N]
+
+N=${1:-200}
+SHELL_BIN=${SHELL_BIN:-./mini_bash}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+export HOME=$WORK
+export MINI_BASH_NO_CACHE=1
+cc -O2 -o "$WORK/syscount" "$(dirname "$0")/syscount.c" || exit 1
+
+for n in $N $((2 * N)); do
+    for ((i = 0; i < n; i++)); do echo true; done > "$WORK/s$n.sh"
+done
+
+# interactive N TRACER... - feeds N lines one at a time, prints elapsed us
+interactive() {
+    local n=$1
+    shift
+    coproc SH { "$@" 2> "$WORK/trace"; }
+    local start=${EPOCHREALTIME/./}
+    for ((i = 0; i < n; i++)); do
+        echo true >&"${SH[1]}"
+        while read -r line <&"${SH[0]}"; do
+            [[ $line == *"Command completed"* ]] && break
+        done
+    done
+    local end=${EPOCHREALTIME/./}
+    exec {SH[1]}>&-
+    wait "$SH_PID" 2>/dev/null
+    echo $((end - start))
+}
+
+syscalls() { sed -n 's/^syscalls: //p' "$WORK/trace"; }
+per_command() { awk -v a="$1" -v b="$2" -v n="$N" 'BEGIN { printf "%.2f", (b - a) / n }'; }
+
+for mode in plain uring; do
+    opts=()
+    [ "$mode" = uring ] && opts=(-o uring)
+
+    "$WORK/syscount" "$SHELL_BIN" "${opts[@]}" "$WORK/s$N.sh" > /dev/null 2> "$WORK/trace"
+    a=$(syscalls)
+    "$WORK/syscount" "$SHELL_BIN" "${opts[@]}" "$WORK/s$((2 * N)).sh" > /dev/null 2> "$WORK/trace"
+    b=$(syscalls)
+    start=${EPOCHREALTIME/./}
+    "$SHELL_BIN" "${opts[@]}" "$WORK/s$((2 * N)).sh" > /dev/null
+    end=${EPOCHREALTIME/./}
+    printf 'script       %-6s %6s syscalls/command  %5d us/command\n' "$mode" \
+        "$(per_command "$a" "$b")" $(( (end - start) / (2 * N) ))
+
+    interactive "$N" "$WORK/syscount" "$SHELL_BIN" "${opts[@]}" > /dev/null
+    a=$(syscalls)
+    interactive $((2 * N)) "$WORK/syscount" "$SHELL_BIN" "${opts[@]}" > /dev/null
+    b=$(syscalls)
+    us=$(interactive $((2 * N)) "$SHELL_BIN" "${opts[@]}")
+    printf 'interactive  %-6s %6s syscalls/command  %5d us/command\n' "$mode" \
+        "$(per_command "$a" "$b")" $((us / (2 * N)))
+done
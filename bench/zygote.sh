@@ -0,0 +1,37 @@
+#!/bin/bash
+#
+# zygote.sh - Spawn latency vs. shell memory size, with and without
+#             the fork server (-o zygote)
+#
+# The script run by mini_bash first grows the shell: big=$(cat FILE)
+# touches FILE's size in the expansion arena and again in the variable
+# table. It then runs /bin/true SPAWNS times. Without the fork server
+# every fork() copies the page tables of all that memory; with it, the
+# helper started at shell startup forks from its own small image.
+#
+# Usage: make && bench/zygote.sh [SPAWNS]
+
+SPAWNS=${1:-300}
+SHELL_BIN=${SHELL_BIN:-./mini_bash}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+export HOME=$WORK  # Keep the script cache out of the way
+
+for mb in 0 32 96; do
+    head -c $((mb * 1024 * 1024)) /dev/zero | tr '\0' x > "$WORK/fill"
+    cat > "$WORK/bench.sh" <<SCRIPT
+big=\$(cat $WORK/fill)
+rss=\$(grep VmRSS /proc/\$\$/status)
+start=\$(date +%s%N)
+for i in \$(seq $SPAWNS); do true; done
+end=\$(date +%s%N)
+echo "RESULT \$start \$end \$rss"
+SCRIPT
+    for mode in fork zygote; do
+        opts=()
+        [ "$mode" = zygote ] && opts=(-o zygote)
+        read -r _ start end _ rss _ < <("$SHELL_BIN" "${opts[@]}" "$WORK/bench.sh" | grep '^RESULT')
+        printf 'fill %3d MB  shell RSS %7d kB  %-6s  %6d us/spawn\n' \
+            "$mb" "$rss" "$mode" $(( (end - start) / SPAWNS / 1000 ))
+    done
+done
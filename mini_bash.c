@@ -1,385 +1,10182 @@
-/*
- * mini_bash.c - A minimal shell implementation using system calls
- * 
- * This program demonstrates process management and system call usage
- * by implementing a simple command interpreter.
-     */
-
-#include <unistd.h>     // For write(), read(), fork(), exec(), chdir(), access()
-#include <stdlib.h>     // For getenv(), exit()
-#include <string.h>     // For string manipulation functions
-#include <stdio.h>      // For perror()
-#include <sys/types.h>  // For pid_t type
-#include <sys/wait.h>   // For wait() system call
-
-// Constants
-#define PROMPT "mini-bash$ "
-#define PROMPT_LEN 11       // Length of "mini-bash$ " (10 chars + space)
-#define BUFFER_SIZE 1024    // Size of input buffer
-#define MAX_ARGS 64         // Maximum number of arguments (command + args)
-#define MAX_PATH 512        // Maximum path length
-
-/*
- * Function: parse_input
- * ---------------------
- * Parses the input buffer and splits it into tokens (words)
- * 
- * input: The input string to parse
- * argv: Array to store pointers to each token
- * 
- * Returns: Number of tokens found, or -1 on error
- * 
- * How it works:
- * - Uses in-place tokenization (modifies input string)
- * - Replaces spaces and tabs with '\0' to separate tokens
- * - Stores pointer to each token in argv array
- * - Argv array ends with NULL pointer (required by execv)
- */
-int parse_input(char *input, char *argv[MAX_ARGS]) {
-    int argc = 0;  // Argument count
-    int in_token = 0;  // Flag: are we currently inside a token?
-    
-    // Iterate through each character in the input
-    for (int i = 0; input[i] != '\0'; i++) {
-        // Check if current character is a separator (space or tab)
-        if (input[i] == ' ' || input[i] == '\t') {
-            // Replace separator with null terminator
-            input[i] = '\0';
-            in_token = 0;  // We're no longer in a token
-        } else {
-            // We found a non-separator character
-            if (!in_token) {
-                // This is the start of a new token
-                if (argc >= MAX_ARGS - 1) {
-                    // Too many arguments - leave room for NULL terminator
-                    return -1;
-                }
-                argv[argc] = &input[i];  // Store pointer to start of token
-                argc++;
-                in_token = 1;  // We're now inside a token
-            }
-            // If already in_token, just continue to next character
-        }
-    }
-    
-    // Null-terminate the argv array (required by execv)
-    argv[argc] = NULL;
-    
-    return argc;
-}
-
-/*
- * Function: find_command
- * ----------------------
- * Searches for an executable command in HOME and /bin directories
- * 
- * command: The command name to search for
- * full_path: Buffer to store the full path if found
- * 
- * Returns: 1 if found, 0 if not found
- * 
- * Search order:
- * 1. $HOME/command_name
- * 2. /bin/command_name
- */
-int find_command(const char *command, char *full_path) {
-    // First, try searching in HOME directory
-    char *home = getenv("HOME");
-    if (home != NULL) {
-        // Build path: HOME + "/" + command
-        // Example: "/home/user" + "/" + "ls" = "/home/user/ls"
-        
-        // Copy HOME path
-        int i = 0;
-        while (home[i] != '\0' && i < MAX_PATH - 2) {
-            full_path[i] = home[i];
-            i++;
-        }
-        
-        // Add slash
-        if (i < MAX_PATH - 1) {
-            full_path[i++] = '/';
-        }
-        
-        // Add command name
-        int j = 0;
-        while (command[j] != '\0' && i < MAX_PATH - 1) {
-            full_path[i++] = command[j++];
-        }
-        
-        // Null-terminate
-        full_path[i] = '\0';
-        
-        // Check if file exists and is executable
-        // access(path, X_OK) returns 0 if file exists and is executable
-        if (access(full_path, X_OK) == 0) {
-            return 1;  // Found in HOME
-        }
-    }
-    
-    // Not found in HOME, try /bin directory
-    // Build path: "/bin/" + command
-    const char *bin_dir = "/bin/";
-    int i = 0;
-    
-    // Copy "/bin/"
-    while (bin_dir[i] != '\0' && i < MAX_PATH - 1) {
-        full_path[i] = bin_dir[i];
-        i++;
-    }
-    
-    // Add command name
-    int j = 0;
-    while (command[j] != '\0' && i < MAX_PATH - 1) {
-        full_path[i++] = command[j++];
-    }
-    
-    // Null-terminate
-    full_path[i] = '\0';
-    
-    // Check if file exists and is executable
-    if (access(full_path, X_OK) == 0) {
-        return 1;  // Found in /bin
-    }
-    
-    // Not found in either location
-    return 0;
-}
-
-/*
- * Function: int_to_string
- * -----------------------
- * Converts an integer to a string (helper for printing return codes)
- * 
- * num: The integer to convert
- * buffer: Buffer to store the resulting string
- *  
- * Returns: Pointer to the start of the string in buffer
- */
-char* int_to_string(int num, char *buffer) {
-    int i = 0;
-    int is_negative = 0;
-    
-    // Handle negative numbers
-    if (num < 0) {
-        is_negative = 1;
-        num = -num;
-    }
-    
-    // Handle zero specially
-    if (num == 0) {
-        buffer[i++] = '0';
-        buffer[i] = '\0';
-        return buffer;
-    }
-    
-    // Convert digits (in reverse order)
-    while (num > 0) {
-        buffer[i++] = '0' + (num % 10);
-        num /= 10;
-    }
-    
-    // Add negative sign if needed
-    if (is_negative) {
-        buffer[i++] = '-';
-    }
-    
-    // Null-terminate
-    buffer[i] = '\0';
-    
-    // Reverse the string
-    for (int j = 0; j < i / 2; j++) {
-        char temp = buffer[j];
-        buffer[j] = buffer[i - 1 - j];
-        buffer[i - 1 - j] = temp;
-    }
-    
-    return buffer;
-}
-
-/*
- * Main function - Entry point of the shell
- * 
- * Implements an infinite loop that:
- * 1. Displays a prompt
- * 2. Reads user input
- * 3. Parses the input
- * 4. Executes commands
- */
-int main(void) {
-    // Buffer to store user input - reused across iterations for efficiency
-    char input_buffer[BUFFER_SIZE];
-    
-    // Array to store command arguments (pointers to tokens)
-    // Format: ["command", "arg1", "arg2", ..., NULL]
-    char *argv[MAX_ARGS];
-    
-    // Buffer to store full path to executable
-    char full_path[MAX_PATH];
-
-    // Main shell loop - runs indefinitely until user types "exit"
-    while (1) {
-        // STEP 1: Display the prompt using write() system call
-        // write(fd, buffer, count) - writes 'count' bytes from 'buffer' to file descriptor 'fd'
-        // STDOUT_FILENO (1) is the standard output (screen)
-        // Returns: number of bytes written, or -1 on error
-        ssize_t bytes_written = write(STDOUT_FILENO, PROMPT, PROMPT_LEN);
-        
-        // Check if write() failed
-        if (bytes_written == -1) {
-            // perror() prints the system error message
-            perror("write");
-            exit(1);
-        }
-        
-        // STEP 2: Read user input using read() system call
-        // read(fd, buffer, count) - reads up to 'count' bytes into 'buffer' from file descriptor 'fd'
-        // STDIN_FILENO (0) is the standard input (keyboard)
-        // Returns: number of bytes read, 0 on EOF, or -1 on error
-        ssize_t bytes_read = read(STDIN_FILENO, input_buffer, BUFFER_SIZE - 1);
-        
-        // Check if read() failed
-        if (bytes_read == -1) {
-            perror("read");
-            exit(1);
-        }
-        
-        // Check if we got EOF (Ctrl+D) - exit gracefully
-        if (bytes_read == 0) {
-            write(STDOUT_FILENO, "\n", 1);  // Print newline for clean exit
-            break;
-        }
-        
-        // Remove the trailing newline character if present
-        // When user presses Enter, read() includes the '\n' character
-        if (bytes_read > 0 && input_buffer[bytes_read - 1] == '\n') {
-            bytes_read--;  // Reduce the count to exclude newline
-        }
-        
-        // Null-terminate the input string
-        // This converts the raw byte array into a proper C string
-        input_buffer[bytes_read] = '\0';
-        
-        // Handle empty input (user just pressed Enter)
-        if (input_buffer[0] == '\0') {
-            continue;  // Skip to next iteration - show prompt again
-        }
-
-        // STEP 3: Parse input into tokens
-        int argc = parse_input(input_buffer, argv);
-        
-        // Check if parsing failed (too many arguments)
-        if (argc == -1) {
-            write(STDOUT_FILENO, "Error: Too many arguments\n", 26);
-            continue;
-        }
-        
-        // Check if parsing resulted in no tokens (shouldn't happen after empty check)
-        if (argc == 0) {
-            continue;
-        }
-
-        // STEP 4: Check for internal (built-in) commands
-        
-        // Internal command: "exit"
-        // Exits the shell and terminates the program
-        if (strcmp(argv[0], "exit") == 0) {
-            break;  // Exit the while loop, which ends the program
-        }
-        
-        // Internal command: "cd"
-        // Changes the current working directory using chdir() system call
-        if (strcmp(argv[0], "cd") == 0) {
-            // Check if directory argument was provided
-            if (argc < 2) {
-                write(STDOUT_FILENO, "cd: missing argument\n", 21);
-                continue;
-            }
-            
-            // chdir() system call - changes current working directory
-            // Returns: 0 on success, -1 on error
-            if (chdir(argv[1]) == -1) {
-                // Failed to change directory - print error
-                perror("cd");
-            }
-            // If successful, chdir() silently changes directory
-            continue;  // Go to next iteration - don't try to execute externally
-        }
-        
-        // STEP 5: Search for external command
-        // If we reach here, it's not an internal command
-        
-        if (find_command(argv[0], full_path)) {
-            // STEP 6: Fork-Exec-Wait pattern
-            // Command found! Now execute it in a child process
-            
-            // fork() creates a child process
-            // Returns: PID of child in parent, 0 in child, -1 on error
-            pid_t pid = fork();
-            
-            if (pid == -1) {
-                // Fork failed - print error and continue shell
-                perror("fork");
-                continue;
-            } else if (pid == 0) {
-                // ===== CHILD PROCESS =====
-                // This code runs ONLY in the child process
-                
-                // execv() replaces the child process with the new program
-                // If successful, this function NEVER returns
-                // Parameters:
-                //   - full_path: path to executable
-                //   - argv: array of arguments (NULL-terminated)
-                execv(full_path, argv);
-                
-                // If we reach here, execv() failed
-                perror("execv");
-                exit(1);  // Child must exit (don't continue shell loop in child!)
-                
-            } else {
-                // ===== PARENT PROCESS =====
-                // This code runs ONLY in the parent process
-                // pid contains the child's process ID
-                
-                // wait() blocks parent until child process terminates
-                // Returns: PID of terminated child, or -1 on error
-                // Parameter: pointer to int where exit status is stored
-                int status;
-                pid_t waited_pid = wait(&status);
-                
-                if (waited_pid == -1) {
-                    perror("wait");
-                } else {
-                    // Child finished successfully
-                    // Extract exit code using WIFEXITED and WEXITSTATUS macros
-                    
-                    if (WIFEXITED(status)) {
-                        // Child exited normally
-                        int exit_code = WEXITSTATUS(status);
-                        
-                        // Print "Command completed with return code: X"
-                        write(STDOUT_FILENO, "Command completed with return code: ", 36);
-                        
-                        // Convert exit code to string and print it
-                        char code_str[12];  // Enough for 32-bit int
-                        int_to_string(exit_code, code_str);
-                        write(STDOUT_FILENO, code_str, strlen(code_str));
-                        write(STDOUT_FILENO, "\n", 1);
-                    } else {
-                        // Child terminated abnormally (signal, etc.)
-                        write(STDOUT_FILENO, "Command terminated abnormally\n", 30);
-                    }
-                }
-            }
-            
-        } else {
-            // Command not found in HOME or /bin
-            // Print error message: "[command]: Unknown Command"
-            write(STDOUT_FILENO, "[", 1);
-            write(STDOUT_FILENO, argv[0], strlen(argv[0]));
-            write(STDOUT_FILENO, "]: Unknown Command\n", 19);
-        }
-    }
-    
-    return 0;
-}
+/*
+ * mini_bash.c - A minimal shell implementation using system calls
+ *
+ * This program demonstrates process management and system call usage
+ * by implementing a simple command interpreter.
+ *
+ * Input (an interactive line, a -c string or a whole script file) is
+ * tokenized and parsed ONCE into a compact syntax tree, which the
+ * executor then walks. Loop bodies are never re-tokenized.
+     */
+
+#define _GNU_SOURCE     // For MAP_ANONYMOUS, setenv() and Linux-specific calls
+
+#include <unistd.h>     // For write(), read(), fork(), exec(), chdir(), access()
+#include <stdlib.h>     // For getenv(), exit(), malloc(), free()
+#include <string.h>     // For string manipulation functions
+#include <stdio.h>      // For perror()
+#include <stdint.h>     // For fixed-width integer types used by the syntax tree
+#include <fcntl.h>      // For open()
+#include <sys/types.h>  // For pid_t type
+#include <sys/wait.h>   // For wait() system call
+#include <sys/stat.h>   // For fstat()
+#include <sys/mman.h>   // For mmap()
+#include <sys/uio.h>    // For writev()
+#include <errno.h>      // For errno (EEXIST from mkdir())
+#include <dirent.h>     // For getdents64() and d_type (glob expansion)
+#include <signal.h>     // For sigprocmask() (fork server)
+#include <poll.h>       // For poll() (fork server)
+#include <sys/socket.h> // For socketpair(), sendmsg(), SCM_RIGHTS (fork server)
+#include <sys/un.h>     // For struct sockaddr_un (--metrics)
+#include <sys/signalfd.h>   // For signalfd() (fork server)
+#include <sys/syscall.h>    // For SYS_clone3, SYS_pidfd_open (process handles)
+#include <sys/epoll.h>      // For epoll_wait() (event loop)
+#include <sys/timerfd.h>    // For timerfd_create() (event loop)
+#include <termios.h>        // For tcsetpgrp(), tcgetattr() (job control)
+#include <sys/resource.h>   // For prlimit() (ulimit), setpriority() (nice)
+#include <sched.h>          // For sched_setaffinity(), SCHED_BATCH (taskset, chrt)
+#include <time.h>           // For clock_gettime() (completion records)
+#include <linux/perf_event.h>   // For perf_event_open() (perf stat prefix)
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h> // For the io_uring ABI (-o uring)
+#define HAVE_IO_URING 1
+#endif
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>        // For DTRACE_PROBEn() (USDT probes)
+#define HAVE_SDT 1
+#endif
+#endif
+
+// Constants
+#define PROMPT "mini-bash$ "
+#define PROMPT_LEN 11       // Length of "mini-bash$ " (10 chars + space)
+#define PROMPT2 "> "        // Prompt for continuation lines (open if/while/...)
+#define PROMPT2_LEN 2
+#define BUFFER_SIZE 1024    // Initial size of the input buffer
+#define MAX_PATH 512        // Maximum path length
+#define ARENA_SIZE (256UL * 1024 * 1024)  // Address space reserved per arena
+
+/*
+ * Static probes
+ * -------------
+ * With <sys/sdt.h> (systemtap-sdt-dev) the shell is built with USDT
+ * probes of provider "mini_bash", which bpftrace, perf probe or
+ * SystemTap can attach to in a running shell:
+ *
+ *   prompt(continuation)            a prompt was queued
+ *   read(length)                    a line (or a script) was read
+ *   parse(result, nodes)            parse_input() finished
+ *   resolve(name, path, found, argc)   find_command() looked a command up
+ *   fork(pid, path)                 a foreground command's child exists
+ *   exec_failed(path, errno)        execv() returned (fires in the child)
+ *   reap(pid, status, spawn_ns, run_ns)    a child was reaped
+ *
+ * A probe that nothing is attached to is a single nop. Without the
+ * header the probes compile to nothing but the evaluation of their
+ * arguments, which are all values the shell has at hand anyway.
+ */
+#ifdef HAVE_SDT
+#define PROBE1(name, a)             DTRACE_PROBE1(mini_bash, name, a)
+#define PROBE2(name, a, b)          DTRACE_PROBE2(mini_bash, name, a, b)
+#define PROBE4(name, a, b, c, d)    DTRACE_PROBE4(mini_bash, name, a, b, c, d)
+#else
+#define PROBE1(name, a)             ((void)(a))
+#define PROBE2(name, a, b)          ((void)(a), (void)(b))
+#define PROBE4(name, a, b, c, d)    ((void)(a), (void)(b), (void)(c), (void)(d))
+#endif
+
+/*
+ * Memory arenas
+ * -------------
+ * Expanded words and argv vectors are built in two bump-pointer arenas.
+ * Each arena is one large mmap() reservation: pages are only backed by
+ * memory once touched, so the arena never has to move (pointers into it
+ * stay valid) and allocation is a single addition.
+ *
+ * Memory is released in stack order: the executor remembers arena->top
+ * before a command and restores it afterwards.
+ *
+ * scratch: Bytes of expanded words (NUL-terminated strings)
+ * fields: char * vectors (argv arrays) pointing into scratch or the program
+ */
+typedef struct {
+    char *base;     // Start of the reserved region
+    size_t top;     // Bytes in use
+    size_t size;    // Bytes reserved
+} arena_t;
+
+arena_t scratch;
+arena_t fields;
+
+/*
+ * Function: arena_init
+ * --------------------
+ * Reserves address space for an arena
+ *
+ * mmap() with MAP_NORESERVE reserves 'size' bytes of virtual memory
+ * without committing physical memory or swap.
+ * Returns: Address of the mapping, or MAP_FAILED on error
+ */
+void arena_init(arena_t *arena, size_t size) {
+    arena->base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (arena->base == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    arena->top = 0;
+    arena->size = size;
+}
+
+/*
+ * Function: arena_overflow
+ * ------------------------
+ * Fatal error: an arena ran out of reserved space
+ */
+void arena_overflow(void) {
+    write(STDERR_FILENO, "mini_bash: out of memory\n", 25);
+    exit(1);
+}
+
+/*
+ * Function: arena_alloc
+ * ---------------------
+ * Allocates 'n' bytes, 8-byte aligned, from the top of the arena.
+ * arena_alloc(arena, 0) returns the aligned top without consuming it,
+ * which is where the next pointer pushed to 'fields' will land.
+ */
+void *arena_alloc(arena_t *arena, size_t n) {
+    size_t aligned = (arena->top + 7) & ~(size_t)7;
+    if (aligned + n > arena->size) {
+        arena_overflow();
+    }
+    arena->top = aligned + n;
+    return arena->base + aligned;
+}
+
+/*
+ * Function: arena_putc
+ * --------------------
+ * Appends one byte to the top of the arena (used to build strings)
+ */
+void arena_putc(arena_t *arena, char c) {
+    if (arena->top >= arena->size) {
+        arena_overflow();
+    }
+    arena->base[arena->top++] = c;
+}
+
+/*
+ * Function: push_field
+ * --------------------
+ * Appends a pointer to the argv vector being built on the 'fields' arena
+ */
+void push_field(char *field) {
+    *(char **)arena_alloc(&fields, sizeof(char *)) = field;
+}
+
+/*
+ * Tokens
+ * ------
+ * The lexer splits the input into words and operators.
+ * Reserved words (if, then, do, ...) are ordinary TOKEN_WORDs; the
+ * parser recognizes them only where a command may start.
+ */
+#define TOKEN_EOF     0
+#define TOKEN_WORD    1
+#define TOKEN_NEWLINE 2
+#define TOKEN_SEMI    3     // ;
+#define TOKEN_DSEMI   4     // ;;
+#define TOKEN_AND     5     // &&
+#define TOKEN_OR      6     // ||
+#define TOKEN_AMP     7     // &
+#define TOKEN_PIPE    8     // |
+#define TOKEN_LPAREN  9     // (
+#define TOKEN_RPAREN  10    // )
+#define TOKEN_REDIR   11    // < > >> << <<- <<< <& >& (type in lexer->redir_type)
+
+/*
+ * Redirection types
+ * -----------------
+ * [n]<file  [n]>file  [n]>>file  [n]<&m  [n]>&m  ([n]>&- closes n)
+ * [n]<<WORD here-document, [n]<<-WORD (leading tabs stripped),
+ * [n]<<<word here-string
+ */
+#define REDIR_IN            1
+#define REDIR_OUT           2
+#define REDIR_APPEND        3
+#define REDIR_DUP_IN        4
+#define REDIR_DUP_OUT       5
+#define REDIR_HEREDOC       6
+#define REDIR_HEREDOC_STRIP 7
+#define REDIR_HERESTRING    8
+
+#define MAX_PENDING_HEREDOCS 16     // Here-documents started on one line
+
+// Word flags, computed once by the lexer and stored with each word
+#define WORD_PLAIN  1       // No quotes, '\' or '$': used as-is, never copied
+#define WORD_ASSIGN 2       // NAME=value
+#define HEREDOC_LITERAL 4   // Redirection flag: quoted <<'EOF', body is not expanded
+#define WORD_GLOB   8       // Unquoted * ? [ or $: may need pathname expansion
+
+// parse_input() results
+#define PARSE_OK          0
+#define PARSE_SYNTAX     -2 // Unexpected token
+#define PARSE_INCOMPLETE -3 // Input ended inside a construct (more lines needed)
+
+struct program;
+
+/*
+ * Structure: lexer_t
+ * ------------------
+ * Tokenizer state. Like the original parse_input(), words are
+ * terminated in place by writing '\0' after them, so a word token is
+ * just a pointer into the text. When the character after a word is an
+ * operator (e.g. the ';' in "ls;pwd"), it is saved before being
+ * overwritten and read back from 'saved' on the next call.
+ *
+ * Here-document bodies start after the next newline, so "<<WORD"
+ * redirections are queued in 'heredocs' until that newline is lexed.
+ */
+typedef struct {
+    char *text;         // Text being tokenized (modified in place)
+    size_t pos;         // Next character to examine
+    size_t saved_pos;   // Position overwritten by '\0' (or (size_t)-1)
+    char saved;         // Character that was stored at saved_pos
+    int token;          // Current token (TOKEN_*)
+    char *word;         // Current word (TOKEN_WORD only)
+    int word_flags;     // WORD_* flags of the current word
+    int incomplete;     // Set if the text ended inside quotes or a here-document
+    int redir_type;     // REDIR_* (TOKEN_REDIR only)
+    int redir_fd;       // Explicit fd before the operator ("2>"), or -1
+    struct program *program;                // Receives here-document bodies
+    int heredocs[MAX_PENDING_HEREDOCS];     // Redirection indexes waiting for a body
+    int nheredocs;
+} lexer_t;
+
+/*
+ * Function: lexer_char
+ * --------------------
+ * Returns the original character at position i, looking through the
+ * '\0' the lexer may have written there
+ */
+char lexer_char(lexer_t *lexer, size_t i) {
+    return i == lexer->saved_pos ? lexer->saved : lexer->text[i];
+}
+
+/*
+ * Function: is_operator_char
+ * --------------------------
+ * Returns 1 if c ends an unquoted word
+ */
+int is_operator_char(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == ';' || c == '&' ||
+           c == '|' || c == '(' || c == ')' || c == '<' || c == '>' || c == '\0';
+}
+
+/*
+ * Function: is_name_char
+ * ----------------------
+ * Returns 1 if c may appear in a variable name (digits not first)
+ */
+int is_name_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') || c == '_';
+}
+
+/*
+ * Function: subst_end
+ * -------------------
+ * Finds the ')' that closes the command substitution starting with
+ * "$(" at s[i]. Quotes, escapes and nested parentheses inside are
+ * skipped, so $(echo ")") and $(a $(b)) work.
+ *
+ * Returns: Index of the closing ')', or 0 if the text ends first
+ */
+size_t subst_end(const char *s, size_t i) {
+    int depth = 0;
+    for (i += 1; s[i] != '\0'; i++) {
+        char c = s[i];
+        if (c == '(') {
+            depth++;
+        } else if (c == ')') {
+            if (--depth == 0) {
+                return i;
+            }
+        } else if (c == '\\' && s[i + 1] != '\0') {
+            i++;
+        } else if (c == '\'' || c == '"') {
+            // Skip a quoted string (inside "..." only \ escapes)
+            for (i++; s[i] != c && s[i] != '\0'; i++) {
+                if (c == '"' && s[i] == '\\' && s[i + 1] != '\0') {
+                    i++;
+                }
+            }
+            if (s[i] == '\0') {
+                return 0;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Function: lexer_scan_word
+ * -------------------------
+ * Scans one word starting at lexer->pos. Quoted text ('...' and "..."),
+ * backslash escapes and $(...) may contain operator characters; quotes
+ * are kept in the word and removed later by expand_word().
+ *
+ * (Inside a word, lexer->text is read directly: the only '\0' the lexer
+ * has written so far lies before the word.)
+ *
+ * Returns: 1 on success, 0 if the text ended inside quotes
+ */
+int lexer_scan_word(lexer_t *lexer) {
+    size_t start = lexer->pos;
+    size_t i = start;
+    int flags = WORD_PLAIN;
+
+    // NAME= at the start of a word marks an assignment
+    if (!(lexer_char(lexer, i) >= '0' && lexer_char(lexer, i) <= '9')) {
+        size_t j = i;
+        while (is_name_char(lexer_char(lexer, j))) {
+            j++;
+        }
+        if (j > i && lexer_char(lexer, j) == '=') {
+            flags |= WORD_ASSIGN;
+        }
+    }
+
+    while (!is_operator_char(lexer_char(lexer, i))) {
+        char c = lexer_char(lexer, i);
+        if (c == '\'') {
+            // Single quotes: everything up to the next ' is literal
+            i++;
+            while (lexer_char(lexer, i) != '\'') {
+                if (lexer_char(lexer, i) == '\0') {
+                    return 0;
+                }
+                i++;
+            }
+            flags &= ~WORD_PLAIN;
+        } else if (c == '"') {
+            // Double quotes: \" does not end the quoted text
+            i++;
+            while (lexer_char(lexer, i) != '"') {
+                if (lexer_char(lexer, i) == '\0') {
+                    return 0;
+                }
+                if (lexer_char(lexer, i) == '\\' && lexer_char(lexer, i + 1) != '\0') {
+                    i++;
+                } else if (lexer->text[i] == '$' && lexer->text[i + 1] == '(') {
+                    i = subst_end(lexer->text, i);  // "...$(cmd "x")..."
+                    if (i == 0) {
+                        return 0;
+                    }
+                }
+                i++;
+            }
+            flags &= ~WORD_PLAIN;
+        } else if (c == '\\') {
+            // Backslash: the next character is literal (even an operator)
+            if (lexer_char(lexer, i + 1) != '\0') {
+                i++;
+            }
+            flags &= ~WORD_PLAIN;
+        } else if (c == '$') {
+            if (lexer->text[i + 1] == '(') {
+                i = subst_end(lexer->text, i);  // $(...) may contain ; | ( ) and blanks
+                if (i == 0) {
+                    return 0;
+                }
+            }
+            flags &= ~WORD_PLAIN;
+            flags |= WORD_GLOB;  // $x may expand to a pattern
+        } else if (c == '*' || c == '?' || c == '[') {
+            flags |= WORD_GLOB;
+        }
+        i++;
+    }
+
+    // Terminate the word in place, saving the character we overwrite
+    if (lexer->text[i] != '\0') {
+        lexer->saved = lexer->text[i];
+        lexer->saved_pos = i;
+        lexer->text[i] = '\0';
+    }
+
+    lexer->word = &lexer->text[start];
+    lexer->word_flags = flags;
+    lexer->pos = i;
+    return 1;
+}
+
+void lexer_read_heredocs(lexer_t *lexer);
+
+/*
+ * Function: lexer_next
+ * --------------------
+ * Advances to the next token, storing it in lexer->token
+ *
+ * - Spaces, tabs and backslash-newline separate tokens
+ * - '#' at the start of a word begins a comment up to end of line
+ * - Digits right before '<' or '>' are the redirected fd ("2>err")
+ * - After a newline, bodies of pending here-documents are consumed
+ */
+void lexer_next(lexer_t *lexer) {
+    char c;
+
+    // Skip blanks, line continuations and comments
+    while (1) {
+        c = lexer_char(lexer, lexer->pos);
+        if (c == ' ' || c == '\t') {
+            lexer->pos++;
+        } else if (c == '\\' && lexer_char(lexer, lexer->pos + 1) == '\n') {
+            lexer->pos += 2;
+        } else if (c == '#') {
+            while (lexer_char(lexer, lexer->pos) != '\0' &&
+                   lexer_char(lexer, lexer->pos) != '\n') {
+                lexer->pos++;
+            }
+        } else {
+            break;
+        }
+    }
+
+    // "2>file": a number glued to a redirection operator is its fd
+    lexer->redir_fd = -1;
+    if (c >= '0' && c <= '9') {
+        size_t j = lexer->pos;
+        int fd = 0;
+        while (lexer_char(lexer, j) >= '0' && lexer_char(lexer, j) <= '9' && fd < 10000) {
+            fd = fd * 10 + (lexer_char(lexer, j) - '0');
+            j++;
+        }
+        if (lexer_char(lexer, j) == '<' || lexer_char(lexer, j) == '>') {
+            lexer->redir_fd = fd;
+            lexer->pos = j;
+            c = lexer_char(lexer, j);
+        }
+    }
+
+    char next = (c == '\0') ? '\0' : lexer_char(lexer, lexer->pos + 1);
+    char next2 = (next == '\0') ? '\0' : lexer_char(lexer, lexer->pos + 2);
+    size_t length = 1;  // Characters in the operator
+    switch (c) {
+        case '\0':
+            lexer->token = TOKEN_EOF;
+            return;
+        case '\n':
+            lexer->token = TOKEN_NEWLINE;
+            lexer->pos++;
+            if (lexer->nheredocs > 0) {
+                lexer_read_heredocs(lexer);
+            }
+            return;
+        case ';':
+            lexer->token = (next == ';') ? TOKEN_DSEMI : TOKEN_SEMI;
+            length = (next == ';') ? 2 : 1;
+            break;
+        case '&':
+            lexer->token = (next == '&') ? TOKEN_AND : TOKEN_AMP;
+            length = (next == '&') ? 2 : 1;
+            break;
+        case '|':
+            lexer->token = (next == '|') ? TOKEN_OR : TOKEN_PIPE;
+            length = (next == '|') ? 2 : 1;
+            break;
+        case '<':
+            lexer->token = TOKEN_REDIR;
+            if (next == '<' && next2 == '<') {
+                lexer->redir_type = REDIR_HERESTRING;
+                length = 3;
+            } else if (next == '<' && next2 == '-') {
+                lexer->redir_type = REDIR_HEREDOC_STRIP;
+                length = 3;
+            } else if (next == '<') {
+                lexer->redir_type = REDIR_HEREDOC;
+                length = 2;
+            } else if (next == '&') {
+                lexer->redir_type = REDIR_DUP_IN;
+                length = 2;
+            } else {
+                lexer->redir_type = REDIR_IN;
+            }
+            break;
+        case '>':
+            lexer->token = TOKEN_REDIR;
+            if (next == '>') {
+                lexer->redir_type = REDIR_APPEND;
+                length = 2;
+            } else if (next == '&') {
+                lexer->redir_type = REDIR_DUP_OUT;
+                length = 2;
+            } else {
+                lexer->redir_type = REDIR_OUT;
+            }
+            break;
+        case '(':
+            lexer->token = TOKEN_LPAREN;
+            break;
+        case ')':
+            lexer->token = TOKEN_RPAREN;
+            break;
+        default:
+            if (lexer_scan_word(lexer)) {
+                lexer->token = TOKEN_WORD;
+            } else {
+                lexer->token = TOKEN_EOF;
+                lexer->incomplete = 1;
+            }
+            return;
+    }
+
+    lexer->pos += length;
+}
+
+/*
+ * Syntax tree nodes
+ * -----------------
+ * NODE_SIMPLE     words = command words (assignments first)
+ * NODE_AND/OR     left && right, left || right
+ * NODE_NOT        ! left
+ * NODE_IF         if left; then right; else extra; fi  (elif = nested IF)
+ * NODE_WHILE      while/until left; do right; done    (flags: LOOP_UNTIL)
+ * NODE_FOR        for words[0] in words[1..]; do right; done
+ *                 (flags: FOR_ARGS when there is no "in" list)
+ * NODE_CASE       case words[0] in left...; esac  (left = first item)
+ * NODE_CASE_ITEM  patterns = words, body = right
+ * NODE_FUNCDEF    words[0]() right
+ * NODE_GROUP      { left; }
+ * NODE_BACKGROUND left &
+ *
+ * Statements of a list are chained through 'next' (and case items too),
+ * so long scripts are walked iteratively, not by recursion.
+ *
+ * Nodes refer to each other and to words by INDEX, never by pointer,
+ * and words are offsets into the program text. A compiled program is
+ * therefore position-independent.
+ */
+#define NODE_SIMPLE    1
+#define NODE_AND       2
+#define NODE_OR        3
+#define NODE_NOT       4
+#define NODE_IF        5
+#define NODE_WHILE     6
+#define NODE_FOR       7
+#define NODE_CASE      8
+#define NODE_CASE_ITEM 9
+#define NODE_FUNCDEF   10
+#define NODE_GROUP     11
+#define NODE_BACKGROUND 12
+
+#define LOOP_UNTIL 1        // NODE_WHILE flag: "until" loop
+#define FOR_ARGS   1        // NODE_FOR flag: iterate over "$@"
+
+typedef struct {
+    int32_t type;           // NODE_*
+    int32_t flags;
+    int32_t left;           // Child nodes, -1 when absent
+    int32_t right;
+    int32_t extra;
+    int32_t next;           // Next statement in the same list
+    int32_t word;           // First word (index into program->words)
+    int32_t nwords;         // Number of words
+    int32_t redir;          // First redirection (index into program->redirs)
+    int32_t nredirs;        // Number of redirections
+} node_t;
+
+typedef struct {
+    uint32_t offset;        // Offset of the word in program->text
+    uint32_t flags;         // WORD_* flags
+} word_t;
+
+/*
+ * Structure: redir_t
+ * ------------------
+ * One redirection of a command. The target (file name, fd number,
+ * here-document delimiter or here-string) is a word in the text. A
+ * here-document body is also left in place in the text: the lexer puts
+ * a '\0' where the delimiter line starts, so 'body' is a C string.
+ */
+typedef struct {
+    int32_t type;           // REDIR_*
+    int32_t fd;             // Descriptor being redirected
+    uint32_t offset;        // Target word (offset in program->text)
+    uint32_t flags;         // WORD_* flags of the target (not PLAIN = quoted delimiter)
+    uint32_t body;          // Here-document body (offset in program->text)
+    uint32_t reserved;
+} redir_t;
+
+/*
+ * Structure: program_t
+ * --------------------
+ * A compiled piece of shell code: the tokenized text plus the node and
+ * word tables. Programs are reference counted because function
+ * definitions keep pointing into the program that defined them.
+ */
+typedef struct program {
+    char *text;             // Source text, words NUL-terminated in place
+    size_t text_len;
+    node_t *nodes;
+    int nnodes;
+    int nodes_cap;
+    word_t *words;
+    int nwords;
+    int words_cap;
+    redir_t *redirs;
+    int nredirs;
+    int redirs_cap;
+    int root;               // First statement, -1 for an empty program
+    int refs;               // Number of owners (caller + defined functions)
+    void *map;              // Cache file mapping holding all of the above,
+    size_t map_len;         // or NULL if the tables are malloc()ed
+} program_t;
+
+/*
+ * Function: word_text
+ * -------------------
+ * Returns the NUL-terminated text of word w of program p
+ */
+char *word_text(program_t *p, int w) {
+    return p->text + p->words[w].offset;
+}
+
+/*
+ * Function: program_new
+ * ---------------------
+ * Creates an empty program that takes ownership of 'text'
+ *
+ * text: malloc()ed source, with text[len] == '\0'
+ */
+program_t *program_new(char *text, size_t len) {
+    program_t *p = malloc(sizeof(program_t));
+    if (p == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    memset(p, 0, sizeof(program_t));
+    p->text = text;
+    p->text_len = len;
+    p->root = -1;
+    p->refs = 1;
+    return p;
+}
+
+/*
+ * Function: program_release
+ * -------------------------
+ * Drops one reference; frees the program when nobody uses it any more
+ */
+void program_release(program_t *p) {
+    if (--p->refs > 0) {
+        return;
+    }
+    if (p->map != NULL) {
+        // Loaded from the script cache: one munmap() releases everything
+        munmap(p->map, p->map_len);
+        free(p);
+        return;
+    }
+    free(p->text);
+    free(p->nodes);
+    free(p->words);
+    free(p->redirs);
+    free(p);
+}
+
+/*
+ * Function: grow
+ * --------------
+ * Makes room for one more element in a malloc()ed table, doubling it
+ */
+void *grow(void *table, int count, int *cap, size_t elem_size) {
+    if (count < *cap) {
+        return table;
+    }
+    *cap = (*cap == 0) ? 64 : *cap * 2;
+    table = realloc(table, (size_t)*cap * elem_size);
+    if (table == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    return table;
+}
+
+/*
+ * Structure: parser_t
+ * -------------------
+ * Recursive-descent parser state
+ */
+typedef struct {
+    lexer_t lexer;
+    program_t *program;
+    int error;              // PARSE_OK, PARSE_SYNTAX or PARSE_INCOMPLETE
+} parser_t;
+
+/*
+ * Function: new_node
+ * ------------------
+ * Appends a node of the given type and returns its index
+ */
+int new_node(parser_t *parser, int type) {
+    program_t *p = parser->program;
+    p->nodes = grow(p->nodes, p->nnodes, &p->nodes_cap, sizeof(node_t));
+    node_t *node = &p->nodes[p->nnodes];
+    node->type = type;
+    node->flags = 0;
+    node->left = node->right = node->extra = node->next = -1;
+    node->word = p->nwords;
+    node->nwords = 0;
+    node->redir = 0;
+    node->nredirs = 0;
+    return p->nnodes++;
+}
+
+/*
+ * Function: add_word
+ * ------------------
+ * Appends the current word token to the word table of node n
+ * (a node's words are always contiguous) and advances the lexer
+ */
+void add_word(parser_t *parser, int n) {
+    program_t *p = parser->program;
+    p->words = grow(p->words, p->nwords, &p->words_cap, sizeof(word_t));
+    p->words[p->nwords].offset = (uint32_t)(parser->lexer.word - p->text);
+    p->words[p->nwords].flags = (uint32_t)parser->lexer.word_flags;
+    p->nwords++;
+    p->nodes[n].nwords++;
+    lexer_next(&parser->lexer);
+}
+
+/*
+ * Function: syntax_error
+ * ----------------------
+ * Records a parse error. Running out of input is reported as
+ * PARSE_INCOMPLETE so an interactive shell can read another line.
+ * Always returns -1 so callers can write "return syntax_error(parser);"
+ */
+int syntax_error(parser_t *parser) {
+    if (parser->error == PARSE_OK) {
+        parser->error = (parser->lexer.token == TOKEN_EOF) ? PARSE_INCOMPLETE : PARSE_SYNTAX;
+    }
+    return -1;
+}
+
+/*
+ * Function: at_reserved
+ * ---------------------
+ * Returns 1 if the current token is the (unquoted) reserved word 'word'
+ */
+int at_reserved(parser_t *parser, const char *word) {
+    return parser->lexer.token == TOKEN_WORD &&
+           (parser->lexer.word_flags & WORD_PLAIN) &&
+           strcmp(parser->lexer.word, word) == 0;
+}
+
+/*
+ * Function: expect_reserved
+ * -------------------------
+ * Consumes the reserved word 'word' or records a syntax error
+ * Returns: 1 on success, 0 on error
+ */
+int expect_reserved(parser_t *parser, const char *word) {
+    if (parser->error != PARSE_OK || !at_reserved(parser, word)) {
+        syntax_error(parser);
+        return 0;
+    }
+    lexer_next(&parser->lexer);
+    return 1;
+}
+
+/*
+ * Function: skip_newlines
+ * -----------------------
+ * Newlines are allowed (and ignored) after operators and reserved words
+ */
+void skip_newlines(parser_t *parser) {
+    while (parser->lexer.token == TOKEN_NEWLINE) {
+        lexer_next(&parser->lexer);
+    }
+}
+
+/*
+ * Function: at_list_end
+ * ---------------------
+ * Returns 1 if the current token closes a statement list
+ */
+int at_list_end(parser_t *parser) {
+    int token = parser->lexer.token;
+    return token == TOKEN_EOF || token == TOKEN_RPAREN || token == TOKEN_DSEMI ||
+           at_reserved(parser, "then") || at_reserved(parser, "elif") ||
+           at_reserved(parser, "else") || at_reserved(parser, "fi") ||
+           at_reserved(parser, "do") || at_reserved(parser, "done") ||
+           at_reserved(parser, "esac") || at_reserved(parser, "}");
+}
+
+/*
+ * Function: remove_quotes
+ * -----------------------
+ * Removes quotes and backslashes from a word in place
+ * (used for here-document delimiters: <<'EOF' ends at the line EOF)
+ */
+void remove_quotes(char *word) {
+    char *out = word;
+    char quote = '\0';
+    for (char *c = word; *c != '\0'; c++) {
+        if (quote != '\0' && *c == quote) {
+            quote = '\0';
+        } else if (quote == '\0' && (*c == '\'' || *c == '"')) {
+            quote = *c;
+        } else if (*c == '\\' && quote != '\'' && c[1] != '\0') {
+            *out++ = *++c;
+        } else {
+            *out++ = *c;
+        }
+    }
+    *out = '\0';
+}
+
+/*
+ * Function: lexer_read_heredocs
+ * -----------------------------
+ * Reads the bodies of the queued here-documents, which start right
+ * after the newline just lexed
+ *
+ * Each body stays where it is in the text: a '\0' is written at the
+ * start of its delimiter line, and the lexer continues after that line.
+ * Running out of text before a delimiter line makes the input
+ * incomplete (the interactive shell then reads more lines).
+ */
+void lexer_read_heredocs(lexer_t *lexer) {
+    char *text = lexer->text;
+    size_t line = lexer->pos;
+
+    for (int h = 0; h < lexer->nheredocs; h++) {
+        redir_t *r = &lexer->program->redirs[lexer->heredocs[h]];
+        const char *delimiter = text + r->offset;
+        size_t delimiter_len = strlen(delimiter);
+        r->body = (uint32_t)line;
+
+        while (1) {
+            // Find the line [start, end); <<- ignores leading tabs
+            size_t start = line;
+            if (r->type == REDIR_HEREDOC_STRIP) {
+                while (text[start] == '\t') {
+                    start++;
+                }
+            }
+            size_t end = start;
+            while (text[end] != '\0' && text[end] != '\n') {
+                end++;
+            }
+
+            if (end - start == delimiter_len && memcmp(text + start, delimiter, delimiter_len) == 0) {
+                text[line] = '\0';  // Terminates the body
+                line = (text[end] == '\n') ? end + 1 : end;
+                break;
+            }
+            if (text[end] == '\0') {
+                lexer->incomplete = 1;  // No delimiter line yet
+                lexer->nheredocs = 0;
+                lexer->pos = end;
+                lexer->token = TOKEN_EOF;
+                return;
+            }
+            line = end + 1;
+        }
+    }
+
+    lexer->nheredocs = 0;
+    lexer->pos = line;
+}
+
+/*
+ * Function: parse_redirect
+ * ------------------------
+ * Parses one redirection (operator + target word) and attaches it to
+ * node n. A node's redirections are always contiguous in the table.
+ *
+ * Returns: 1 on success, 0 on a syntax error
+ */
+int parse_redirect(parser_t *parser, int n) {
+    program_t *p = parser->program;
+    lexer_t *lexer = &parser->lexer;
+    int type = lexer->redir_type;
+    int fd = lexer->redir_fd;
+
+    if (fd == -1) {
+        // Input redirections default to stdin, output ones to stdout
+        fd = (type == REDIR_OUT || type == REDIR_APPEND || type == REDIR_DUP_OUT) ? 1 : 0;
+    }
+
+    lexer_next(lexer);
+    if (lexer->token != TOKEN_WORD) {
+        syntax_error(parser);
+        return 0;
+    }
+
+    p->redirs = grow(p->redirs, p->nredirs, &p->redirs_cap, sizeof(redir_t));
+    redir_t *r = &p->redirs[p->nredirs];
+    r->type = type;
+    r->fd = fd;
+    r->offset = (uint32_t)(lexer->word - p->text);
+    r->flags = (uint32_t)lexer->word_flags;
+    if (strpbrk(lexer->word, "'\"\\") != NULL) {
+        r->flags |= HEREDOC_LITERAL;
+    }
+    r->body = r->offset;
+    r->reserved = 0;
+
+    if (type == REDIR_HEREDOC || type == REDIR_HEREDOC_STRIP) {
+        // The body follows the next newline; queue it for the lexer
+        if (lexer->nheredocs == MAX_PENDING_HEREDOCS) {
+            syntax_error(parser);
+            return 0;
+        }
+        remove_quotes(lexer->word);
+        lexer->heredocs[lexer->nheredocs++] = p->nredirs;
+    }
+
+    if (p->nodes[n].nredirs == 0) {
+        p->nodes[n].redir = p->nredirs;
+    }
+    p->nodes[n].nredirs++;
+    p->nredirs++;
+
+    lexer_next(lexer);
+    return 1;
+}
+
+int parse_list(parser_t *parser);
+int parse_command(parser_t *parser);
+
+/*
+ * Function: parse_if
+ * ------------------
+ * if LIST then LIST [elif LIST then LIST]... [else LIST] fi
+ * "elif" is parsed as an IF node in the else slot of the previous one.
+ */
+int parse_if(parser_t *parser) {
+    int n = new_node(parser, NODE_IF);
+    lexer_next(&parser->lexer);  // "if" or "elif"
+
+    int cond = parse_list(parser);
+    if (cond == -1) {
+        return syntax_error(parser);  // "if then" - empty condition
+    }
+    if (!expect_reserved(parser, "then")) {
+        return -1;
+    }
+    int then_part = parse_list(parser);
+    int else_part = -1;
+
+    if (at_reserved(parser, "elif")) {
+        else_part = parse_if(parser);  // Consumes the closing "fi"
+        if (else_part == -1) {
+            return -1;
+        }
+    } else {
+        if (at_reserved(parser, "else")) {
+            lexer_next(&parser->lexer);
+            else_part = parse_list(parser);
+        }
+        if (!expect_reserved(parser, "fi")) {
+            return -1;
+        }
+    }
+
+    if (parser->error != PARSE_OK) {
+        return -1;
+    }
+    node_t *node = &parser->program->nodes[n];
+    node->left = cond;
+    node->right = then_part;
+    node->extra = else_part;
+    return n;
+}
+
+/*
+ * Function: parse_do_group
+ * ------------------------
+ * do LIST done
+ * Returns: The body (may be -1 for an empty body), -2 on error
+ */
+int parse_do_group(parser_t *parser) {
+    skip_newlines(parser);
+    if (!expect_reserved(parser, "do")) {
+        return -2;
+    }
+    int body = parse_list(parser);
+    if (!expect_reserved(parser, "done")) {
+        return -2;
+    }
+    return body;
+}
+
+/*
+ * Function: parse_while
+ * ---------------------
+ * while LIST do LIST done   /   until LIST do LIST done
+ */
+int parse_while(parser_t *parser) {
+    int n = new_node(parser, NODE_WHILE);
+    if (at_reserved(parser, "until")) {
+        parser->program->nodes[n].flags = LOOP_UNTIL;
+    }
+    lexer_next(&parser->lexer);
+
+    int cond = parse_list(parser);
+    if (cond == -1) {
+        return syntax_error(parser);  // "while do" - empty condition
+    }
+    int body = parse_do_group(parser);
+    if (body == -2) {
+        return -1;
+    }
+    parser->program->nodes[n].left = cond;
+    parser->program->nodes[n].right = body;
+    return n;
+}
+
+/*
+ * Function: parse_for
+ * -------------------
+ * for NAME [in WORD...] ; do LIST done
+ */
+int parse_for(parser_t *parser) {
+    int n = new_node(parser, NODE_FOR);
+    lexer_next(&parser->lexer);  // "for"
+
+    if (parser->lexer.token != TOKEN_WORD) {
+        return syntax_error(parser);
+    }
+    add_word(parser, n);  // Loop variable
+    skip_newlines(parser);
+
+    if (at_reserved(parser, "in")) {
+        lexer_next(&parser->lexer);
+        while (parser->lexer.token == TOKEN_WORD) {
+            add_word(parser, n);
+        }
+        // The word list ends with ';' or a newline
+        if (parser->lexer.token != TOKEN_SEMI && parser->lexer.token != TOKEN_NEWLINE) {
+            return syntax_error(parser);
+        }
+        lexer_next(&parser->lexer);
+    } else {
+        parser->program->nodes[n].flags = FOR_ARGS;
+        if (parser->lexer.token == TOKEN_SEMI) {
+            lexer_next(&parser->lexer);
+        }
+    }
+
+    int body = parse_do_group(parser);
+    if (body == -2) {
+        return -1;
+    }
+    parser->program->nodes[n].right = body;
+    return n;
+}
+
+/*
+ * Function: parse_case
+ * --------------------
+ * case WORD in [(]PATTERN[|PATTERN]...) LIST ;; ... esac
+ */
+int parse_case(parser_t *parser) {
+    int n = new_node(parser, NODE_CASE);
+    lexer_next(&parser->lexer);  // "case"
+
+    if (parser->lexer.token != TOKEN_WORD) {
+        return syntax_error(parser);
+    }
+    add_word(parser, n);  // Subject
+    skip_newlines(parser);
+    if (!expect_reserved(parser, "in")) {
+        return -1;
+    }
+    skip_newlines(parser);
+
+    int last_item = -1;
+    while (!at_reserved(parser, "esac")) {
+        int item = new_node(parser, NODE_CASE_ITEM);
+
+        if (parser->lexer.token == TOKEN_LPAREN) {
+            lexer_next(&parser->lexer);
+        }
+        // Pattern list: WORD [| WORD]...
+        while (1) {
+            if (parser->lexer.token != TOKEN_WORD) {
+                return syntax_error(parser);
+            }
+            add_word(parser, item);
+            if (parser->lexer.token != TOKEN_PIPE) {
+                break;
+            }
+            lexer_next(&parser->lexer);
+        }
+        if (parser->lexer.token != TOKEN_RPAREN) {
+            return syntax_error(parser);
+        }
+        lexer_next(&parser->lexer);
+
+        parser->program->nodes[item].right = parse_list(parser);
+        if (parser->error != PARSE_OK) {
+            return -1;
+        }
+
+        // Link the item into the list of items
+        if (last_item == -1) {
+            parser->program->nodes[n].left = item;
+        } else {
+            parser->program->nodes[last_item].next = item;
+        }
+        last_item = item;
+
+        // ";;" separates items; it may be omitted before "esac"
+        if (parser->lexer.token == TOKEN_DSEMI) {
+            lexer_next(&parser->lexer);
+            skip_newlines(parser);
+        } else if (!at_reserved(parser, "esac")) {
+            return syntax_error(parser);
+        }
+    }
+    lexer_next(&parser->lexer);  // "esac"
+    return n;
+}
+
+/*
+ * Function: parse_simple
+ * ----------------------
+ * WORD... or a function definition NAME ( ) COMMAND
+ */
+int parse_simple(parser_t *parser) {
+    int n = new_node(parser, NODE_SIMPLE);
+
+    // Redirections may come before the command name ("<in cat")
+    while (parser->lexer.token == TOKEN_REDIR) {
+        if (!parse_redirect(parser, n)) {
+            return -1;
+        }
+    }
+    if (parser->lexer.token != TOKEN_WORD) {
+        if (parser->program->nodes[n].nredirs == 0) {
+            return syntax_error(parser);
+        }
+        return n;
+    }
+    add_word(parser, n);
+
+    // NAME() { ... } - function definition
+    if (parser->lexer.token == TOKEN_LPAREN && parser->program->nodes[n].nredirs == 0) {
+        lexer_next(&parser->lexer);
+        if (parser->lexer.token != TOKEN_RPAREN) {
+            return syntax_error(parser);
+        }
+        lexer_next(&parser->lexer);
+        skip_newlines(parser);
+
+        int body = parse_command(parser);
+        if (body == -1) {
+            return syntax_error(parser);
+        }
+        parser->program->nodes[n].type = NODE_FUNCDEF;
+        parser->program->nodes[n].right = body;
+        return n;
+    }
+
+    while (parser->lexer.token == TOKEN_WORD || parser->lexer.token == TOKEN_REDIR) {
+        if (parser->lexer.token == TOKEN_WORD) {
+            add_word(parser, n);
+        } else if (!parse_redirect(parser, n)) {
+            return -1;
+        }
+    }
+    return n;
+}
+
+/*
+ * Function: parse_compound
+ * ------------------------
+ * A compound command (if, while, until, for, case, { }), or
+ * NOT_COMPOUND if the current word does not start one (0 is a valid
+ * node: the first statement of the input)
+ */
+#define NOT_COMPOUND -2
+
+int parse_compound(parser_t *parser) {
+    if (at_reserved(parser, "if")) {
+        return parse_if(parser);
+    }
+    if (at_reserved(parser, "while") || at_reserved(parser, "until")) {
+        return parse_while(parser);
+    }
+    if (at_reserved(parser, "for")) {
+        return parse_for(parser);
+    }
+    if (at_reserved(parser, "case")) {
+        return parse_case(parser);
+    }
+    if (at_reserved(parser, "{")) {
+        int n = new_node(parser, NODE_GROUP);
+        lexer_next(&parser->lexer);
+        int body = parse_list(parser);
+        if (body == -1) {
+            return syntax_error(parser);  // "{ }" - empty group
+        }
+        if (!expect_reserved(parser, "}")) {
+            return -1;
+        }
+        parser->program->nodes[n].left = body;
+        return n;
+    }
+    return NOT_COMPOUND;
+}
+
+/*
+ * Function: parse_command
+ * -----------------------
+ * A compound command with optional trailing redirections
+ * ("while ...; done <file"), or a simple command
+ */
+int parse_command(parser_t *parser) {
+    if (parser->lexer.token == TOKEN_REDIR) {
+        return parse_simple(parser);
+    }
+    if (parser->lexer.token != TOKEN_WORD) {
+        return syntax_error(parser);
+    }
+
+    int n = parse_compound(parser);
+    if (n == NOT_COMPOUND) {
+        return parse_simple(parser);
+    }
+    if (n == -1) {
+        return -1;
+    }
+    while (parser->lexer.token == TOKEN_REDIR) {
+        if (!parse_redirect(parser, n)) {
+            return -1;
+        }
+    }
+    return n;
+}
+
+/*
+ * Function: parse_pipeline
+ * ------------------------
+ * [!] COMMAND
+ */
+int parse_pipeline(parser_t *parser) {
+    if (at_reserved(parser, "!")) {
+        int n = new_node(parser, NODE_NOT);
+        lexer_next(&parser->lexer);
+        int command = parse_command(parser);
+        if (command == -1) {
+            return -1;
+        }
+        parser->program->nodes[n].left = command;
+        return n;
+    }
+    return parse_command(parser);
+}
+
+/*
+ * Function: parse_and_or
+ * ----------------------
+ * PIPELINE [(&& | ||) PIPELINE]...  (left-associative)
+ */
+int parse_and_or(parser_t *parser) {
+    int left = parse_pipeline(parser);
+
+    while (left != -1 && (parser->lexer.token == TOKEN_AND || parser->lexer.token == TOKEN_OR)) {
+        int n = new_node(parser, parser->lexer.token == TOKEN_AND ? NODE_AND : NODE_OR);
+        lexer_next(&parser->lexer);
+        skip_newlines(parser);  // "a &&<newline> b" continues the list
+
+        int right = parse_pipeline(parser);
+        if (right == -1) {
+            return -1;
+        }
+        parser->program->nodes[n].left = left;
+        parser->program->nodes[n].right = right;
+        left = n;
+    }
+    return left;
+}
+
+/*
+ * Function: parse_list
+ * --------------------
+ * AND_OR [(; | & | newline) AND_OR]...
+ * Stops at a token that closes the list (then, fi, done, ...).
+ * A statement ended by '&' is wrapped in a NODE_BACKGROUND.
+ *
+ * Returns: First statement (linked through 'next'), or -1 if the list
+ *          is empty or an error occurred
+ */
+int parse_list(parser_t *parser) {
+    int first = -1;
+    int last = -1;
+
+    skip_newlines(parser);
+    while (parser->error == PARSE_OK && !at_list_end(parser)) {
+        int n = parse_and_or(parser);
+        if (n == -1) {
+            return -1;
+        }
+        if (parser->lexer.token == TOKEN_AMP) {
+            int background = new_node(parser, NODE_BACKGROUND);
+            parser->program->nodes[background].left = n;
+            n = background;
+        }
+        if (first == -1) {
+            first = n;
+        } else {
+            parser->program->nodes[last].next = n;
+        }
+        last = n;
+
+        // A statement ends at ';', '&', a newline, or the end of the list
+        if (parser->lexer.token == TOKEN_SEMI || parser->lexer.token == TOKEN_AMP ||
+            parser->lexer.token == TOKEN_NEWLINE) {
+            lexer_next(&parser->lexer);
+            skip_newlines(parser);
+        } else if (!at_list_end(parser)) {
+            syntax_error(parser);  // e.g. "ls )" or "ls | wc"
+            return -1;
+        }
+    }
+    return first;
+}
+
+/*
+ * Function: parse_input
+ * ---------------------
+ * Tokenizes and parses a whole input buffer (a line, a -c string or a
+ * script file) into the program's syntax tree
+ *
+ * program: Program whose text is parsed; nodes and words are appended
+ *          and program->root is set to the first statement
+ *
+ * Returns: PARSE_OK, PARSE_SYNTAX, or PARSE_INCOMPLETE when the text
+ *          ends inside a quote or compound command
+ *
+ * How it works:
+ * - Uses in-place tokenization (modifies the program text)
+ * - Replaces the character after each word with '\0'
+ * - Words are recorded as offsets into the text (zero-copy), nodes as
+ *   indexes into the node table
+ */
+int parse_input(program_t *program) {
+    parser_t parser;
+    parser.program = program;
+    parser.error = PARSE_OK;
+    parser.lexer.text = program->text;
+    parser.lexer.pos = 0;
+    parser.lexer.saved_pos = (size_t)-1;
+    parser.lexer.saved = '\0';
+    parser.lexer.incomplete = 0;
+    parser.lexer.program = program;
+    parser.lexer.nheredocs = 0;
+    lexer_next(&parser.lexer);
+
+    program->root = parse_list(&parser);
+    if (parser.lexer.nheredocs > 0) {
+        parser.lexer.incomplete = 1;  // "cat <<EOF" on the last line
+    }
+
+    // Anything left over (e.g. a stray "fi" or ")") is an error
+    if (parser.error == PARSE_OK && parser.lexer.token != TOKEN_EOF) {
+        syntax_error(&parser);
+    }
+    if (parser.lexer.incomplete) {
+        return PARSE_INCOMPLETE;
+    }
+    return parser.error;
+}
+
+/*
+ * Function: find_command
+ * ----------------------
+ * Searches for an executable command in HOME and /bin directories
+ * 
+ * command: The command name to search for
+ * full_path: Buffer to store the full path if found
+ * 
+ * Returns: 1 if found, 0 if not found
+ * 
+ * Search order:
+ * 1. $HOME/command_name
+ * 2. /bin/command_name
+ */
+int find_command(const char *command, char *full_path) {
+    // First, try searching in HOME directory
+    char *home = getenv("HOME");
+    if (home != NULL) {
+        // Build path: HOME + "/" + command
+        // Example: "/home/user" + "/" + "ls" = "/home/user/ls"
+        
+        // Copy HOME path
+        int i = 0;
+        while (home[i] != '\0' && i < MAX_PATH - 2) {
+            full_path[i] = home[i];
+            i++;
+        }
+        
+        // Add slash
+        if (i < MAX_PATH - 1) {
+            full_path[i++] = '/';
+        }
+        
+        // Add command name
+        int j = 0;
+        while (command[j] != '\0' && i < MAX_PATH - 1) {
+            full_path[i++] = command[j++];
+        }
+        
+        // Null-terminate
+        full_path[i] = '\0';
+        
+        // Check if file exists and is executable
+        // access(path, X_OK) returns 0 if file exists and is executable
+        if (access(full_path, X_OK) == 0) {
+            return 1;  // Found in HOME
+        }
+    }
+    
+    // Not found in HOME, try /bin directory
+    // Build path: "/bin/" + command
+    const char *bin_dir = "/bin/";
+    int i = 0;
+    
+    // Copy "/bin/"
+    while (bin_dir[i] != '\0' && i < MAX_PATH - 1) {
+        full_path[i] = bin_dir[i];
+        i++;
+    }
+    
+    // Add command name
+    int j = 0;
+    while (command[j] != '\0' && i < MAX_PATH - 1) {
+        full_path[i++] = command[j++];
+    }
+    
+    // Null-terminate
+    full_path[i] = '\0';
+    
+    // Check if file exists and is executable
+    if (access(full_path, X_OK) == 0) {
+        return 1;  // Found in /bin
+    }
+    
+    // Not found in either location
+    return 0;
+}
+
+/*
+ * Function: int_to_string
+ * -----------------------
+ * Converts an integer to a string (helper for printing return codes)
+ * 
+ * num: The integer to convert
+ * buffer: Buffer to store the resulting string
+ *  
+ * Returns: Pointer to the start of the string in buffer
+ */
+char* int_to_string(int num, char *buffer) {
+    int i = 0;
+    int is_negative = 0;
+    
+    // Handle negative numbers
+    if (num < 0) {
+        is_negative = 1;
+        num = -num;
+    }
+    
+    // Handle zero specially
+    if (num == 0) {
+        buffer[i++] = '0';
+        buffer[i] = '\0';
+        return buffer;
+    }
+    
+    // Convert digits (in reverse order)
+    while (num > 0) {
+        buffer[i++] = '0' + (num % 10);
+        num /= 10;
+    }
+    
+    // Add negative sign if needed
+    if (is_negative) {
+        buffer[i++] = '-';
+    }
+    
+    // Null-terminate
+    buffer[i] = '\0';
+    
+    // Reverse the string
+    for (int j = 0; j < i / 2; j++) {
+        char temp = buffer[j];
+        buffer[j] = buffer[i - 1 - j];
+        buffer[i - 1 - j] = temp;
+    }
+    
+    return buffer;
+}
+
+/*
+ * Function: fd_high
+ * -----------------
+ * Moves an fd the shell opened for itself to SHELL_FD_MIN or above
+ * (close-on-exec), so that fds 3-9 stay free for scripts ("exec 3>log"),
+ * as in bash. Fixed internal fds (100 and up) are placed directly.
+ *
+ * Returns: The new fd, or 'fd' itself if it is already high or cannot
+ *          be moved (-1 stays -1)
+ */
+#define SHELL_FD_MIN 10     // Lowest fd the shell uses for itself
+
+int fd_high(int fd) {
+    if (fd == -1 || fd >= SHELL_FD_MIN) {
+        return fd;
+    }
+    int high = fcntl(fd, F_DUPFD_CLOEXEC, SHELL_FD_MIN);
+    if (high == -1) {
+        return fd;
+    }
+    close(fd);
+    return high;
+}
+
+
+/*
+ * Shell state shared by the executor
+ * ----------------------------------
+ * last_status: Exit status of the most recently executed command ($?)
+ * exit_requested: Set by the "exit" built-in to stop the shell
+ * loop_depth: Number of loops currently executing
+ * loop_break / loop_continue: Pending "break N" / "continue N" levels
+ * script_name: Value of $0
+ */
+int last_status = 0;
+int exit_requested = 0;
+int loop_depth = 0;
+int loop_break = 0;
+int loop_continue = 0;
+char *script_name = "mini_bash";
+int report_completion = 1;  // Print "Command completed..." (off inside $(...))
+int parse_error_fd = STDOUT_FILENO; // Syntax errors; stderr inside $(...), whose stdout is captured
+pid_t last_background_pid = -1;    // $!: pid of the last "cmd &"
+pid_t shell_pid = 0;        // $$: the shell's pid, also inside $(...) and & children
+int shell_interactive = 0;  // Reading commands from a terminal (run_interactive())
+int subst_status = -1;      // Status of the last $(...) in this command
+int zygote_fd = -1;         // Socket to the fork server, or -1 (see zygote_spawn())
+pid_t zygote_pid = -1;      // The fork server process
+int shell_generation = 0;   // Bumped when the working directory or the shell's fds change
+int redirections_active = 0;    // Redirections currently applied to the shell itself
+int redirect_persist = 0;   // Set by "exec" without a command: keep them
+int tail_position = 0;      // The next statement is the last thing this process does
+
+/*
+ * Shell options
+ * -------------
+ * Set with "-o NAME" on the command line (mini_bash -o zygote ...).
+ */
+int option_zygote = 0;      // Spawn external commands through a fork server
+int option_standby = 0;     // Interactive: fork the next child while waiting for input
+int option_uring = 0;       // Batch prompt/report writes and reads with io_uring
+int option_cgroup = 0;      // Run each command in a cgroup v2 leaf of its own
+int option_batch = 0;       // Pin background jobs round-robin to $BATCH_CPUS
+int records_fd = -1;        // --records FILE / --records-fd N: JSON lines go here
+
+typedef struct {
+    const char *name;
+    int *value;
+} option_t;
+
+option_t options[] = {
+    {"zygote", &option_zygote},
+    {"standby", &option_standby},
+    {"uring", &option_uring},
+    {"cgroup", &option_cgroup},
+    {"batch", &option_batch},
+    {NULL, NULL}
+};
+
+/*
+ * Function: option_set
+ * --------------------
+ * Turns on the option called 'name'
+ *
+ * Returns: 1 on success, 0 if there is no such option
+ */
+int option_set(const char *name) {
+    for (option_t *o = options; o->name != NULL; o++) {
+        if (strcmp(o->name, name) == 0) {
+            *o->value = 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Shell variables
+ * ---------------
+ * Stored as "NAME=value" strings in a growable array. Lookups fall back
+ * to the environment, so $HOME and $PATH work without being copied in.
+ */
+char **variables = NULL;
+int nvariables = 0;
+int variables_cap = 0;
+
+/*
+ * Function: var_find
+ * ------------------
+ * Returns the index of variable 'name' (length 'len', not necessarily
+ * NUL-terminated), or -1 if it is not set
+ */
+int var_find(const char *name, size_t len) {
+    for (int i = 0; i < nvariables; i++) {
+        if (strncmp(variables[i], name, len) == 0 && variables[i][len] == '=') {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Function: var_get
+ * -----------------
+ * Returns the value of variable 'name', or NULL if it is not set
+ */
+const char *var_get(const char *name, size_t len) {
+    int i = var_find(name, len);
+    if (i != -1) {
+        return variables[i] + len + 1;
+    }
+
+    // Not a shell variable - try the environment (getenv needs a C string)
+    char buffer[MAX_PATH];
+    if (len >= sizeof(buffer)) {
+        return NULL;
+    }
+    memcpy(buffer, name, len);
+    buffer[len] = '\0';
+    return getenv(buffer);
+}
+
+/*
+ * Function: var_set
+ * -----------------
+ * Sets variable 'name' (length 'len') to 'value'
+ */
+void var_set(const char *name, size_t len, const char *value) {
+    size_t value_len = strlen(value);
+    char *entry = malloc(len + 1 + value_len + 1);
+    if (entry == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(entry, name, len);
+    entry[len] = '=';
+    memcpy(entry + len + 1, value, value_len + 1);
+
+    int i = var_find(name, len);
+    if (i != -1) {
+        free(variables[i]);
+        variables[i] = entry;
+        return;
+    }
+    variables = grow(variables, nvariables, &variables_cap, sizeof(char *));
+    variables[nvariables++] = entry;
+}
+
+/*
+ * Function: fnv1a
+ * ---------------
+ * FNV-1a hash of 'len' bytes, continuing from 'hash'
+ * (start with FNV_OFFSET). Used by the function table and the cache.
+ */
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+uint64_t fnv1a(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+/*
+ * Shell functions
+ * ---------------
+ * A function is a name plus the body node inside the program that
+ * defined it. The function holds a reference to that program.
+ *
+ * Functions live in an open-addressing hash table (linear probing,
+ * power-of-two size, at most 3/4 full), so looking a command name up
+ * costs one hash and usually one string compare, however many helper
+ * functions a script defines.
+ */
+typedef struct {
+    const char *name;       // Points into program->text (NULL = empty slot)
+    uint64_t hash;          // fnv1a(name), kept for probing and rehashing
+    program_t *program;
+    int body;
+} function_t;
+
+function_t *functions = NULL;
+size_t functions_cap = 0;   // Number of slots (power of two)
+size_t nfunctions = 0;      // Number of used slots
+
+/*
+ * Function: function_slot
+ * -----------------------
+ * Returns the slot holding 'name', or the empty slot where it belongs
+ */
+function_t *function_slot(function_t *table, size_t cap, const char *name, uint64_t hash) {
+    size_t i = (size_t)hash & (cap - 1);
+    while (table[i].name != NULL &&
+           (table[i].hash != hash || strcmp(table[i].name, name) != 0)) {
+        i = (i + 1) & (cap - 1);
+    }
+    return &table[i];
+}
+
+/*
+ * Function: function_find
+ * -----------------------
+ * Returns the function called 'name', or NULL
+ */
+function_t *function_find(const char *name) {
+    if (nfunctions == 0) {
+        return NULL;
+    }
+    function_t *f = function_slot(functions, functions_cap, name,
+                                  fnv1a(FNV_OFFSET, name, strlen(name)));
+    return f->name != NULL ? f : NULL;
+}
+
+/*
+ * Function: function_define
+ * -------------------------
+ * Defines (or redefines) a function from a NODE_FUNCDEF node
+ */
+void function_define(program_t *p, int n) {
+    const char *name = word_text(p, p->nodes[n].word);
+    uint64_t hash = fnv1a(FNV_OFFSET, name, strlen(name));
+
+    // Keep the table at most 3/4 full: double it and re-insert
+    if ((nfunctions + 1) * 4 > functions_cap * 3) {
+        size_t cap = (functions_cap == 0) ? 64 : functions_cap * 2;
+        function_t *table = calloc(cap, sizeof(function_t));
+        if (table == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        for (size_t i = 0; i < functions_cap; i++) {
+            if (functions[i].name != NULL) {
+                *function_slot(table, cap, functions[i].name, functions[i].hash) = functions[i];
+            }
+        }
+        free(functions);
+        functions = table;
+        functions_cap = cap;
+    }
+
+    function_t *f = function_slot(functions, functions_cap, name, hash);
+    p->refs++;  // The function keeps the program (and its text) alive
+    if (f->name != NULL) {
+        program_release(f->program);
+    } else {
+        nfunctions++;
+    }
+    f->name = name;
+    f->hash = hash;
+    f->program = p;
+    f->body = p->nodes[n].right;
+}
+
+/*
+ * Positional parameters
+ * ---------------------
+ * $1..$N, $# and $@ come from the innermost frame. Calling a function
+ * pushes a frame whose params point straight at the caller's argv
+ * (argv[1..argc-1]), which stays alive in the 'fields' arena until the
+ * call returns, so binding arguments copies nothing. Frame 0 holds the
+ * script's own arguments.
+ */
+#define MAX_FRAMES 1000     // Maximum function call depth
+
+typedef struct {
+    char **params;          // $1 is params[0]
+    int nparams;            // $#
+} frame_t;
+
+frame_t frames[MAX_FRAMES];
+int frame_depth = 0;        // Index of the innermost frame
+int function_return = 0;    // Set by "return" to unwind the current function
+
+/*
+ * Function: append_string
+ * -----------------------
+ * Appends a C string to the field being built on the scratch arena
+ */
+void append_string(const char *s) {
+    while (*s != '\0') {
+        arena_putc(&scratch, *s++);
+    }
+}
+
+/*
+ * Function: expand_parameter
+ * --------------------------
+ * Looks up the parameter that follows a '$'
+ *
+ * s: Text just after the '$' ("?", "name", "{name}", ...)
+ * consumed: Receives the number of characters used from s
+ * number: Scratch buffer for numeric values ($?, $$)
+ *
+ * Returns: The value ("" if unset), or NULL if s does not start a
+ *          parameter (the '$' is then literal, e.g. "$ " or "a$")
+ */
+const char *expand_parameter(const char *s, size_t *consumed, char *number) {
+    if (s[0] == '?') {
+        *consumed = 1;
+        return int_to_string(last_status, number);
+    }
+    if (s[0] == '$') {
+        *consumed = 1;
+        return int_to_string((int)shell_pid, number);
+    }
+    if (s[0] == '!') {
+        *consumed = 1;
+        return (last_background_pid == -1) ? "" : int_to_string((int)last_background_pid, number);
+    }
+    if (s[0] == '0') {
+        *consumed = 1;
+        return script_name;
+    }
+    if (s[0] == '#') {
+        *consumed = 1;
+        return int_to_string(frames[frame_depth].nparams, number);
+    }
+
+    // $1..$9 and ${10}...
+    size_t start = (s[0] == '{') ? 1 : 0;
+    if (s[start] >= '1' && s[start] <= '9') {
+        int index = s[start] - '0';
+        size_t len = 1;
+        while (start == 1 && s[1 + len] >= '0' && s[1 + len] <= '9') {
+            index = index * 10 + (s[1 + len] - '0');
+            len++;
+        }
+        if (start == 1 && s[1 + len] != '}') {
+            return NULL;
+        }
+        *consumed = (start == 1) ? len + 2 : 1;
+        frame_t *frame = &frames[frame_depth];
+        return index <= frame->nparams ? frame->params[index - 1] : "";
+    }
+
+    // ${name} or $name
+    size_t len = 0;
+    if (!(s[start] >= '0' && s[start] <= '9')) {
+        while (is_name_char(s[start + len])) {
+            len++;
+        }
+    }
+    if (len == 0) {
+        return NULL;
+    }
+    if (start == 1) {
+        if (s[1 + len] != '}') {
+            return NULL;
+        }
+        *consumed = len + 2;
+    } else {
+        *consumed = len;
+    }
+
+    const char *value = var_get(s + start, len);
+    return value != NULL ? value : "";
+}
+
+/*
+ * Function: split_value
+ * ---------------------
+ * Appends an unquoted expansion to the field being built, starting a
+ * new field at every run of blanks (field splitting)
+ *
+ * start: Start of the current field (updated when a field is finished)
+ * quoted: Whether the current field came from quotes (reset per field)
+ *
+ * Returns: Number of fields finished and pushed
+ */
+int split_value(const char *value, size_t *start, int *quoted) {
+    int count = 0;
+    for (; *value != '\0'; value++) {
+        if (*value == ' ' || *value == '\t' || *value == '\n') {
+            if (scratch.top > *start || *quoted) {
+                arena_putc(&scratch, '\0');
+                push_field(scratch.base + *start);
+                count++;
+                *start = scratch.top;
+                *quoted = 0;
+            }
+        } else {
+            arena_putc(&scratch, *value);
+        }
+    }
+    return count;
+}
+
+/*
+ * Function: split_in_place
+ * ------------------------
+ * Field-splits bytes that are already on the scratch arena (output of
+ * a command substitution): each run of blanks ends the current field
+ * with a '\0' written in place, so no byte is moved or copied
+ *
+ * from: First byte to split (bytes before it belong to the open field)
+ * start, quoted: As in split_value()
+ *
+ * Returns: Number of fields finished and pushed
+ */
+int split_in_place(size_t from, size_t *start, int *quoted) {
+    int count = 0;
+    for (size_t i = from; i < scratch.top; i++) {
+        char c = scratch.base[i];
+        if (c == ' ' || c == '\t' || c == '\n') {
+            if (i > *start || *quoted) {
+                scratch.base[i] = '\0';
+                push_field(scratch.base + *start);
+                count++;
+                *quoted = 0;
+            }
+            *start = i + 1;
+        }
+    }
+    return count;
+}
+
+/*
+ * Function: write_all
+ * -------------------
+ * Writes a whole buffer, continuing after partial writes
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/*
+ * io_uring backend ("-o uring")
+ * -----------------------------
+ * A small submission/completion ring driven with raw syscalls (no
+ * liburing). The shell uses it for three things only:
+ *
+ * - the prompt (and whatever output is still queued, such as the
+ *   previous command's report) is written and the next input read in
+ *   ONE io_uring_enter(): a WRITE linked to a READ;
+ * - foreground children are waited for with IORING_OP_WAITID on their
+ *   pidfd (Linux 6.7), probed at startup;
+ * - queued output is flushed with a WRITE when nothing else is pending.
+ *
+ * Everything else (clone3(), access(), epoll) has no io_uring
+ * equivalent worth using here. Without io_uring (old kernel, headers,
+ * or kernel.io_uring_disabled) uring.fd stays -1 and the plain
+ * syscalls are used.
+ *
+ * The rings are MAP_SHARED: a forked child that runs shell code must
+ * call uring_reset() before it could touch them.
+ */
+#ifdef HAVE_IO_URING
+#ifndef IORING_OP_WAITID
+#define IORING_OP_WAITID 50         // Linux 6.7; older headers lack it
+#endif
+#ifndef IORING_SETUP_SINGLE_ISSUER
+#define IORING_SETUP_SINGLE_ISSUER (1U << 12)
+#endif
+#ifndef IORING_SETUP_DEFER_TASKRUN
+#define IORING_SETUP_DEFER_TASKRUN (1U << 13)
+#endif
+#endif
+
+#define URING_ENTRIES 8
+#define URING_WRITE   1             // user_data of each kind of request
+#define URING_READ    2
+#define URING_WAITID  3
+
+typedef struct {
+    int fd;                         // Ring, or -1 when not in use
+    int has_waitid;                 // IORING_OP_WAITID supported
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    void *sqes;                     // struct io_uring_sqe[URING_ENTRIES]
+    void *cqes;                     // struct io_uring_cqe[]
+    unsigned queued;                // SQEs filled in, not yet submitted
+} uring_t;
+
+uring_t uring = {-1, 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0};
+
+#define OUT_BUFFER_SIZE 4096
+char out_buffer[OUT_BUFFER_SIZE];   // Shell output for stdout not yet written
+size_t out_len = 0;
+
+void out_flush(void);
+
+#ifdef HAVE_IO_URING
+/*
+ * Function: uring_init
+ * --------------------
+ * Sets up the ring when "-o uring" is on; silently keeps the plain
+ * syscalls if the kernel refuses
+ */
+void uring_init(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // Completions are only wanted while the shell waits for them
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    int fd = (int)syscall(SYS_io_uring_setup, URING_ENTRIES, &params);
+    if (fd == -1 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));  // Before Linux 6.1
+        fd = (int)syscall(SYS_io_uring_setup, URING_ENTRIES, &params);
+    }
+    if (fd == -1) {
+        return;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    fd, IORING_OFF_SQ_RING);
+    char *cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    fd, IORING_OFF_CQ_RING);
+    void *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        close(fd);
+        return;
+    }
+    uring.sq_head = (unsigned *)(sq + params.sq_off.head);
+    uring.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    uring.sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    uring.sq_array = (unsigned *)(sq + params.sq_off.array);
+    uring.cq_head = (unsigned *)(cq + params.cq_off.head);
+    uring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    uring.cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    uring.sqes = sqes;
+    uring.cqes = cq + params.cq_off.cqes;
+    uring.fd = fd_high(fd);
+
+    // Which opcodes does this kernel know? IORING_OP_WAITID is recent
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_size);
+    if (probe != NULL &&
+        syscall(SYS_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+        probe->ops_len > IORING_OP_WAITID) {
+        uring.has_waitid = (probe->ops[IORING_OP_WAITID].flags & IO_URING_OP_SUPPORTED) != 0;
+    }
+    free(probe);
+}
+
+/*
+ * Function: uring_sqe
+ * -------------------
+ * Fills in the next submission queue entry (not yet submitted)
+ */
+struct io_uring_sqe *uring_sqe(int opcode, int fd, uint64_t user_data) {
+    unsigned tail = *uring.sq_tail + uring.queued;
+    unsigned index = tail & *uring.sq_mask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)uring.sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (uint8_t)opcode;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    uring.sq_array[index] = index;
+    uring.queued++;
+    return sqe;
+}
+
+/*
+ * Function: uring_submit_wait
+ * ---------------------------
+ * Submits the queued entries and waits until 'count' completions have
+ * arrived, storing the result of each kind in results[user_data]
+ *
+ * Returns: 0, or -1 if io_uring_enter() failed
+ */
+int uring_submit_wait(unsigned count, int results[4]) {
+    // The kernel must see the entries before the new tail
+    __atomic_store_n(uring.sq_tail, *uring.sq_tail + uring.queued, __ATOMIC_RELEASE);
+    unsigned submit = uring.queued;
+    uring.queued = 0;
+
+    unsigned seen = 0;
+    while (seen < count) {
+        long n = syscall(SYS_io_uring_enter, uring.fd, submit, count - seen,
+                         IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n == -1 && errno != EINTR) {
+            return -1;
+        }
+        if (n >= 0) {
+            submit = 0;
+        }
+        unsigned head = *uring.cq_head;
+        unsigned tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = (struct io_uring_cqe *)uring.cqes + (head & *uring.cq_mask);
+            if (cqe->user_data < 4) {
+                results[cqe->user_data] = cqe->res;
+            }
+            head++;
+            seen++;
+        }
+        __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/*
+ * Function: uring_waitid
+ * ----------------------
+ * waitid(P_PIDFD, pidfd, info, options) as an IORING_OP_WAITID request
+ *
+ * Returns: 0 on success, -1 on error, -2 if the ring cannot do it (the
+ *          caller then uses waitid())
+ */
+int uring_waitid(int pidfd, siginfo_t *info, int options) {
+    if (uring.fd == -1 || !uring.has_waitid) {
+        return -2;
+    }
+    struct io_uring_sqe *sqe = uring_sqe(IORING_OP_WAITID, pidfd, URING_WAITID);
+    sqe->len = P_PIDFD;             // idtype
+    sqe->file_index = (uint32_t)options;
+    sqe->addr2 = (uint64_t)(uintptr_t)info;
+    int results[4] = {0, 0, 0, 0};
+    if (uring_submit_wait(1, results) == -1) {
+        return -2;
+    }
+    if (results[URING_WAITID] < 0) {
+        errno = -results[URING_WAITID];
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+/*
+ * Function: uring_reset
+ * ---------------------
+ * Stops using the ring in a child that goes on running shell code:
+ * the ring memory is shared with the parent
+ */
+void uring_reset(void) {
+    if (uring.fd != -1) {
+        close(uring.fd);
+        uring.fd = -1;
+    }
+}
+
+/*
+ * Function: out_write
+ * -------------------
+ * Queues shell output for stdout (reports, prompts, job notices). It is
+ * written by out_flush(), together with the next read on the io_uring
+ * path, so a command's report and the next prompt cost one write.
+ *
+ * Queued output must reach stdout before anything else can write there
+ * or change fd 1: out_flush() is called before children are created,
+ * before a command runs, around redirections and at exit.
+ */
+void out_write(const char *data, size_t len) {
+    if (out_len + len > OUT_BUFFER_SIZE) {
+        out_flush();
+        if (len > OUT_BUFFER_SIZE) {
+            write_all(STDOUT_FILENO, data, len);
+            return;
+        }
+    }
+    memcpy(out_buffer + out_len, data, len);
+    out_len += len;
+}
+
+/*
+ * Function: out_str
+ * -----------------
+ * out_write() for a C string
+ */
+void out_str(const char *s) {
+    out_write(s, strlen(s));
+}
+
+/*
+ * Function: out_flush
+ * -------------------
+ * Writes the queued output
+ */
+void out_flush(void) {
+    if (out_len == 0) {
+        return;
+    }
+#ifdef HAVE_IO_URING
+    if (uring.fd != -1) {
+        struct io_uring_sqe *sqe = uring_sqe(IORING_OP_WRITE, STDOUT_FILENO, URING_WRITE);
+        sqe->addr = (uint64_t)(uintptr_t)out_buffer;
+        sqe->len = (uint32_t)out_len;
+        sqe->off = (uint64_t)-1;    // Current file position, like write()
+        int results[4] = {0, 0, 0, 0};
+        if (uring_submit_wait(1, results) == 0 && results[URING_WRITE] >= 0) {
+            size_t done = (size_t)results[URING_WRITE];
+            write_all(STDOUT_FILENO, out_buffer + done, out_len - done);
+            out_len = 0;
+            return;
+        }
+    }
+#endif
+    write_all(STDOUT_FILENO, out_buffer, out_len);
+    out_len = 0;
+}
+
+/*
+ * Function: out_flush_read
+ * ------------------------
+ * Flushes the queued output, then read()s from fd: with io_uring both
+ * go into one io_uring_enter() (a WRITE linked to a READ)
+ *
+ * Returns: Like read()
+ */
+ssize_t out_flush_read(int fd, char *buffer, size_t len) {
+#ifdef HAVE_IO_URING
+    if (uring.fd != -1) {
+        unsigned count = 1;
+        if (out_len > 0) {
+            struct io_uring_sqe *sqe = uring_sqe(IORING_OP_WRITE, STDOUT_FILENO, URING_WRITE);
+            sqe->addr = (uint64_t)(uintptr_t)out_buffer;
+            sqe->len = (uint32_t)out_len;
+            sqe->off = (uint64_t)-1;
+            sqe->flags = IOSQE_IO_LINK;     // The read starts after the write
+            count = 2;
+        }
+        struct io_uring_sqe *sqe = uring_sqe(IORING_OP_READ, fd, URING_READ);
+        sqe->addr = (uint64_t)(uintptr_t)buffer;
+        sqe->len = (uint32_t)len;
+        sqe->off = (uint64_t)-1;
+        int results[4] = {0, 0, 0, 0};
+        if (uring_submit_wait(count, results) == 0) {
+            if (count == 2) {
+                // A short write cancels the linked read: finish by hand
+                size_t done = (results[URING_WRITE] > 0) ? (size_t)results[URING_WRITE] : 0;
+                if (done < out_len) {
+                    write_all(STDOUT_FILENO, out_buffer + done, out_len - done);
+                }
+                out_len = 0;
+            }
+            if (results[URING_READ] >= 0) {
+                return results[URING_READ];
+            }
+            if (results[URING_READ] != -ECANCELED) {
+                errno = -results[URING_READ];
+                return -1;
+            }
+        }
+    }
+#endif
+    out_flush();
+    return read(fd, buffer, len);
+}
+
+/*
+ * Tracing (--trace FILE)
+ * ----------------------
+ * With --trace FILE the shell records where its time goes, as events
+ * of the Chrome trace format (chrome://tracing, ui.perfetto.dev):
+ *
+ *   shell track      read, parse, find_command, fork, wait
+ *   one track per    the child's lifetime (named after the command),
+ *   child (its pid)  and inside it exec: from the child's first step
+ *                    to its execv() call
+ *
+ * Events are appended to a buffer in memory and written to FILE in one
+ * go when the shell exits, so tracing costs no system calls while the
+ * script runs. Only the shell itself records: its $(...) and & children
+ * drop their copy of the buffer.
+ *
+ * A child cannot hand the exec times back through the buffer (it is a
+ * copy), so it writes them to a page shared with the shell (and the
+ * zygote), in the slot for its pid; the shell picks them up after the
+ * wait.
+ */
+#define TRACE_FD        105                 // Trace file: high, guarded by redirect_shell_fd()
+#define TRACE_MAX       (64 * 1024 * 1024)  // Buffer limit; later events are dropped
+#define TRACE_EVENT_MAX 512                 // Longest event (command names are cut)
+#define TRACE_SLOTS     64                  // Exec times of children, by pid % TRACE_SLOTS
+
+typedef struct {
+    int32_t pid;            // Child that owns the slot
+    int32_t unused;
+    int64_t begin_ns;       // It started preparing the exec
+    int64_t exec_ns;        // It called execv(), or 0
+} trace_slot_t;
+
+int trace_fd = -1;          // -1: not tracing (or not the shell)
+pid_t trace_owner = 0;      // The shell: pid of every event
+char *trace_buffer = NULL;
+size_t trace_len = 0;
+size_t trace_cap = 0;
+unsigned long trace_dropped = 0;
+trace_slot_t *trace_slots = NULL;   // MAP_SHARED: survives fork()
+pid_t command_pid = 0;              // PID of the foreground command run_external() started
+int64_t command_started_ns = 0;     // When it was started (--trace, stats)
+
+void write_str(int fd, const char *s);
+
+/*
+ * Function: trace_now
+ * -------------------
+ * Returns: CLOCK_MONOTONIC in nanoseconds
+ */
+int64_t trace_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/*
+ * Function: trace_number
+ * ----------------------
+ * Writes n in decimal to 'out'; with 'fraction' n is nanoseconds and
+ * is written as microseconds with three decimals (the unit of "ts")
+ *
+ * Returns: The number of characters written
+ */
+size_t trace_number(char *out, int64_t n, int fraction) {
+    char digits[24];
+    int len = 0;
+    uint64_t u = (n < 0) ? 0 - (uint64_t)n : (uint64_t)n;
+    do {
+        digits[len++] = (char)('0' + u % 10);
+        u /= 10;
+        if (fraction && len == 3) {
+            digits[len++] = '.';
+        }
+    } while (u != 0 || (fraction && len < 5));
+    size_t at = 0;
+    if (n < 0) {
+        out[at++] = '-';
+    }
+    while (len > 0) {
+        out[at++] = digits[--len];
+    }
+    return at;
+}
+
+/*
+ * Function: trace_put
+ * -------------------
+ * Appends s to the event being built in 'event' (at *len)
+ */
+void trace_put(char *event, size_t *len, const char *s) {
+    size_t n = strlen(s);
+    memcpy(event + *len, s, n);
+    *len += n;
+}
+
+/*
+ * Function: trace_event
+ * ---------------------
+ * Appends one event to the trace buffer:
+ *
+ *   {"name":NAME,"ph":PH,"ts":TS,"pid":SHELL,"tid":TID,"args":{ARGS}},
+ *
+ * name: Event name, escaped as a JSON string (long names are cut)
+ * ph: 'B' (begin) or 'E' (end)
+ * ns: CLOCK_MONOTONIC time of the event
+ * tid: The shell's pid for its own phases, a child's pid for its track
+ * args: Inner part of "args", already JSON, or NULL
+ */
+void trace_event(const char *name, char ph, int64_t ns, pid_t tid, const char *args) {
+    static const char hex[] = "0123456789abcdef";
+    char event[TRACE_EVENT_MAX];
+    size_t len = 0;
+
+    trace_put(event, &len, "{\"name\":\"");
+    for (int i = 0; name[i] != '\0' && len < TRACE_EVENT_MAX / 2; i++) {
+        unsigned char c = (unsigned char)name[i];
+        if (c == '"' || c == '\\') {
+            event[len++] = '\\';
+            event[len++] = (char)c;
+        } else if (c < 0x20 || c == 0x7f) {
+            trace_put(event, &len, "\\u00");
+            event[len++] = hex[c >> 4];
+            event[len++] = hex[c & 15];
+        } else {
+            event[len++] = (char)c;
+        }
+    }
+    trace_put(event, &len, "\",\"ph\":\"");
+    event[len++] = ph;
+    trace_put(event, &len, "\",\"ts\":");
+    len += trace_number(event + len, ns, 1);
+    trace_put(event, &len, ",\"pid\":");
+    len += trace_number(event + len, trace_owner, 0);
+    trace_put(event, &len, ",\"tid\":");
+    len += trace_number(event + len, tid, 0);
+    if (args != NULL) {
+        trace_put(event, &len, ",\"args\":{");
+        trace_put(event, &len, args);
+        event[len++] = '}';
+    }
+    trace_put(event, &len, "},\n");
+
+    if (trace_len + len > trace_cap) {
+        size_t cap = (trace_cap == 0) ? 65536 : trace_cap * 2;
+        char *grown = (cap <= TRACE_MAX) ? realloc(trace_buffer, cap) : NULL;
+        if (grown == NULL) {
+            trace_dropped++;
+            return;
+        }
+        trace_buffer = grown;
+        trace_cap = cap;
+    }
+    memcpy(trace_buffer + trace_len, event, len);
+    trace_len += len;
+}
+
+/*
+ * Function: trace_begin / trace_end
+ * ---------------------------------
+ * Opens and closes a phase of the shell itself ("read", "parse", ...)
+ */
+void trace_begin(const char *name) {
+    if (trace_fd != -1) {
+        trace_event(name, 'B', trace_now(), trace_owner, NULL);
+    }
+}
+
+void trace_end(const char *name) {
+    if (trace_fd != -1) {
+        trace_event(name, 'E', trace_now(), trace_owner, NULL);
+    }
+}
+
+/*
+ * Function: trace_span
+ * --------------------
+ * Records a phase of the shell after the fact, from begin to end
+ */
+void trace_span(const char *name, int64_t begin, int64_t end) {
+    if (trace_fd != -1) {
+        trace_event(name, 'B', begin, trace_owner, NULL);
+        trace_event(name, 'E', end, trace_owner, NULL);
+    }
+}
+
+/*
+ * Function: trace_child
+ * ---------------------
+ * Records the lifetime of a reaped child on a track of its own: from
+ * 'begin' until now, named 'name', with the exec phase the child left
+ * in its slot and, on the end event, how it ended
+ */
+void trace_child(pid_t pid, const char *name, int64_t begin, int status) {
+    if (trace_fd == -1 || pid <= 0) {
+        return;
+    }
+    trace_slot_t *slot = &trace_slots[pid % TRACE_SLOTS];
+    int exec = (slot->pid == pid && slot->exec_ns != 0);
+    if (exec && slot->begin_ns < begin) {
+        begin = slot->begin_ns;     // The zygote's "started" came in late
+    }
+    trace_event(name, 'B', begin, pid, NULL);
+    if (exec) {
+        trace_event("exec", 'B', slot->begin_ns, pid, NULL);
+        trace_event("exec", 'E', slot->exec_ns, pid, NULL);
+    }
+    slot->pid = 0;
+
+    char args[32];
+    size_t len = 0;
+    trace_put(args, &len, WIFSIGNALED(status) ? "\"signal\":" : "\"exit\":");
+    len += trace_number(args + len, WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status), 0);
+    args[len] = '\0';
+    trace_event(name, 'E', trace_now(), pid, args);
+}
+
+/*
+ * Function: trace_exec_mark
+ * -------------------------
+ * Called by a child on its way to execv(): at the start of the
+ * preparations (exec = 0) and right before the call (exec = 1)
+ */
+void trace_exec_mark(int exec) {
+    if (trace_slots == NULL) {
+        return;
+    }
+    pid_t pid = getpid();
+    trace_slot_t *slot = &trace_slots[pid % TRACE_SLOTS];
+    if (!exec) {
+        slot->pid = pid;
+        slot->exec_ns = 0;
+        slot->begin_ns = trace_now();
+    } else if (slot->pid == pid) {
+        slot->exec_ns = trace_now();
+    }
+}
+
+/*
+ * Function: trace_open
+ * --------------------
+ * Sets up --trace FILE: the file (truncated) moves to TRACE_FD and the
+ * slot page is mapped before the zygote starts, so its children share it
+ *
+ * Returns: 0 on success, -1 on error (message printed)
+ */
+int trace_open(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd != -1) {
+        int high = fcntl(fd, F_DUPFD_CLOEXEC, TRACE_FD);
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        fd = high;
+    }
+    if (fd == -1) {
+        write_str(STDERR_FILENO, "mini_bash: ");
+        write_str(STDERR_FILENO, path);
+        write_str(STDERR_FILENO, ": ");
+        write_str(STDERR_FILENO, strerror(errno));
+        write_str(STDERR_FILENO, "\n");
+        return -1;
+    }
+    if (trace_slots == NULL) {
+        void *page = mmap(NULL, TRACE_SLOTS * sizeof(trace_slot_t), PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        trace_slots = (page == MAP_FAILED) ? NULL : page;
+    }
+    if (trace_fd != -1) {
+        close(trace_fd);    // The last --trace wins
+    }
+    trace_fd = fd;
+    trace_owner = getpid();
+    return 0;
+}
+
+/*
+ * Function: trace_reset
+ * ---------------------
+ * In a forked child of the shell: stop recording (the buffer is a copy
+ * that nobody would write out). Exec marks still go to the shared page.
+ */
+void trace_reset(void) {
+    if (trace_fd != -1) {
+        close(trace_fd);
+        trace_fd = -1;
+    }
+}
+
+/*
+ * Function: trace_flush
+ * ---------------------
+ * Writes the buffered events to the trace file as one JSON object and
+ * closes it. Registered with atexit(); the exec built-in calls it too.
+ */
+void trace_flush(void) {
+    if (trace_fd == -1 || getpid() != trace_owner) {
+        return;
+    }
+    // The last event's ",\n" would leave a trailing comma
+    static const char head[] = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    char tail[80];
+    size_t len = 0;
+    trace_put(tail, &len, "\n],\"otherData\":{\"dropped_events\":");
+    len += trace_number(tail + len, (int64_t)trace_dropped, 0);
+    trace_put(tail, &len, "}}\n");
+
+    write_all(trace_fd, head, sizeof(head) - 1);
+    write_all(trace_fd, trace_buffer, (trace_len >= 2) ? trace_len - 2 : 0);
+    write_all(trace_fd, tail, len);
+    close(trace_fd);
+    trace_fd = -1;
+}
+
+/*
+ * Metrics (--metrics SOCKET)
+ * --------------------------
+ * The shell counts what it does in one small struct: plain increments
+ * on paths that fork and exec anyway. With --metrics SOCKET it also
+ * listens on that Unix socket and answers every connection with the
+ * counters in OpenMetrics text format, then closes it:
+ *
+ *   curl --unix-socket /run/mb.sock http://localhost/metrics
+ *
+ * A request that starts with "GET " gets an HTTP/1.0 response (what
+ * Prometheus and curl speak); any other request, or none (the client
+ * only shuts down its side), gets the bare text.
+ *
+ * There are no threads: the listening socket and the connections sit
+ * in the event loop next to jobs and timers, so scrapes are answered
+ * while the shell waits at the prompt or for a command.
+ */
+#define METRICS_FD          106     // Listening socket: high, guarded by redirect_shell_fd()
+#define MAX_METRICS_CLIENTS 4       // Connections waiting for their request (fds 107-110)
+
+typedef struct {
+    uint64_t commands;          // External commands run in the foreground
+    uint64_t failures;          // ... that exited non-zero or were killed
+    uint64_t unknown;           // Command names find_command() did not find
+    uint64_t lookups_found;     // find_command() calls that found the program
+    uint64_t lookups_missed;
+    uint64_t fork_failures;     // No child could be created
+    uint64_t child_user_us;     // CPU time of reaped children
+    uint64_t child_system_us;
+} metrics_t;
+
+metrics_t metrics;
+int metrics_fd = -1;                        // -1: no --metrics listener
+int metrics_clients[MAX_METRICS_CLIENTS];   // Accepted connections (0: free slot)
+pid_t metrics_owner = 0;
+char metrics_path[108];                     // sun_path, unlinked at exit
+
+/*
+ * Function: metrics_child_cpu
+ * ---------------------------
+ * Adds the CPU time of a reaped child (its rusage) to the counters
+ */
+void metrics_child_cpu(const struct rusage *usage) {
+    metrics.child_user_us += (uint64_t)(usage->ru_utime.tv_sec * 1000000LL + usage->ru_utime.tv_usec);
+    metrics.child_system_us += (uint64_t)(usage->ru_stime.tv_sec * 1000000LL + usage->ru_stime.tv_usec);
+}
+
+/*
+ * Function: metrics_close
+ * -----------------------
+ * Closes the listener and its connections. In the shell (at exit) the
+ * socket file is removed too; in a forked child only the copies go.
+ */
+void metrics_close(void) {
+    if (metrics_fd == -1) {
+        return;
+    }
+    for (int i = 0; i < MAX_METRICS_CLIENTS; i++) {
+        if (metrics_clients[i] > 0) {
+            close(metrics_clients[i]);
+            metrics_clients[i] = 0;
+        }
+    }
+    close(metrics_fd);
+    metrics_fd = -1;
+    if (getpid() == metrics_owner) {
+        unlink(metrics_path);
+    }
+}
+
+/*
+ * Function: metrics_open
+ * ----------------------
+ * Sets up --metrics SOCKET: binds a listening Unix socket at 'path'.
+ * A stale socket file of an earlier shell is replaced; any other file
+ * is left alone.
+ *
+ * Returns: 0 on success, -1 on error (message printed)
+ */
+int metrics_open(const char *path) {
+    struct sockaddr_un addr;
+    struct stat st;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    int fd = -1;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+    } else if (lstat(path, &st) == 0 && !S_ISSOCK(st.st_mode)) {
+        errno = EEXIST;
+    } else {
+        strcpy(addr.sun_path, path);
+        unlink(path);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd != -1 && (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+                         listen(fd, MAX_METRICS_CLIENTS) == -1)) {
+            int saved = errno;
+            close(fd);
+            errno = saved;
+            fd = -1;
+        }
+    }
+    if (fd != -1) {
+        int high = fcntl(fd, F_DUPFD_CLOEXEC, METRICS_FD);
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        fd = high;
+    }
+    if (fd == -1) {
+        write_str(STDERR_FILENO, "mini_bash: ");
+        write_str(STDERR_FILENO, path);
+        write_str(STDERR_FILENO, ": ");
+        write_str(STDERR_FILENO, strerror(errno));
+        write_str(STDERR_FILENO, "\n");
+        return -1;
+    }
+    metrics_close();    // The last --metrics wins
+    metrics_fd = fd;
+    metrics_owner = getpid();
+    strcpy(metrics_path, path);
+    return 0;
+}
+
+/*
+ * Function: metrics_counter
+ * -------------------------
+ * Appends one sample line, "NAME_total{LABELS} VALUE\n", to 'text';
+ * with 'seconds' the value is in microseconds and is written in
+ * seconds (to the millisecond)
+ */
+void metrics_counter(char *text, size_t *len, const char *name, const char *labels,
+                     uint64_t value, int seconds) {
+    trace_put(text, len, name);
+    trace_put(text, len, "_total");
+    trace_put(text, len, labels);
+    trace_put(text, len, " ");
+    *len += trace_number(text + *len, (int64_t)(seconds ? value / 1000 : value), seconds);
+    trace_put(text, len, "\n");
+}
+
+/*
+ * Function: metrics_render
+ * ------------------------
+ * Writes the counters to 'text' in OpenMetrics text format (at most
+ * METRICS_TEXT_MAX bytes)
+ *
+ * Returns: The length of the text
+ */
+#define METRICS_TEXT_MAX 2048
+
+size_t metrics_render(char *text) {
+    size_t len = 0;
+    trace_put(text, &len,
+              "# TYPE mini_bash_commands counter\n"
+              "# HELP mini_bash_commands External commands run in the foreground.\n");
+    metrics_counter(text, &len, "mini_bash_commands", "", metrics.commands, 0);
+    trace_put(text, &len,
+              "# TYPE mini_bash_command_failures counter\n"
+              "# HELP mini_bash_command_failures External commands that exited non-zero or were killed.\n");
+    metrics_counter(text, &len, "mini_bash_command_failures", "", metrics.failures, 0);
+    trace_put(text, &len,
+              "# TYPE mini_bash_unknown_commands counter\n"
+              "# HELP mini_bash_unknown_commands Commands that were not found.\n");
+    metrics_counter(text, &len, "mini_bash_unknown_commands", "", metrics.unknown, 0);
+    trace_put(text, &len,
+              "# TYPE mini_bash_command_lookups counter\n"
+              "# HELP mini_bash_command_lookups Program lookups in $HOME and /bin.\n");
+    metrics_counter(text, &len, "mini_bash_command_lookups", "{result=\"found\"}",
+                    metrics.lookups_found, 0);
+    metrics_counter(text, &len, "mini_bash_command_lookups", "{result=\"not_found\"}",
+                    metrics.lookups_missed, 0);
+    trace_put(text, &len,
+              "# TYPE mini_bash_fork_failures counter\n"
+              "# HELP mini_bash_fork_failures Children that could not be created.\n");
+    metrics_counter(text, &len, "mini_bash_fork_failures", "", metrics.fork_failures, 0);
+    trace_put(text, &len,
+              "# TYPE mini_bash_child_cpu_seconds counter\n"
+              "# UNIT mini_bash_child_cpu_seconds seconds\n"
+              "# HELP mini_bash_child_cpu_seconds CPU time of reaped children.\n");
+    metrics_counter(text, &len, "mini_bash_child_cpu_seconds", "{mode=\"user\"}",
+                    metrics.child_user_us, 1);
+    metrics_counter(text, &len, "mini_bash_child_cpu_seconds", "{mode=\"system\"}",
+                    metrics.child_system_us, 1);
+    trace_put(text, &len, "# EOF\n");
+    return len;
+}
+
+/*
+ * Process handles
+ * ---------------
+ * Every child the shell waits for is a process_t: its pid plus a pidfd,
+ * a file descriptor that refers to that one process. The pidfd comes
+ * from clone3(CLONE_PIDFD), which creates it together with the child,
+ * so there is no moment where the pid could already have been reused.
+ * Kernels before 5.3 lack clone3(): the shell then fork()s and asks for
+ * the pidfd afterwards with pidfd_open() (5.3 too), and with neither
+ * it falls back to plain pids and waitpid().
+ *
+ * waitid(P_PIDFD) reaps exactly the child behind the pidfd and
+ * pidfd_send_signal() signals exactly that child, whatever other
+ * children (fork server, standby child, $(...) helpers) exist.
+ *
+ * clone3() is called directly, bypassing glibc's fork(): the child runs
+ * without fork handlers and with the parent's cached thread id, which
+ * only matters to threads and raise(), neither of which the shell uses.
+ *
+ * With job control (an interactive shell at a terminal) each command
+ * and each background job gets a process group of its own: Ctrl+C and
+ * Ctrl+Z reach only the group that owns the terminal. The shell
+ * ignores SIGTSTP, SIGTTIN and SIGTTOU; children in their own group get
+ * the defaults back. Children that stay in the shell's group ($(...))
+ * keep ignoring them, so Ctrl+Z cannot stop them behind the shell's back.
+ */
+#ifndef CLONE_PIDFD
+#define CLONE_PIDFD 0x00001000
+#endif
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL
+#endif
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+#define SPAWN_SHELL      0  // Stay in the shell's process group
+#define SPAWN_FOREGROUND 1  // New process group that gets the terminal
+#define SPAWN_BACKGROUND 2  // New process group
+
+#define TERMINAL_FD 102     // Shell's copy of the terminal: high, guarded by redirect_shell_fd()
+
+typedef struct {
+    pid_t pid;
+    int pidfd;              // -1 if the kernel gave none
+    pid_t pgid;             // Own process group (job control), or 0
+} process_t;
+
+// struct clone_args from <linux/sched.h> (third version, 88 bytes;
+// older kernels accept it as long as the newer fields are zero)
+typedef struct {
+    uint64_t flags;
+    uint64_t pidfd;         // Address of the int receiving the pidfd
+    uint64_t child_tid;
+    uint64_t parent_tid;
+    uint64_t exit_signal;
+    uint64_t stack;
+    uint64_t stack_size;
+    uint64_t tls;
+    uint64_t set_tid;
+    uint64_t set_tid_size;
+    uint64_t cgroup;        // Directory fd, with CLONE_INTO_CGROUP
+} clone3_args_t;
+
+int clone3_usable = 1;      // Cleared after the first ENOSYS
+struct rusage process_usage;    // Resources of the child process_wait() reaped last
+int clone_into_cgroup = 1;  // Cleared when the kernel rejects CLONE_INTO_CGROUP (before 5.7)
+int spawn_cgroup = -1;      // cgroup directory for the next child (-o cgroup), or -1
+sigset_t child_signal_mask; // Signal mask children start with
+int child_signal_reset = 0; // 1 while the event loop blocks signals (see event_init())
+
+int job_control = 0;        // Commands get their own process groups (job_control_init())
+int terminal_fd = -1;       // The controlling terminal, while job_control is set
+pid_t shell_pgid = 0;       // The shell's process group
+struct termios shell_modes; // Terminal modes the prompt expects
+
+/*
+ * Function: process_child_setup
+ * -----------------------------
+ * First thing a new child does: restore the signal mask, join
+ * spawn_cgroup if clone3() could not put it there, and with job control
+ * move into a process group of its own
+ *
+ * group: SPAWN_* (see process_spawn())
+ * in_cgroup: 1 if the child was created in spawn_cgroup already
+ */
+void process_child_setup(int group, int in_cgroup) {
+    if (spawn_cgroup != -1 && !in_cgroup) {
+        int fd = openat(spawn_cgroup, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+        if (fd != -1) {
+            write(fd, "0", 1);  // "0": the writing process
+            close(fd);
+        }
+    }
+    if (child_signal_reset) {
+        sigprocmask(SIG_SETMASK, &child_signal_mask, NULL);
+    }
+    if (job_control && group != SPAWN_SHELL) {
+        setpgid(0, 0);
+        if (group == SPAWN_FOREGROUND) {
+            // SIGTTOU is still ignored, so a background group may do this
+            tcsetpgrp(terminal_fd, getpid());
+        }
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+    }
+    // Whatever the child runs, its own children stay in its group
+    job_control = 0;
+}
+
+/*
+ * Function: process_spawn
+ * -----------------------
+ * Creates a child like fork(), together with its pidfd. The child
+ * starts with the signal mask the shell had before the event loop
+ * blocked the signals it reads from its signalfd.
+ *
+ * group: SPAWN_SHELL, SPAWN_FOREGROUND or SPAWN_BACKGROUND; the last
+ *        two only make a difference with job control
+ *
+ * Returns: 0 in the child; in the parent the child's pid (p filled in),
+ *          or -1 with errno set if no child was created
+ */
+pid_t process_spawn(process_t *p, int group) {
+    out_flush();  // The child must not inherit (or overtake) queued output
+    p->pidfd = -1;
+    p->pgid = 0;
+    int own_group = job_control && group != SPAWN_SHELL;
+#ifdef SYS_clone3
+    if (clone3_usable) {
+        clone3_args_t args;
+        memset(&args, 0, sizeof(args));
+        args.flags = CLONE_PIDFD;
+        args.pidfd = (uint64_t)(uintptr_t)&p->pidfd;
+        args.exit_signal = SIGCHLD;
+        int in_cgroup = spawn_cgroup != -1 && clone_into_cgroup;
+        if (in_cgroup) {
+            // The child starts inside the cgroup: nothing it does before
+            // exec is accounted elsewhere, and it cannot escape
+            args.flags |= CLONE_INTO_CGROUP;
+            args.cgroup = (uint64_t)spawn_cgroup;
+        }
+        long pid = syscall(SYS_clone3, &args, sizeof(args));
+        if (pid == -1 && in_cgroup && errno != EAGAIN && errno != ENOMEM) {
+            // Before 5.7, or a cgroup the kernel will not take directly:
+            // the child joins it itself
+            clone_into_cgroup = (errno != EINVAL && errno != E2BIG);
+            in_cgroup = 0;
+            args.flags &= ~(uint64_t)CLONE_INTO_CGROUP;
+            args.cgroup = 0;
+            pid = syscall(SYS_clone3, &args, sizeof(args));
+        }
+        if (pid != -1) {
+            if (pid == 0) {
+                process_child_setup(group, in_cgroup);
+                return 0;
+            }
+            // The pidfd is created with O_CLOEXEC already
+            p->pid = (pid_t)pid;
+            p->pidfd = fd_high(p->pidfd);
+            if (own_group) {
+                // Also here: the child's setpgid() may come too late for
+                // a kill(-pgid) of the parent
+                setpgid(p->pid, p->pid);
+                p->pgid = p->pid;
+            }
+            return p->pid;
+        }
+        if (errno != ENOSYS && errno != EINVAL && errno != E2BIG) {
+            metrics.fork_failures++;
+            return -1;  // A real failure (EAGAIN, ENOMEM), not a missing call
+        }
+        clone3_usable = 0;
+    }
+#endif
+    pid_t pid = fork();
+    if (pid == 0) {
+        process_child_setup(group, 0);
+    }
+    if (pid <= 0) {
+        metrics.fork_failures += (pid == -1);
+        return pid;
+    }
+    p->pid = pid;
+    if (own_group) {
+        setpgid(pid, pid);
+        p->pgid = pid;
+    }
+#ifdef SYS_pidfd_open
+    // The child cannot have been reaped yet, so the pid is still its own
+    p->pidfd = fd_high((int)syscall(SYS_pidfd_open, pid, 0));
+#endif
+    return pid;
+}
+
+/*
+ * Function: process_wait
+ * ----------------------
+ * Waits for a child and releases its pidfd. A child in its own process
+ * group may also just stop: it is then still a child, with its pidfd.
+ *
+ * status: Receives a wait status in the usual encoding (WIFEXITED(),
+ *         WEXITSTATUS(), WTERMSIG(), WIFSTOPPED() work on it)
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int process_wait(process_t *p, int *status) {
+    // A child in its own process group can be stopped (Ctrl+Z)
+    int options = WEXITED | (p->pgid != 0 ? WSTOPPED : 0);
+    memset(&process_usage, 0, sizeof(process_usage));
+    if (p->pidfd == -1) {
+        while (wait4(p->pid, status, (p->pgid != 0) ? WUNTRACED : 0, &process_usage) == -1) {
+            if (errno != EINTR) {
+                return -1;
+            }
+        }
+        metrics_child_cpu(&process_usage);
+        return 0;
+    }
+
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+    int result = -2;
+#ifdef HAVE_IO_URING
+    // IORING_OP_WAITID has no rusage: not when records or metrics need it
+    if (records_fd == -1 && metrics_fd == -1) {
+        result = uring_waitid(p->pidfd, &info, options);  // -2: not on this ring
+    }
+#endif
+    if (result == -2) {
+        // The system call (unlike glibc's waitid()) also fills in a rusage
+        while ((result = (int)syscall(SYS_waitid, P_PIDFD, p->pidfd, &info, options,
+                                      &process_usage)) == -1 &&
+               errno == EINTR) {
+        }
+    }
+    if (result == 0 && info.si_code == CLD_STOPPED) {
+        *status = (info.si_status << 8) | 0x7f;  // WIFSTOPPED(); still a child
+        return 0;
+    }
+    close(p->pidfd);
+    p->pidfd = -1;
+    if (result == -1) {
+        return -1;
+    }
+
+    // waitid() reports the exit as si_code + si_status; rebuild the
+    // status word that waitpid() would have stored
+    switch (info.si_code) {
+    case CLD_EXITED:
+        *status = (info.si_status & 0xff) << 8;
+        break;
+    case CLD_DUMPED:
+        *status = (info.si_status & 0x7f) | 0x80;
+        break;
+    default:
+        *status = info.si_status & 0x7f;
+        break;
+    }
+    metrics_child_cpu(&process_usage);
+    return 0;
+}
+
+/*
+ * Function: command_started
+ * -------------------------
+ * Notes the pid and the time of the foreground command, whichever way
+ * it was started: fork, zygote or standby child
+ */
+void command_started(pid_t pid, const char *full_path) {
+    command_pid = pid;
+    command_started_ns = trace_now();
+    PROBE2(fork, pid, full_path);
+}
+
+/*
+ * Function: process_signal
+ * ------------------------
+ * Sends a signal to a child that has not been waited for yet
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int process_signal(process_t *p, int sig) {
+#ifdef SYS_pidfd_send_signal
+    if (p->pidfd != -1) {
+        return (int)syscall(SYS_pidfd_send_signal, p->pidfd, sig, NULL, 0);
+    }
+#endif
+    return kill(p->pid, sig);
+}
+
+/*
+ * Event loop
+ * ----------
+ * The shell waits for several things at once with one epoll instance:
+ *
+ *   EVENT_INPUT   stdin is readable (interactive mode)
+ *   EVENT_SIGNAL  signalfd: SIGCHLD, and SIGINT at a terminal
+ *   EVENT_CHILD   a pidfd became readable: that child has exited
+ *   EVENT_TIMER   a timerfd expired ($TMOUT at the prompt, or the
+ *                 time limit of a foreground command)
+ *   EVENT_METRICS the --metrics listener or one of its connections
+ *
+ * Each registration carries EVENT_KEY(kind, index) as its epoll data:
+ * for EVENT_CHILD the index is the job slot (or EVENT_FOREGROUND: the
+ * foreground pidfd, or the zygote socket while a reply is due), for
+ * EVENT_TIMER one of TIMER_*, for EVENT_METRICS a connection slot (or
+ * METRICS_LISTENER). There are no threads and no signal
+ * handlers: signals are blocked and read from the signalfd like any
+ * other input.
+ *
+ * The loop is set up lazily, by the interactive prompt or the first
+ * "&". A script without background jobs never pays for it: its
+ * foreground commands are waited for directly.
+ */
+#define EVENT_INPUT  1
+#define EVENT_SIGNAL 2
+#define EVENT_CHILD  3
+#define EVENT_TIMER  4
+#define EVENT_METRICS 5
+
+#define EVENT_FOREGROUND 0xffffffffu    // EVENT_CHILD index of the command being waited for
+#define METRICS_LISTENER 0xffffffffu    // EVENT_METRICS index of the listening socket
+#define METRICS_EXIT_WAIT_MS 100        // At exit: how long a request may take to arrive
+#define EVENT_KEY(kind, index) (((uint64_t)(kind) << 32) | (uint32_t)(index))
+
+#define TIMER_TMOUT   0     // Idle timeout at the prompt ($TMOUT)
+#define TIMER_COMMAND 1     // Time limit of the foreground command ("timeout", $TMOUT_CMD)
+#define MAX_TIMERS    2
+
+#define MAX_JOBS 64         // Background jobs running or not yet reported
+
+int event_fd = -1;          // epoll instance, -1 until event_init()
+int signal_fd = -1;         // signalfd for the signals in event_signals
+sigset_t event_signals;
+int input_pollable = 0;     // stdin is registered (epoll refuses regular files)
+int timer_fds[MAX_TIMERS] = {-1, -1};
+int timers_armed = 0;       // Number of armed timers
+int foreground_done = 0;    // Set when the EVENT_FOREGROUND pidfd fires
+
+#define TIMEOUT_STATUS   124    // Status of a command that ran out of time
+#define TIMEOUT_GRACE_MS 2000   // Between SIGTERM and SIGKILL, unless -k
+
+long command_timeout_ms = 0;    // Limit for the next foreground command, 0: none
+long command_kill_ms = 0;       // Then SIGTERM, and SIGKILL this much later
+int command_timed_out = 0;      // Set by event_wait_child() when the limit hit
+
+/*
+ * Structure: job_t
+ * ----------------
+ * A background job ("cmd &"), or a foreground command stopped with
+ * Ctrl+Z. The slot is kept after the job exits until its status has
+ * been reported ("[1]+  Done  cmd").
+ */
+typedef struct {
+    process_t process;      // pid 0: free slot
+    int done;               // Exited; status is valid
+    int stopped;            // Stopped (job control); status holds the stop
+    int notify;             // Stopped since the last prompt: report it
+    int status;             // Wait status
+    unsigned order;         // job_sequence when last started or stopped
+    char *text;             // Command text (malloc()ed)
+    int has_modes;          // Stopped in the foreground: modes is valid
+    struct termios modes;   // Its terminal modes, given back by fg
+    unsigned cgroup;        // Its leaf (-o cgroup), or 0
+    int64_t started_ns;     // When it was started (--trace, reap probe)
+} job_t;
+
+job_t jobs[MAX_JOBS];
+int njobs = 0;              // Slots in use (running or unreported)
+int jobs_running = 0;       // Not exited yet (stopped jobs included)
+int jobs_report = 0;        // Interactive: keep finished jobs until reported
+unsigned job_sequence = 0;  // The current job ("%+") has the highest order
+process_t *foreground_process = NULL;   // Child event_wait_child() waits for
+
+/*
+ * Function: event_init
+ * --------------------
+ * Creates the epoll instance and the signalfd (once)
+ *
+ * interactive: 1 to also read SIGINT (Ctrl+C abandons the current line
+ *              instead of killing the shell) and watch stdin
+ *
+ * Returns: 0 on success, -1 if the loop is not available
+ */
+int event_init(int interactive) {
+    if (event_fd != -1) {
+        return 0;
+    }
+    event_fd = fd_high(epoll_create1(EPOLL_CLOEXEC));
+    if (event_fd == -1) {
+        return -1;
+    }
+
+    // Blocked signals stay pending for the signalfd; children get the
+    // original mask back in process_spawn()
+    sigemptyset(&event_signals);
+    sigaddset(&event_signals, SIGCHLD);
+    if (interactive && isatty(STDIN_FILENO)) {
+        sigaddset(&event_signals, SIGINT);
+    }
+    sigprocmask(SIG_BLOCK, &event_signals, &child_signal_mask);
+    child_signal_reset = 1;
+    signal_fd = fd_high(signalfd(-1, &event_signals, SFD_CLOEXEC | SFD_NONBLOCK));
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    if (signal_fd != -1) {
+        ev.data.u64 = EVENT_KEY(EVENT_SIGNAL, 0);
+        epoll_ctl(event_fd, EPOLL_CTL_ADD, signal_fd, &ev);
+    }
+    if (interactive) {
+        ev.data.u64 = EVENT_KEY(EVENT_INPUT, 0);
+        input_pollable = (epoll_ctl(event_fd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == 0);
+    }
+    if (metrics_fd != -1) {
+        ev.data.u64 = EVENT_KEY(EVENT_METRICS, METRICS_LISTENER);
+        epoll_ctl(event_fd, EPOLL_CTL_ADD, metrics_fd, &ev);
+    }
+    return 0;
+}
+
+/*
+ * Function: event_reset
+ * ---------------------
+ * Forgets the event loop and the jobs in a child that goes on running
+ * shell code ($(...), background job): they belong to the parent
+ */
+void event_reset(void) {
+    if (event_fd == -1) {
+        return;
+    }
+    close(event_fd);
+    if (signal_fd != -1) {
+        close(signal_fd);
+    }
+    for (int i = 0; i < MAX_TIMERS; i++) {
+        if (timer_fds[i] != -1) {
+            close(timer_fds[i]);
+            timer_fds[i] = -1;
+        }
+    }
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].process.pid != 0 && jobs[i].process.pidfd != -1) {
+            close(jobs[i].process.pidfd);
+        }
+        jobs[i].process.pid = 0;
+    }
+    sigprocmask(SIG_SETMASK, &child_signal_mask, NULL);
+    child_signal_reset = 0;
+    event_fd = signal_fd = -1;
+    input_pollable = 0;
+    timers_armed = 0;
+    njobs = jobs_running = 0;
+}
+
+/*
+ * Function: event_timer
+ * ---------------------
+ * Arms (ms > 0) or disarms (ms = 0) timer 'index', creating its timerfd
+ * on first use
+ */
+void event_timer(int index, long ms) {
+    if (event_fd == -1) {
+        return;
+    }
+    int fd = timer_fds[index];
+    if (fd == -1) {
+        if (ms == 0) {
+            return;
+        }
+        fd = fd_high(timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK));
+        if (fd == -1) {
+            return;
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = EVENT_KEY(EVENT_TIMER, index);
+        epoll_ctl(event_fd, EPOLL_CTL_ADD, fd, &ev);
+        timer_fds[index] = fd;
+    }
+
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = ms / 1000;
+    spec.it_value.tv_nsec = (ms % 1000) * 1000000;
+    struct itimerspec old;
+    timerfd_settime(fd, 0, &spec, &old);
+    int was_armed = old.it_value.tv_sec != 0 || old.it_value.tv_nsec != 0;
+    timers_armed += (ms > 0) - was_armed;
+}
+
+/*
+ * Function: process_changed
+ * -------------------------
+ * Polls a child in its own process group for a stop or continue,
+ * without blocking and without reaping it
+ *
+ * options: WSTOPPED and/or WCONTINUED, plus WNOWAIT to leave the event
+ *          for a later process_wait()
+ * status: Receives the wait status of a stop (WSTOPSIG() works on it)
+ *
+ * Returns: CLD_STOPPED, CLD_CONTINUED, or 0 if nothing happened
+ */
+int process_changed(process_t *p, int options, int *status) {
+    if (p->pgid == 0 || p->pidfd == -1) {
+        return 0;
+    }
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+    if (waitid((idtype_t)P_PIDFD, (id_t)p->pidfd, &info, options | WNOHANG) == -1 ||
+        info.si_pid == 0) {
+        return 0;
+    }
+    if (info.si_code == CLD_STOPPED) {
+        *status = (info.si_status << 8) | 0x7f;
+    }
+    return info.si_code;
+}
+
+/*
+ * Function: job_finished
+ * ----------------------
+ * Reaps job 'slot' once its pidfd (or SIGCHLD) says it has exited
+ */
+void job_finished(int slot) {
+    job_t *job = &jobs[slot];
+    if (job->process.pidfd != -1) {
+        // Explicitly: a forked job may hold a copy of this pidfd, which
+        // would keep the registration alive after close()
+        epoll_ctl(event_fd, EPOLL_CTL_DEL, job->process.pidfd, NULL);
+    }
+    if (process_wait(&job->process, &job->status) == -1) {
+        job->status = 1 << 8;
+    }
+    if (WIFSTOPPED(job->status)) {
+        job->stopped = 1;  // Only after event_run() failed: it is still there
+        return;
+    }
+    job->done = 1;
+    jobs_running--;
+    PROBE4(reap, job->process.pid, job->status, 0, trace_now() - job->started_ns);
+    trace_child(job->process.pid, job->text, job->started_ns, job->status);
+}
+
+/*
+ * Function: metrics_event
+ * -----------------------
+ * Serves the --metrics socket: accepts new connections (index
+ * METRICS_LISTENER), or answers the request on connection 'index' and
+ * closes it. Never blocks: a client that is slow to read loses the rest
+ * of its answer.
+ *
+ * at_exit: 1 from metrics_finish(): the request gets a moment to
+ *          arrive, and a client that sent none gets the bare text
+ */
+void metrics_event(uint32_t index, int at_exit) {
+    if (index == METRICS_LISTENER) {
+        while (1) {
+            int slot = 0;
+            while (slot < MAX_METRICS_CLIENTS && metrics_clients[slot] != 0) {
+                slot++;
+            }
+            if (slot == MAX_METRICS_CLIENTS && at_exit) {
+                break;  // The rest stays queued until these are answered
+            }
+            int fd = accept4(metrics_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd == -1) {
+                break;
+            }
+            // High, like the listener
+            int high = (slot < MAX_METRICS_CLIENTS) ? fcntl(fd, F_DUPFD_CLOEXEC, METRICS_FD + 1) : -1;
+            close(fd);
+            if (high == -1) {
+                continue;  // Too many at once: the client sees EOF
+            }
+            struct epoll_event ev;
+            ev.events = EPOLLIN | EPOLLRDHUP;
+            ev.data.u64 = EVENT_KEY(EVENT_METRICS, slot);
+            epoll_ctl(event_fd, EPOLL_CTL_ADD, high, &ev);
+            metrics_clients[slot] = high;
+        }
+        return;
+    }
+
+    int fd = metrics_clients[index];
+    if (at_exit) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        poll(&pfd, 1, METRICS_EXIT_WAIT_MS);
+    }
+    char request[1024];
+    ssize_t n = recv(fd, request, sizeof(request), MSG_DONTWAIT);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR) && !at_exit) {
+        return;  // Woken up early: wait for the request
+    }
+
+    char text[METRICS_TEXT_MAX];
+    size_t len = metrics_render(text);
+    char header[256];
+    size_t header_len = 0;
+    if (n >= 4 && memcmp(request, "GET ", 4) == 0) {
+        trace_put(header, &header_len,
+                  "HTTP/1.0 200 OK\r\n"
+                  "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+                  "Content-Length: ");
+        header_len += trace_number(header + header_len, (int64_t)len, 0);
+        trace_put(header, &header_len, "\r\n\r\n");
+    }
+    struct iovec iov[2] = {{header, header_len}, {text, len}};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+    epoll_ctl(event_fd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    metrics_clients[index] = 0;
+}
+
+/*
+ * Function: metrics_finish
+ * ------------------------
+ * atexit() handler of the shell: answers the connections still queued
+ * on the metrics socket, so a scrape racing the exit gets the final
+ * counters rather than a reset, then closes the socket
+ */
+void metrics_finish(void) {
+    int answered = 1;
+    while (metrics_fd != -1 && getpid() == metrics_owner && answered) {
+        metrics_event(METRICS_LISTENER, 1);
+        answered = 0;
+        for (uint32_t i = 0; i < MAX_METRICS_CLIENTS; i++) {
+            if (metrics_clients[i] > 0) {
+                metrics_event(i, 1);
+                answered = 1;
+            }
+        }
+    }
+    metrics_close();
+}
+
+/*
+ * Function: event_run
+ * -------------------
+ * Waits for events and dispatches them: exited jobs are reaped, and
+ * the foreground child, input and timers are flagged for the caller
+ *
+ * until: Kind of event the caller is waiting for (EVENT_INPUT or
+ *        EVENT_CHILD)
+ *
+ * Returns: 'until' once such an event was seen; EVENT_SIGNAL after a
+ *          SIGINT; EVENT_TIMER when $TMOUT (waiting for input) or the
+ *          command's time limit (waiting for a child) expired; -1 on
+ *          error
+ */
+int event_run(int until) {
+    struct epoll_event events[8];
+    while (1) {
+        int n = epoll_wait(event_fd, events, 8, -1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            return -1;
+        }
+
+        int result = 0;
+        for (int i = 0; i < n; i++) {
+            int kind = (int)(events[i].data.u64 >> 32);
+            uint32_t index = (uint32_t)events[i].data.u64;
+
+            if (kind == EVENT_INPUT) {
+                if (until == EVENT_INPUT) {
+                    result = EVENT_INPUT;
+                }
+            } else if (kind == EVENT_CHILD) {
+                if (index == EVENT_FOREGROUND) {
+                    foreground_done = 1;
+                } else if (jobs[index].process.pid != 0 && !jobs[index].done) {
+                    job_finished((int)index);
+                }
+                if (until == EVENT_CHILD) {
+                    result = EVENT_CHILD;
+                }
+            } else if (kind == EVENT_METRICS) {
+                metrics_event(index, 0);
+            } else if (kind == EVENT_TIMER) {
+                uint64_t expirations;
+                if (read(timer_fds[index], &expirations, sizeof(expirations)) != (ssize_t)sizeof(expirations)) {
+                    continue;  // Disarmed in the meantime
+                }
+                timers_armed--;
+                if ((index == TIMER_TMOUT && until == EVENT_INPUT) ||
+                    (index == TIMER_COMMAND && until == EVENT_CHILD)) {
+                    result = EVENT_TIMER;
+                }
+            } else if (kind == EVENT_SIGNAL) {
+                struct signalfd_siginfo info;
+                int sigchld = 0;
+                int sigint = 0;
+                while (read(signal_fd, &info, sizeof(info)) == (ssize_t)sizeof(info)) {
+                    sigchld |= (info.ssi_signo == SIGCHLD);
+                    sigint |= (info.ssi_signo == SIGINT);
+                }
+                // A pidfd only fires on exit: stops (Ctrl+Z, SIGTTIN) are
+                // found through SIGCHLD
+                int stop;
+                if (sigchld && foreground_process != NULL &&
+                    process_changed(foreground_process, WSTOPPED | WNOWAIT, &stop) == CLD_STOPPED) {
+                    foreground_done = 1;
+                    if (until == EVENT_CHILD) {
+                        result = EVENT_CHILD;
+                    }
+                }
+                // Jobs without a pidfd (old kernels) are found by polling
+                for (int j = 0; sigchld && j < MAX_JOBS; j++) {
+                    job_t *job = &jobs[j];
+                    if (job->process.pid == 0 || job->done) {
+                        continue;
+                    }
+                    int change;
+                    while ((change = process_changed(&job->process, WSTOPPED | WCONTINUED,
+                                                     &job->status)) != 0) {
+                        job->stopped = (change == CLD_STOPPED);
+                        job->notify = job->stopped;
+                        if (job->stopped) {
+                            job->order = ++job_sequence;
+                        }
+                        if (until == EVENT_CHILD) {
+                            result = EVENT_CHILD;
+                        }
+                    }
+                    struct rusage usage;
+                    if (job->process.pidfd == -1 &&
+                        wait4(job->process.pid, &job->status, WNOHANG, &usage) > 0) {
+                        metrics_child_cpu(&usage);
+                        job->done = 1;
+                        jobs_running--;
+                        PROBE4(reap, job->process.pid, job->status, 0, trace_now() - job->started_ns);
+                        trace_child(job->process.pid, job->text, job->started_ns, job->status);
+                        if (until == EVENT_CHILD) {
+                            result = EVENT_CHILD;
+                        }
+                    }
+                }
+                if (sigint && result != EVENT_INPUT) {
+                    result = EVENT_SIGNAL;
+                }
+            }
+        }
+        if (result != 0) {
+            return result;
+        }
+    }
+}
+
+/*
+ * Function: event_wait_child
+ * --------------------------
+ * Waits for a foreground child while background jobs keep being
+ * reaped, timers fire and --metrics scrapes are answered. Without
+ * running jobs, armed timers, a time limit or a metrics socket this is
+ * a plain process_wait().
+ *
+ * With command_timeout_ms set, the child gets SIGTERM when the limit
+ * expires and SIGKILL command_kill_ms later; command_timed_out is set.
+ * The limit needs the child's pidfd (not on kernels before 5.3).
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int event_wait_child(process_t *p, int *status) {
+    command_timed_out = 0;
+    if ((command_timeout_ms > 0 || metrics_fd != -1) && p->pidfd != -1) {
+        event_init(0);
+    }
+    if (event_fd == -1 || p->pidfd == -1 ||
+        (jobs_running == 0 && timers_armed == 0 && command_timeout_ms == 0 && metrics_fd == -1)) {
+        int result = process_wait(p, status);
+        if (result == 0 && WIFSIGNALED(*status) && WTERMSIG(*status) == SIGINT &&
+            sigismember(&event_signals, SIGINT)) {
+            // The shell got the same Ctrl+C: it must not hit the next prompt
+            sigset_t sigint;
+            sigemptyset(&sigint);
+            sigaddset(&sigint, SIGINT);
+            struct timespec zero = {0, 0};
+            sigtimedwait(&sigint, NULL, &zero);
+        }
+        return result;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = EVENT_KEY(EVENT_CHILD, EVENT_FOREGROUND);
+    if (epoll_ctl(event_fd, EPOLL_CTL_ADD, p->pidfd, &ev) == -1) {
+        return process_wait(p, status);
+    }
+    foreground_done = 0;
+    foreground_process = p;
+    if (command_timeout_ms > 0) {
+        event_timer(TIMER_COMMAND, command_timeout_ms);
+    }
+    while (!foreground_done) {
+        int event = event_run(EVENT_CHILD);
+        if (event == -1) {
+            break;
+        }
+        if (event == EVENT_TIMER && !foreground_done) {
+            // First expiry: ask politely; the grace period: no more asking
+            process_signal(p, command_timed_out ? SIGKILL : SIGTERM);
+            if (!command_timed_out && command_kill_ms > 0) {
+                event_timer(TIMER_COMMAND, command_kill_ms);
+            }
+            command_timed_out = 1;
+        }
+        // Otherwise a job exited, or Ctrl+C went to the child too: keep
+        // waiting for it
+    }
+    foreground_process = NULL;
+    event_timer(TIMER_COMMAND, 0);
+    epoll_ctl(event_fd, EPOLL_CTL_DEL, p->pidfd, NULL);
+    return process_wait(p, status);
+}
+
+/*
+ * Function: event_wait_fd
+ * -----------------------
+ * Waits until 'fd' (a pipe or socket the shell is about to read) is
+ * readable. With running jobs or a metrics socket the wait goes
+ * through the event loop, with 'fd' standing in for the foreground
+ * pidfd, so jobs are reaped and scrapes answered meanwhile; otherwise
+ * it returns at once and the caller's read() does the blocking.
+ */
+void event_wait_fd(int fd) {
+    if (jobs_running == 0 && metrics_fd == -1) {
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = EVENT_KEY(EVENT_CHILD, EVENT_FOREGROUND);
+    if (event_init(0) == 0 && epoll_ctl(event_fd, EPOLL_CTL_ADD, fd, &ev) == 0) {
+        foreground_done = 0;
+        while (!foreground_done && event_run(EVENT_CHILD) != -1) {
+            // A job exited: keep waiting for the data
+        }
+        epoll_ctl(event_fd, EPOLL_CTL_DEL, fd, NULL);
+    }
+}
+
+int run_program(char *text, size_t len);
+void report_parse_error(int result);
+void zygote_stop(void);
+void standby_stop(int reap);
+void cgroup_reset(void);
+
+/*
+ * Function: command_substitution
+ * ------------------------------
+ * Runs $(command) and appends its output to the field being built
+ *
+ * command, len: The text between "$(" and ")"
+ * split: 1 to field-split the output (unquoted), 0 inside "..."
+ * start, quoted: State of the field being built (see split_value())
+ *
+ * How it works:
+ * - pipe() + fork(); the child sends its stdout into the pipe, parses
+ *   and runs the command text, and exits with its status
+ * - F_SETPIPE_SZ enlarges the pipe so the child blocks less often
+ * - The parent read()s straight into the scratch arena at the end of
+ *   the current field, in chunks as large as the pipe: the output is
+ *   never copied again
+ * - Each read() waits in event_wait_fd() first: background jobs are
+ *   reaped and --metrics scrapes answered while the command runs
+ * - Trailing newlines are dropped, then the output is split in place
+ *
+ * Returns: Number of fields finished and pushed
+ */
+#define SUBST_PIPE_SIZE (1024 * 1024)   // Requested pipe capacity
+
+int command_substitution(const char *command, size_t len, int split, size_t *start, int *quoted) {
+    // pipe() creates a one-way channel: fds[0] = read end, fds[1] = write end
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        perror("pipe");
+        return 0;
+    }
+
+    // Ask for a bigger pipe buffer (fails harmlessly above pipe-max-size)
+    fcntl(fds[1], F_SETPIPE_SZ, SUBST_PIPE_SIZE);
+    int chunk = fcntl(fds[0], F_GETPIPE_SZ);
+    if (chunk <= 0) {
+        chunk = 65536;
+    }
+
+    process_t child;
+    int64_t started = trace_now();
+    pid_t pid = process_spawn(&child, SPAWN_SHELL);
+    if (pid == -1) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return 0;
+    }
+    if (pid == 0) {
+        // ===== CHILD: run the command with stdout on the pipe =====
+        // dup2() makes fd 1 a copy of the write end (without O_CLOEXEC)
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[1]);
+        close(fds[0]);
+        report_completion = 0;
+        parse_error_fd = STDERR_FILENO;
+        zygote_stop();  // Replies on the socket belong to the shell
+        standby_stop(0);
+        event_reset();  // So do the jobs
+        uring_reset();  // and the ring
+        cgroup_reset(); // and the cgroup tree
+        trace_reset();  // and the trace
+        metrics_close(); // and the metrics socket
+
+        // The child parses its own copy of the text (parsing is in place)
+        char *text = malloc(len + 1);
+        if (text == NULL) {
+            _exit(1);
+        }
+        memcpy(text, command, len);
+        text[len] = '\0';
+        tail_position = 1;  // The last command needs no fork of its own
+        int result = run_program(text, len);
+        if (result != PARSE_OK) {
+            report_parse_error(result);
+        }
+        // _exit() skips atexit handlers/stdio flushing inherited from the shell
+        _exit(last_status);
+    }
+
+    // ===== PARENT: collect the output =====
+    close(fds[1]);  // Otherwise read() would never see EOF
+    size_t from = scratch.top;
+    while (1) {
+        if (scratch.top + (size_t)chunk > scratch.size) {
+            arena_overflow();
+        }
+        event_wait_fd(fds[0]);  // Jobs and scrapes are served meanwhile
+        ssize_t n = read(fds[0], scratch.base + scratch.top, (size_t)chunk);
+        if (n == -1) {
+            perror("read");
+            break;
+        }
+        if (n == 0) {
+            break;  // EOF: the child (and its children) closed the pipe
+        }
+        scratch.top += (size_t)n;
+    }
+    close(fds[0]);
+
+    // Reaps exactly this child, leaving any other child alone
+    int status;
+    if (process_wait(&child, &status) != -1) {
+        subst_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        PROBE4(reap, pid, status, 0, trace_now() - started);
+        trace_child(pid, "$(...)", started, status);
+    }
+
+    // Strip trailing newlines, then split
+    while (scratch.top > from && scratch.base[scratch.top - 1] == '\n') {
+        scratch.top--;
+    }
+    if (!split) {
+        return 0;
+    }
+    return split_in_place(from, start, quoted);
+}
+
+#define EXPAND_SPLIT 1      // Split unquoted expansions into fields
+#define EXPAND_GLOB  2      // Keep quoted * ? [ \ literal for glob_expand()
+
+/*
+ * Function: glob_putc
+ * -------------------
+ * Appends a quoted character of a word that will be globbed: pattern
+ * characters get a backslash so they only match themselves
+ */
+void glob_putc(char c) {
+    if (c == '*' || c == '?' || c == '[' || c == '\\') {
+        arena_putc(&scratch, '\\');
+    }
+    arena_putc(&scratch, c);
+}
+
+/*
+ * Function: expand_word
+ * ---------------------
+ * Expands one word (quote removal, $parameters, $1..$N, $#, $@,
+ * $(command)) and pushes the
+ * resulting field(s) onto the 'fields' arena
+ *
+ * word: Word text with its quotes still in place
+ * mode: EXPAND_SPLIT to split unquoted expansions on blanks (command
+ *       arguments, for-lists), 0 to always produce exactly one field;
+ *       plus EXPAND_GLOB when the fields are glob patterns
+ *
+ * Returns: Number of fields pushed
+ *
+ * Plain words never reach this function: the executor pushes a pointer
+ * to the program text instead, so most arguments are never copied.
+ */
+int expand_word(const char *word, int mode) {
+    int split = mode & EXPAND_SPLIT;
+    int glob = mode & EXPAND_GLOB;
+    size_t start = scratch.top;     // Start of the field being built
+    int quoted = 0;                 // Field exists even if empty ("")
+    int in_dquote = 0;
+    int at_empty = 0;               // Saw "$@" with no parameters
+    int count = 0;
+    char number[12];
+
+    for (size_t i = 0; word[i] != '\0'; i++) {
+        char c = word[i];
+
+        if (c == '\'' && !in_dquote) {
+            // Single-quoted text is copied literally
+            for (i++; word[i] != '\'' && word[i] != '\0'; i++) {
+                if (glob) {
+                    glob_putc(word[i]);
+                } else {
+                    arena_putc(&scratch, word[i]);
+                }
+            }
+            quoted = 1;
+            if (word[i] == '\0') {
+                break;
+            }
+            continue;
+        }
+        if (c == '"') {
+            in_dquote = !in_dquote;
+            quoted = 1;
+            continue;
+        }
+        if (c == '\\' && word[i + 1] != '\0') {
+            // Inside "..." a backslash only escapes $ " \ and `
+            char next = word[i + 1];
+            if (!in_dquote || next == '$' || next == '"' || next == '\\' || next == '`') {
+                i++;
+                c = next;
+            }
+            if (glob) {
+                glob_putc(c);
+            } else {
+                arena_putc(&scratch, c);
+            }
+            continue;
+        }
+        if (c == '$' && word[i + 1] == '(') {
+            size_t end = subst_end(word, i);
+            if (end != 0) {
+                count += command_substitution(word + i + 2, end - i - 2,
+                                              split && !in_dquote, &start, &quoted);
+                i = end;
+                continue;
+            }
+        }
+        if (c == '$' && (word[i + 1] == '@' || word[i + 1] == '*')) {
+            // $@ and $*: all positional parameters.
+            // "$@" (and unquoted $@/$* when splitting) makes one field per
+            // parameter; otherwise they are joined with spaces.
+            frame_t *frame = &frames[frame_depth];
+            int separate = split && (word[i + 1] == '@' || !in_dquote);
+            if (in_dquote && word[i + 1] == '@' && frame->nparams == 0 && scratch.top == start) {
+                at_empty = 1;  // "$@" with no parameters: no field at all ("$*": one empty field)
+            }
+            i++;
+            for (int a = 0; a < frame->nparams; a++) {
+                if (a > 0) {
+                    if (separate) {
+                        arena_putc(&scratch, '\0');
+                        push_field(scratch.base + start);
+                        count++;
+                        start = scratch.top;
+                    } else {
+                        arena_putc(&scratch, ' ');
+                    }
+                }
+                if (in_dquote || !split) {
+                    append_string(frame->params[a]);
+                } else {
+                    count += split_value(frame->params[a], &start, &quoted);
+                }
+            }
+            continue;
+        }
+        if (c == '$') {
+            size_t consumed;
+            const char *value = expand_parameter(word + i + 1, &consumed, number);
+            if (value == NULL) {
+                arena_putc(&scratch, '$');
+                continue;
+            }
+            i += consumed;
+
+            if (glob && in_dquote) {
+                for (const char *v = value; *v != '\0'; v++) {
+                    glob_putc(*v);
+                }
+                continue;
+            }
+            if (!split || in_dquote) {
+                append_string(value);
+                continue;
+            }
+            // Unquoted expansion: blanks in the value separate fields
+            count += split_value(value, &start, &quoted);
+            continue;
+        }
+        if (glob && in_dquote) {
+            glob_putc(c);
+            continue;
+        }
+        arena_putc(&scratch, c);
+    }
+
+    // An unquoted expansion to nothing produces no field at all
+    if (at_empty && scratch.top == start) {
+        quoted = 0;
+    }
+    if (scratch.top > start || quoted || !split) {
+        arena_putc(&scratch, '\0');
+        push_field(scratch.base + start);
+        count++;
+    }
+    return count;
+}
+
+/*
+ * Pathname expansion (globbing)
+ * -----------------------------
+ * A pattern such as "src/[a-z]*.c" is split at '/' into components.
+ * Every component with * ? or [...] is compiled once into a small array
+ * of match operations; literal components are opened directly with
+ * openat() and never listed.
+ *
+ * Directories are read with getdents64() into a large buffer, and the
+ * d_type of each entry says whether it is a directory, so no stat() is
+ * needed per entry (only for symlinks and file systems that report
+ * DT_UNKNOWN). All matches are collected first and sorted once.
+ */
+#define GLOB_CHAR  0        // One specific character
+#define GLOB_ANY   1        // ?
+#define GLOB_STAR  2        // *
+#define GLOB_CLASS 3        // [...]: set of accepted bytes
+
+#define GLOB_PATH_MAX   4096        // Longest path produced
+#define GLOB_DENTS_SIZE (32 * 1024) // getdents64() buffer (per directory level)
+#define GLOB_MAX_DEPTH  40          // Directory levels searched by "**"
+
+typedef struct {
+    uint8_t type;           // GLOB_*
+    uint8_t c;              // GLOB_CHAR: the character
+    uint8_t set[32];        // GLOB_CLASS: bitmap of the 256 byte values
+} glob_op_t;
+
+typedef struct {
+    char *text;             // Literal component (unescaped), or the pattern
+    size_t len;
+    glob_op_t *ops;         // Compiled matcher, NULL for a literal component
+    int nops;
+    int recursive;          // "**": any number of directory levels
+    int dot;                // Pattern starts with '.': may match hidden names
+} glob_part_t;
+
+typedef struct {
+    glob_part_t *parts;
+    int nparts;
+    int dirs_only;          // Pattern ends with '/'
+    int count;              // Matches pushed so far
+    int descended;          // Set while "**" enters a subdirectory
+    char path[GLOB_PATH_MAX];
+} glob_state_t;
+
+/*
+ * Function: glob_has_meta
+ * -----------------------
+ * Returns 1 if a pattern contains an unescaped * or ?, or a [ with a
+ * closing ]
+ */
+int glob_has_meta(const char *s) {
+    for (; *s != '\0'; s++) {
+        if (*s == '\\' && s[1] != '\0') {
+            s++;
+        } else if (*s == '*' || *s == '?' ||
+                   (*s == '[' && s[1] != '\0' && strchr(s + 2, ']') != NULL)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Function: glob_unescape
+ * -----------------------
+ * Removes the backslashes of a pattern in place (a pattern without
+ * matches becomes the word itself)
+ */
+char *glob_unescape(char *s) {
+    if (strchr(s, '\\') == NULL) {
+        return s;  // Nothing to do: also keeps read-only program text untouched
+    }
+    char *out = s;
+    for (char *c = s; *c != '\0'; c++) {
+        if (*c == '\\' && c[1] != '\0') {
+            c++;
+        }
+        *out++ = *c;
+    }
+    *out = '\0';
+    return s;
+}
+
+/*
+ * Function: glob_compile
+ * ----------------------
+ * Compiles one path component into match operations
+ *
+ * ops: Room for strlen(s) operations
+ *
+ * Returns: Number of operations, or 0 if the component has no pattern
+ *          characters (it is then matched as a literal name)
+ */
+int glob_compile(const char *s, glob_op_t *ops) {
+    int n = 0;
+    int meta = 0;
+
+    for (size_t i = 0; s[i] != '\0'; i++) {
+        glob_op_t *op = &ops[n++];
+        op->type = GLOB_CHAR;
+        op->c = (uint8_t)s[i];
+
+        if (s[i] == '\\' && s[i + 1] != '\0') {
+            op->c = (uint8_t)s[++i];
+        } else if (s[i] == '?') {
+            op->type = GLOB_ANY;
+            meta = 1;
+        } else if (s[i] == '*') {
+            if (n > 1 && ops[n - 2].type == GLOB_STAR) {
+                n--;  // "**" inside a name is the same as "*"
+            } else {
+                op->type = GLOB_STAR;
+            }
+            meta = 1;
+        } else if (s[i] == '[') {
+            // Find the closing ']'; one right after "[" or "[!" is literal
+            size_t j = i + 1;
+            int negate = (s[j] == '!' || s[j] == '^');
+            j += negate;
+            size_t first = j;
+            size_t end = (s[j] == ']') ? j + 1 : j;
+            while (s[end] != '\0' && s[end] != ']') {
+                end += (s[end] == '\\' && s[end + 1] != '\0') ? 2 : 1;
+            }
+            if (s[end] == '\0') {
+                continue;  // No closing ']': a literal '['
+            }
+
+            op->type = GLOB_CLASS;
+            memset(op->set, 0, sizeof(op->set));
+            for (j = first; j < end; ) {
+                unsigned lo = (unsigned char)s[j];
+                if (lo == '\\' && j + 1 < end) {
+                    lo = (unsigned char)s[++j];
+                }
+                j++;
+                unsigned hi = lo;
+                if (s[j] == '-' && j + 1 < end) {
+                    j++;
+                    hi = (unsigned char)s[j];
+                    if (hi == '\\' && j + 1 < end) {
+                        hi = (unsigned char)s[++j];
+                    }
+                    j++;
+                }
+                for (unsigned c = lo; c <= hi; c++) {
+                    op->set[c >> 3] |= (uint8_t)(1u << (c & 7));
+                }
+            }
+            if (negate) {
+                for (int b = 0; b < 32; b++) {
+                    op->set[b] = (uint8_t)~op->set[b];
+                }
+            }
+            i = end;
+            meta = 1;
+        }
+    }
+    return meta ? n : 0;
+}
+
+/*
+ * Function: glob_match
+ * --------------------
+ * Runs a compiled component against a file name
+ *
+ * Like pattern_match(), a '*' remembers where it started and is
+ * extended by one character whenever a later operation fails, so the
+ * match never takes more than (name length x operations) steps.
+ *
+ * Returns: 1 on match, 0 otherwise
+ */
+int glob_match(const glob_op_t *ops, int nops, const char *name) {
+    int i = 0;
+    int star_op = -1;           // Operation after the last '*'
+    const char *star_s = NULL;  // Name position that '*' matched up to
+    const unsigned char *s = (const unsigned char *)name;
+
+    while (*s != '\0') {
+        if (i < nops) {
+            const glob_op_t *op = &ops[i];
+            if (op->type == GLOB_STAR) {
+                star_op = ++i;
+                star_s = (const char *)s;
+                continue;
+            }
+            if (op->type == GLOB_ANY ||
+                (op->type == GLOB_CHAR && op->c == *s) ||
+                (op->type == GLOB_CLASS && (op->set[*s >> 3] & (1u << (*s & 7))))) {
+                i++;
+                s++;
+                continue;
+            }
+        }
+        if (star_op == -1) {
+            return 0;
+        }
+        i = star_op;
+        s = (const unsigned char *)++star_s;
+    }
+    while (i < nops && ops[i].type == GLOB_STAR) {
+        i++;
+    }
+    return i == nops;
+}
+
+/*
+ * Function: glob_emit
+ * -------------------
+ * Pushes path[0..len) + name as a match
+ */
+void glob_emit(glob_state_t *g, size_t len, const char *name) {
+    size_t name_len = strlen(name);
+    char *out = arena_alloc(&scratch, len + name_len + 2);
+    memcpy(out, g->path, len);
+    memcpy(out + len, name, name_len);
+    if (g->dirs_only) {
+        out[len + name_len++] = '/';
+    }
+    out[len + name_len] = '\0';
+    push_field(out);
+    g->count++;
+}
+
+/*
+ * Function: glob_is_dir
+ * ---------------------
+ * Returns 1 if a directory entry is a directory, using d_type when the
+ * file system provides it (follow: also accept symlinks to directories)
+ */
+int glob_is_dir(int dirfd, struct dirent64 *d, int follow) {
+    if (d->d_type == DT_DIR) {
+        return 1;
+    }
+    if (d->d_type != DT_UNKNOWN && !(follow && d->d_type == DT_LNK)) {
+        return 0;
+    }
+    struct stat st;
+    return fstatat(dirfd, d->d_name, &st, follow ? 0 : AT_SYMLINK_NOFOLLOW) == 0 &&
+           S_ISDIR(st.st_mode);
+}
+
+/*
+ * Function: glob_walk
+ * -------------------
+ * Matches components k.. of the pattern inside directory 'dirfd',
+ * whose path (with a trailing '/', or empty for ".") is path[0..len)
+ */
+void glob_walk(glob_state_t *g, int dirfd, size_t len, int k, int depth) {
+    glob_part_t *part = &g->parts[k];
+    int last = (k == g->nparts - 1);
+    int descended = g->descended;
+    g->descended = 0;
+
+    if (part->ops == NULL && !part->recursive) {
+        // Literal component: no need to list the directory
+        if (len + part->len + 2 > GLOB_PATH_MAX) {
+            return;
+        }
+        struct stat st;
+        if (last) {
+            if (fstatat(dirfd, part->text, &st, g->dirs_only ? 0 : AT_SYMLINK_NOFOLLOW) == 0 &&
+                (!g->dirs_only || S_ISDIR(st.st_mode))) {
+                glob_emit(g, len, part->text);
+            }
+            return;
+        }
+        int fd = openat(dirfd, part->text, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd != -1) {
+            memcpy(g->path + len, part->text, part->len);
+            g->path[len + part->len] = '/';
+            glob_walk(g, fd, len + part->len + 1, k + 1, depth);
+            close(fd);
+        }
+        return;
+    }
+
+    if (part->recursive && !last) {
+        glob_walk(g, dirfd, len, k + 1, depth);  // "**" matching no directory
+    }
+    if (part->recursive && last && len > 0 && !descended && !(k > 0 && g->parts[k - 1].recursive)) {
+        // "a/**" matches "a/" itself too; the levels below are emitted
+        // by name, one level up
+        glob_emit(g, g->dirs_only ? len - 1 : len, "");
+    }
+
+    char buf[GLOB_DENTS_SIZE];
+    ssize_t nread;
+    lseek(dirfd, 0, SEEK_SET);  // The same directory may be listed again
+    while ((nread = getdents64(dirfd, buf, sizeof(buf))) > 0) {
+        for (ssize_t off = 0; off < nread; ) {
+            struct dirent64 *d = (struct dirent64 *)(buf + off);
+            off += d->d_reclen;
+            const char *name = d->d_name;
+
+            // "." and ".." never match; hidden names need a leading '.'
+            if (name[0] == '.' && (!part->dot || name[1] == '\0' ||
+                                   (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+
+            if (part->recursive) {
+                // "**/" lists symlinks to directories too (like bash),
+                // but descends without following them (no cycles)
+                if (last && (!g->dirs_only || glob_is_dir(dirfd, d, 1))) {
+                    glob_emit(g, len, name);
+                }
+                size_t name_len = strlen(name);
+                if (depth < GLOB_MAX_DEPTH && len + name_len + 2 <= GLOB_PATH_MAX &&
+                    glob_is_dir(dirfd, d, 0)) {
+                    int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+                    if (fd != -1) {
+                        memcpy(g->path + len, name, name_len);
+                        g->path[len + name_len] = '/';
+                        g->descended = 1;
+                        glob_walk(g, fd, len + name_len + 1, k, depth + 1);
+                        close(fd);
+                    }
+                }
+                continue;
+            }
+
+            if (!glob_match(part->ops, part->nops, name)) {
+                continue;
+            }
+            if (last) {
+                if (!g->dirs_only || glob_is_dir(dirfd, d, 1)) {
+                    glob_emit(g, len, name);
+                }
+                continue;
+            }
+            size_t name_len = strlen(name);
+            if (depth < GLOB_MAX_DEPTH && len + name_len + 2 <= GLOB_PATH_MAX &&
+                glob_is_dir(dirfd, d, 1)) {
+                int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (fd != -1) {
+                    memcpy(g->path + len, name, name_len);
+                    g->path[len + name_len] = '/';
+                    glob_walk(g, fd, len + name_len + 1, k + 1, depth + 1);
+                    close(fd);
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Structure: glob_key_t
+ * ---------------------
+ * A match and the next 8 bytes of its name as a big-endian integer, so
+ * comparing keys compares names like strcmp() does
+ */
+typedef struct {
+    uint64_t key;
+    char *path;
+} glob_key_t;
+
+size_t glob_tie_offset;     // Where glob_compare starts comparing
+
+/*
+ * Function: glob_compare
+ * ----------------------
+ * qsort() comparison for matches whose keys are equal
+ */
+int glob_compare(const void *a, const void *b) {
+    return strcmp(((const glob_key_t *)a)->path + glob_tie_offset,
+                  ((const glob_key_t *)b)->path + glob_tie_offset);
+}
+
+/*
+ * Function: glob_sort
+ * -------------------
+ * Sorts the matches in byte order (like glob(3) in the C locale)
+ *
+ * The matches of a pattern usually share their directory ("src/..."),
+ * so the common prefix is skipped and the next 8 bytes become an
+ * integer key. The keys are sorted with an LSD radix sort (one counting
+ * pass per byte, skipped when all keys agree on that byte), which
+ * touches every match a fixed number of times instead of the
+ * n log n pointer-chasing strcmp() calls of qsort(). Only runs of equal
+ * keys with longer names are finished with qsort().
+ */
+void glob_sort(char **matches, int n) {
+    size_t common = strlen(matches[0]);
+    for (int i = 1; i < n && common > 0; i++) {
+        size_t j = 0;
+        while (j < common && matches[i][j] == matches[0][j]) {
+            j++;
+        }
+        common = j;
+    }
+
+    glob_key_t *keys = arena_alloc(&scratch, (size_t)n * sizeof(glob_key_t));
+    glob_key_t *tmp = arena_alloc(&scratch, (size_t)n * sizeof(glob_key_t));
+    for (int i = 0; i < n; i++) {
+        const unsigned char *s = (const unsigned char *)matches[i] + common;
+        uint64_t key = 0;
+        int b = 0;
+        for (; b < 8 && s[b] != '\0'; b++) {
+            key = (key << 8) | s[b];
+        }
+        keys[i].key = key << (8 * (8 - b));
+        keys[i].path = matches[i];
+    }
+
+    for (int shift = 0; shift < 64; shift += 8) {
+        size_t count[257] = {0};
+        for (int i = 0; i < n; i++) {
+            count[((keys[i].key >> shift) & 0xff) + 1]++;
+        }
+        if (count[((keys[0].key >> shift) & 0xff) + 1] == (size_t)n) {
+            continue;  // Every key has the same byte here
+        }
+        for (int c = 0; c < 256; c++) {
+            count[c + 1] += count[c];
+        }
+        for (int i = 0; i < n; i++) {
+            tmp[count[(keys[i].key >> shift) & 0xff]++] = keys[i];
+        }
+        glob_key_t *swap = keys;
+        keys = tmp;
+        tmp = swap;
+    }
+
+    // Equal keys whose names go on past the key: compare the rest
+    glob_tie_offset = common + 8;
+    for (int i = 0; i < n; ) {
+        int j = i + 1;
+        while (j < n && keys[j].key == keys[i].key) {
+            j++;
+        }
+        if (j - i > 1 && (keys[i].key & 0xff) != 0) {
+            qsort(keys + i, (size_t)(j - i), sizeof(glob_key_t), glob_compare);
+        }
+        i = j;
+    }
+
+    for (int i = 0; i < n; i++) {
+        matches[i] = keys[i].path;
+    }
+}
+
+/*
+ * Function: glob_expand
+ * ---------------------
+ * Pushes the sorted paths matching 'pattern' onto the 'fields' arena
+ *
+ * Returns: Number of matches (0: the caller keeps the word)
+ */
+int glob_expand(const char *pattern) {
+    size_t scratch_mark = scratch.top;
+    glob_state_t *g = arena_alloc(&scratch, sizeof(glob_state_t));
+    g->nparts = 0;
+    g->count = 0;
+    g->descended = 0;
+
+    // Split a copy of the pattern at '/'
+    size_t len = strlen(pattern);
+    char *copy = arena_alloc(&scratch, len + 1);
+    memcpy(copy, pattern, len + 1);
+    g->parts = arena_alloc(&scratch, (len / 2 + 1) * sizeof(glob_part_t));
+    g->dirs_only = (len > 0 && pattern[len - 1] == '/');
+
+    char *c = copy;
+    while (*c != '\0') {
+        char *slash = strchr(c, '/');
+        if (slash != NULL) {
+            *slash = '\0';
+        }
+        if (*c != '\0') {  // "a//b" and a trailing '/' add no component
+            glob_part_t *part = &g->parts[g->nparts++];
+            part->text = c;
+            part->len = strlen(c);
+            part->recursive = (strcmp(c, "**") == 0);
+            part->dot = (c[0] == '.');
+            part->ops = NULL;
+            if (!part->recursive) {
+                glob_op_t *ops = arena_alloc(&scratch, part->len * sizeof(glob_op_t));
+                part->nops = glob_compile(c, ops);
+                if (part->nops > 0) {
+                    part->ops = ops;
+                } else {
+                    part->len = strlen(glob_unescape(c));
+                }
+            }
+        }
+        if (slash == NULL) {
+            break;
+        }
+        c = slash + 1;
+    }
+
+    // The matches go to 'scratch' after the working data, and their
+    // pointers to 'fields'
+    int dirfd = open(pattern[0] == '/' ? "/" : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    char **matches = arena_alloc(&fields, 0);
+    if (dirfd != -1 && g->nparts > 0) {
+        size_t root = (pattern[0] == '/') ? 1 : 0;
+        g->path[0] = '/';
+        glob_walk(g, dirfd, root, 0, 0);
+    }
+    if (dirfd != -1) {
+        close(dirfd);
+    }
+
+    if (g->count == 0) {
+        scratch.top = scratch_mark;
+        return 0;
+    }
+    glob_sort(matches, g->count);  // Sorted once, after the whole walk
+    return g->count;
+}
+
+/*
+ * Function: expand_glob
+ * ---------------------
+ * Expands a word containing unquoted * ? or [ : the word is expanded
+ * as usual (quoted pattern characters escaped), then every field is
+ * replaced by the file names it matches, or kept if nothing matches
+ *
+ * Returns: Number of fields pushed
+ */
+int expand_glob(char *word, uint32_t flags) {
+    if ((flags & WORD_PLAIN) && !glob_has_meta(word)) {
+        push_field(word);  // e.g. the "[" command
+        return 1;
+    }
+
+    char **patterns = arena_alloc(&fields, 0);
+    int n = 1;
+    if (flags & WORD_PLAIN) {
+        push_field(word);
+    } else {
+        n = expand_word(word, EXPAND_SPLIT | EXPAND_GLOB);
+    }
+
+    // Move the patterns aside: the matches take their place on 'fields'
+    char **saved = arena_alloc(&scratch, (size_t)n * sizeof(char *));
+    memcpy(saved, patterns, (size_t)n * sizeof(char *));
+    fields.top = (size_t)((char *)patterns - fields.base);
+
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        int matches = glob_has_meta(saved[i]) ? glob_expand(saved[i]) : 0;
+        if (matches == 0) {
+            push_field(glob_unescape(saved[i]));
+            matches = 1;
+        }
+        count += matches;
+    }
+    return count;
+}
+
+/*
+ * Function: expand_words
+ * ----------------------
+ * Expands words [first, first + n) of a program onto the 'fields'
+ * arena, with field splitting and pathname expansion
+ *
+ * Returns: Number of fields pushed (the caller adds the NULL)
+ */
+int expand_words(program_t *p, int first, int n) {
+    int count = 0;
+    for (int w = first; w < first + n; w++) {
+        if (p->words[w].flags & WORD_GLOB) {
+            count += expand_glob(word_text(p, w), p->words[w].flags);
+        } else if (p->words[w].flags & WORD_PLAIN) {
+            push_field(word_text(p, w));  // Zero-copy fast path
+            count++;
+        } else {
+            count += expand_word(word_text(p, w), EXPAND_SPLIT);
+        }
+    }
+    return count;
+}
+
+/*
+ * Function: expand_string
+ * -----------------------
+ * Expands a word to exactly one string (no field splitting)
+ *
+ * flags: The word's WORD_* flags (plain words are returned as-is)
+ */
+char *expand_string(char *word, uint32_t flags) {
+    if (flags & WORD_PLAIN) {
+        return word;
+    }
+    char **field = arena_alloc(&fields, 0);
+    expand_word(word, 0);
+    char *result = *field;
+    fields.top = (char *)field - fields.base;  // Pop the pointer again
+    return result;
+}
+
+/*
+ * Function: expand_single
+ * -----------------------
+ * Expands word w of a program to one string, used for assignment
+ * values, case subjects and patterns
+ */
+char *expand_single(program_t *p, int w) {
+    return expand_string(word_text(p, w), p->words[w].flags);
+}
+
+/*
+ * Function: expand_heredoc
+ * ------------------------
+ * Expands a here-document body onto the scratch arena (not
+ * NUL-terminated): $parameters and $(command) are replaced, quotes are
+ * ordinary characters, and '\' only escapes $ ` \ and newline
+ */
+void expand_heredoc(const char *body) {
+    char number[12];
+    size_t start = scratch.top;
+    int quoted = 0;
+
+    for (size_t i = 0; body[i] != '\0'; i++) {
+        char c = body[i];
+
+        if (c == '\\' && (body[i + 1] == '$' || body[i + 1] == '`' || body[i + 1] == '\\')) {
+            arena_putc(&scratch, body[++i]);
+            continue;
+        }
+        if (c == '\\' && body[i + 1] == '\n') {
+            i++;  // Line continuation
+            continue;
+        }
+        if (c == '$' && body[i + 1] == '(') {
+            size_t end = subst_end(body, i);
+            if (end != 0) {
+                command_substitution(body + i + 2, end - i - 2, 0, &start, &quoted);
+                i = end;
+                continue;
+            }
+        }
+        if (c == '$' && (body[i + 1] == '@' || body[i + 1] == '*')) {
+            frame_t *frame = &frames[frame_depth];
+            for (int a = 0; a < frame->nparams; a++) {
+                if (a > 0) {
+                    arena_putc(&scratch, ' ');
+                }
+                append_string(frame->params[a]);
+            }
+            i++;
+            continue;
+        }
+        if (c == '$') {
+            size_t consumed;
+            const char *value = expand_parameter(body + i + 1, &consumed, number);
+            if (value != NULL) {
+                append_string(value);
+                i += consumed;
+                continue;
+            }
+        }
+        arena_putc(&scratch, c);
+    }
+}
+
+/*
+ * Function: pattern_match
+ * -----------------------
+ * Matches 'string' against a shell pattern (used by "case")
+ *
+ * Supports: * (any string), ? (any character), [abc], [a-z], [!abc]
+ * and backslash escapes.
+ *
+ * Returns: 1 on match, 0 otherwise
+ */
+int pattern_match(const char *pattern, const char *string) {
+    const char *star_p = NULL;  // Position after the last '*' seen
+    const char *star_s = NULL;  // String position that '*' matched up to
+
+    while (*string != '\0') {
+        int matched = 0;
+        const char *next_p = pattern + 1;
+
+        if (*pattern == '*') {
+            // Remember the star and first try matching it to nothing
+            star_p = ++pattern;
+            star_s = string;
+            continue;
+        } else if (*pattern == '?') {
+            matched = 1;
+        } else if (*pattern == '[') {
+            const char *p = pattern + 1;
+            int negate = (*p == '!' || *p == '^');
+            if (negate) {
+                p++;
+            }
+            int in_set = 0;
+            // A ']' right after '[' is a literal member of the set
+            do {
+                if (p[1] == '-' && p[2] != ']' && p[2] != '\0') {
+                    if (*string >= p[0] && *string <= p[2]) {
+                        in_set = 1;
+                    }
+                    p += 3;
+                } else {
+                    if (*string == *p) {
+                        in_set = 1;
+                    }
+                    p++;
+                }
+            } while (*p != ']' && *p != '\0');
+            if (*p == ']') {
+                matched = (in_set != negate);
+                next_p = p + 1;
+            } else {
+                matched = (*string == '[');  // Unterminated: literal '['
+            }
+        } else if (*pattern == '\\' && pattern[1] != '\0') {
+            matched = (pattern[1] == *string);
+            next_p = pattern + 2;
+        } else {
+            matched = (*pattern == *string && *pattern != '\0');
+        }
+
+        if (matched) {
+            pattern = next_p;
+            string++;
+        } else if (star_p != NULL) {
+            // Backtrack: let the last '*' swallow one more character
+            pattern = star_p;
+            string = ++star_s;
+        } else {
+            return 0;
+        }
+    }
+
+    // Trailing stars match the empty rest of the string
+    while (*pattern == '*') {
+        pattern++;
+    }
+    return *pattern == '\0';
+}
+
+/*
+ * Function: write_str
+ * -------------------
+ * Writes a C string to a file descriptor
+ */
+void write_str(int fd, const char *s) {
+    write(fd, s, strlen(s));
+}
+
+/*
+ * Inherited descriptors
+ * ---------------------
+ * A program should get fds 0-2 and the fds its redirections name, and
+ * nothing else. Internal fds are opened with O_CLOEXEC; as a second line
+ * of defence the child marks every other fd from 3 up close-on-exec
+ * with close_range(CLOSE_RANGE_CLOEXEC) just before execv().
+ *
+ * fds the shell inherited from its caller (a make jobserver, "3>log
+ * mini_bash script") are passed on, as by any other shell: main()
+ * records them in inherited_fds[] before it opens anything itself.
+ *
+ * The fds of redirections applied to the shell itself ("{ cmd; } 3>log")
+ * are kept as well: cmd is meant to see them. redirect_apply() records
+ * them in redirect_stack[], redirect_keep() those of "exec 3>log" in
+ * exec_fds[].
+ *
+ * With MINI_BASH_FD_CHECK in the environment the child first reports
+ * every fd that would have leaked (open, not close-on-exec, not kept)
+ * on stderr, with what it refers to.
+ */
+#ifndef CLOSE_RANGE_CLOEXEC
+#define CLOSE_RANGE_CLOEXEC (1U << 2)
+#endif
+#define MAX_KEPT_FDS 64     // Redirected fds tracked; with more, nothing is closed
+
+int redirect_stack[MAX_KEPT_FDS];   // Targets of the first redirections_active redirections
+int exec_fds[MAX_KEPT_FDS];         // fds above 2 opened for good ("exec 3<file")
+int nexec_fds = 0;
+int inherited_fds[MAX_KEPT_FDS];    // fds above 2 open (not close-on-exec) at startup
+int ninherited_fds = 0;             // More than MAX_KEPT_FDS: nothing is closed
+int close_range_usable = 1;         // Cleared when the kernel lacks CLOSE_RANGE_CLOEXEC (before 5.11)
+int fd_check = 0;                   // MINI_BASH_FD_CHECK: report leaked fds
+
+/*
+ * Function: fds_open
+ * ------------------
+ * Lists the open fds from 'first' up, from /proc/self/fd
+ *
+ * Returns: Number of fds stored in 'fds' (at most max), or -1 if
+ *          /proc is not available
+ */
+int fds_open(int first, int *fds, int max) {
+    int dir = open("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir == -1) {
+        return -1;
+    }
+    char buf[4096];
+    ssize_t nread;
+    int n = 0;
+    while ((nread = getdents64(dir, buf, sizeof(buf))) > 0) {
+        for (ssize_t pos = 0; pos < nread; ) {
+            struct dirent64 *d = (struct dirent64 *)(buf + pos);
+            pos += d->d_reclen;
+            int fd = atoi(d->d_name);
+            if (d->d_name[0] >= '0' && d->d_name[0] <= '9' && fd >= first && fd != dir && n < max) {
+                fds[n++] = fd;
+            }
+        }
+    }
+    close(dir);
+    return n;
+}
+
+/*
+ * Function: fds_inherited_init
+ * ----------------------------
+ * Records the fds the shell was started with (see inherited_fds[])
+ */
+void fds_inherited_init(void) {
+    int fds[MAX_KEPT_FDS + 1];
+    int n = fds_open(3, fds, MAX_KEPT_FDS + 1);
+    for (int i = 0; i < n; i++) {
+        int flags = fcntl(fds[i], F_GETFD);
+        if (flags != -1 && !(flags & FD_CLOEXEC)) {
+            inherited_fds[ninherited_fds++] = fds[i];
+        }
+    }
+    if (n > MAX_KEPT_FDS) {
+        ninherited_fds = MAX_KEPT_FDS + 1;  // Too many to tell apart
+    }
+}
+
+/*
+ * Function: fds_cloexec_range
+ * ---------------------------
+ * Marks the fds first..last close-on-exec
+ */
+void fds_cloexec_range(unsigned first, unsigned last) {
+#ifdef SYS_close_range
+    if (close_range_usable) {
+        if (syscall(SYS_close_range, first, last, CLOSE_RANGE_CLOEXEC) == 0) {
+            return;
+        }
+        close_range_usable = 0;     // ENOSYS (before 5.9) or EINVAL
+    }
+#endif
+    // Older kernels: one fcntl() per fd that is open
+    int fds[1024];
+    int n = fds_open((int)first, fds, 1024);
+    for (int i = 0; i < n; i++) {
+        if ((unsigned)fds[i] <= last) {
+            fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+        }
+    }
+}
+
+/*
+ * Function: fds_report_leaks
+ * --------------------------
+ * MINI_BASH_FD_CHECK: prints every fd from 3 up that the program would
+ * inherit although it is not in 'kept' (sorted)
+ */
+void fds_report_leaks(const char *program, const int *kept, int nkept) {
+    int fds[256];
+    int n = fds_open(3, fds, 256);
+    for (int i = 0; i < n; i++) {
+        int flags = fcntl(fds[i], F_GETFD);
+        int keep = 0;
+        for (int k = 0; k < nkept; k++) {
+            keep |= (kept[k] == fds[i]);
+        }
+        if (flags == -1 || (flags & FD_CLOEXEC) || keep) {
+            continue;
+        }
+        char path[32];
+        char target[256];
+        char number[12];
+        memcpy(path, "/proc/self/fd/", 14);
+        int_to_string(fds[i], path + 14);
+        ssize_t len = readlink(path, target, sizeof(target) - 1);
+        target[len > 0 ? len : 0] = '\0';
+        write_str(STDERR_FILENO, "mini_bash: fd ");
+        write_str(STDERR_FILENO, int_to_string(fds[i], number));
+        write_str(STDERR_FILENO, " (");
+        write_str(STDERR_FILENO, target);
+        write_str(STDERR_FILENO, ") leaked into ");
+        write_str(STDERR_FILENO, program);
+        write_str(STDERR_FILENO, "\n");
+    }
+}
+
+/*
+ * Function: exec_fds_prepare
+ * --------------------------
+ * Called by a child right before execv(): marks every fd from 3 up
+ * close-on-exec except 'keep' (the command's redirected fds) and the
+ * fds of redirections applied to the shell, for the moment or for good,
+ * and the fds the shell inherited
+ */
+void exec_fds_prepare(const char *program, const int *keep, int nkeep) {
+    if (redirections_active > MAX_KEPT_FDS || nkeep > MAX_KEPT_FDS ||
+        ninherited_fds > MAX_KEPT_FDS) {
+        return;  // Cannot tell which fds are meant for the program
+    }
+    int kept[4 * MAX_KEPT_FDS] = {0};  // Zeroed: -O2 cannot tell only kept[0..n) is read
+    int n = 0;
+    for (int i = 0; i < nkeep; i++) {
+        kept[n++] = keep[i];
+    }
+    for (int i = 0; i < redirections_active; i++) {
+        kept[n++] = redirect_stack[i];
+    }
+    for (int i = 0; i < nexec_fds; i++) {
+        kept[n++] = exec_fds[i];
+    }
+    for (int i = 0; i < ninherited_fds; i++) {
+        kept[n++] = inherited_fds[i];
+    }
+    // Ascending, so that the gaps between them are ranges
+    for (int i = 1; i < n; i++) {
+        int fd = kept[i];
+        int j = i;
+        for (; j > 0 && kept[j - 1] > fd; j--) {
+            kept[j] = kept[j - 1];
+        }
+        kept[j] = fd;
+    }
+
+    if (fd_check) {
+        fds_report_leaks(program, kept, n);
+    }
+    unsigned first = 3;
+    for (int i = 0; i < n; i++) {
+        if (kept[i] < (int)first) {
+            continue;
+        }
+        if ((unsigned)kept[i] > first) {
+            fds_cloexec_range(first, (unsigned)kept[i] - 1);
+        }
+        first = (unsigned)kept[i] + 1;
+    }
+    fds_cloexec_range(first, ~0U);
+}
+
+/*
+ * Redirections
+ * ------------
+ * Redirections are prepared in the shell: targets are expanded and
+ * here-document bodies are turned into readable fds. They are then
+ * applied with dup2() - in the child for external programs, or in the
+ * shell itself (saving the old fds) for built-ins, functions and
+ * compound commands.
+ */
+typedef struct {
+    int type;               // REDIR_*
+    int fd;                 // Descriptor being redirected
+    int source;             // Here-document fd, or -1
+    int saved;              // Copy of the old fd while applied in the shell
+    int saved_cloexec;      // The old fd was close-on-exec (an internal fd)
+    const char *target;     // Expanded file name / fd number
+} redirect_t;
+
+#define HEREDOC_PIPE_MAX (64 * 1024)    // Larger bodies go to a memfd
+
+/*
+ * Function: heredoc_fd
+ * --------------------
+ * Turns a here-document body into a readable file descriptor
+ *
+ * Small bodies are written into a pipe whose buffer holds all of them,
+ * so writing never blocks and no file is involved. Bodies larger than
+ * the pipe buffer go to an anonymous memfd, sealed against changes
+ * (the reader sees a frozen, seekable copy) and rewound to offset 0.
+ *
+ * Returns: The fd (close-on-exec; dup2() onto the target clears that),
+ *          or -1 on error
+ */
+int heredoc_fd(const char *data, size_t len) {
+    if (len <= HEREDOC_PIPE_MAX) {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) == -1) {
+            perror("pipe2");
+            return -1;
+        }
+        // The pipe may be smaller than 64 KiB when the per-user pipe
+        // limit is reached; then the memfd is used instead
+        int pipe_size = fcntl(fds[1], F_GETPIPE_SZ);
+        if (pipe_size >= 0 && len <= (size_t)pipe_size) {
+            int ok = write_all(fds[1], data, len) == 0;
+            close(fds[1]);
+            if (ok) {
+                return fds[0];
+            }
+            perror("write");
+            close(fds[0]);
+            return -1;
+        }
+        close(fds[0]);
+        close(fds[1]);
+    }
+
+    int fd = memfd_create("mini_bash-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1) {
+        perror("memfd_create");
+        return -1;
+    }
+    if (write_all(fd, data, len) == -1) {
+        perror("write");
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+/*
+ * Function: redirect_close
+ * ------------------------
+ * Closes the here-document fds of prepared redirections
+ */
+void redirect_close(redirect_t *r, int n) {
+    for (int i = 0; i < n; i++) {
+        if (r[i].source != -1) {
+            close(r[i].source);
+        }
+    }
+}
+
+/*
+ * Function: redirect_prepare
+ * --------------------------
+ * Expands the redirections of node n into an array on the 'fields'
+ * arena (released by the caller's arena marks)
+ *
+ * Returns: The array (node->nredirs entries), or NULL on error
+ */
+redirect_t *redirect_prepare(program_t *p, node_t *node) {
+    redirect_t *r = arena_alloc(&fields, (size_t)node->nredirs * sizeof(redirect_t));
+
+    for (int i = 0; i < node->nredirs; i++) {
+        redir_t *redir = &p->redirs[node->redir + i];
+        r[i].type = redir->type;
+        r[i].fd = redir->fd;
+        r[i].source = -1;
+        r[i].saved = -1;
+        r[i].target = NULL;
+
+        if (redir->type == REDIR_HEREDOC || redir->type == REDIR_HEREDOC_STRIP) {
+            const char *body = p->text + redir->body;
+            if (redir->type == REDIR_HEREDOC_STRIP) {
+                // <<-: leading tabs are removed from every line first
+                size_t from = scratch.top;
+                int line_start = 1;
+                for (size_t j = 0; body[j] != '\0'; j++) {
+                    if (line_start && body[j] == '\t') {
+                        continue;
+                    }
+                    line_start = (body[j] == '\n');
+                    arena_putc(&scratch, body[j]);
+                }
+                arena_putc(&scratch, '\0');
+                body = scratch.base + from;
+            }
+            size_t len;
+            if (redir->flags & HEREDOC_LITERAL) {
+                len = strlen(body);  // Used as-is: <<EOF bodies are never copied
+            } else {
+                size_t from = scratch.top;
+                expand_heredoc(body);
+                body = scratch.base + from;
+                len = scratch.top - from;
+            }
+            r[i].source = heredoc_fd(body, len);
+        } else if (redir->type == REDIR_HERESTRING) {
+            // <<<word: the expanded word plus a newline
+            const char *value = expand_string(p->text + redir->offset, redir->flags);
+            size_t from = scratch.top;
+            append_string(value);
+            arena_putc(&scratch, '\n');
+            r[i].source = heredoc_fd(scratch.base + from, scratch.top - from);
+        } else {
+            r[i].target = expand_string(p->text + redir->offset, redir->flags);
+            continue;
+        }
+
+        if (r[i].source == -1) {
+            redirect_close(r, i);
+            return NULL;
+        }
+    }
+    return r;
+}
+
+/*
+ * Function: redirect_shell_fd
+ * ---------------------------
+ * Tells whether 'fd' is one of the shell's own descriptors: the fork
+ * server and standby sockets, the terminal, cgroup, --records, --trace
+ * and --metrics fds (100 and up), the event loop, pidfds and saved
+ * copies. All of them are close-on-exec, while every fd a script opens
+ * is not. The here-document fds of 'r' are exempt: they are about to
+ * be used.
+ *
+ * Returns: 1 for a shell fd, 0 otherwise (also if 'fd' is not open)
+ */
+int redirect_shell_fd(const redirect_t *r, int n, int fd) {
+    int flags = fcntl(fd, F_GETFD);
+    if (flags == -1 || !(flags & FD_CLOEXEC)) {
+        return 0;
+    }
+    for (int i = 0; i < n; i++) {
+        if (r[i].source == fd) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Function: redirect_apply
+ * ------------------------
+ * Performs prepared redirections with open() and dup2()
+ *
+ * save: 1 to keep a copy of every replaced fd in r[i].saved (the shell
+ *       itself), 0 in a child that is about to exec
+ *
+ * In the shell, a redirection onto one of its own fds ("exec 100>&-")
+ * is refused: it would cut the shell off from the fork server, or send
+ * --records output into the script's file.
+ *
+ * Returns: Number of redirections applied (n on success); on failure an
+ *          error is printed and the caller undoes the applied ones
+ */
+int redirect_apply(redirect_t *r, int n, int save) {
+    if (n > 0) {
+        out_flush();  // Queued output belongs to the old fds
+    }
+    for (int i = 0; i < n; i++) {
+        int fd = r[i].fd;
+        int from = r[i].source;
+        int opened = 0;
+
+        if (save && redirect_shell_fd(r, n, fd)) {
+            char number[12];
+            write_str(STDERR_FILENO, "mini_bash: ");
+            write_str(STDERR_FILENO, int_to_string(fd, number));
+            write_str(STDERR_FILENO, ": file descriptor in use by the shell\n");
+            r[i].saved = -1;
+            return i;
+        }
+
+        // Keep the old fd (above the range scripts use) to restore it
+        // later. This comes first: open() may return 'fd' itself.
+        if (save) {
+            r[i].saved = fcntl(fd, F_DUPFD_CLOEXEC, SHELL_FD_MIN);
+            r[i].saved_cloexec = (r[i].saved != -1 && (fcntl(fd, F_GETFD) & FD_CLOEXEC));
+        }
+
+        switch (r[i].type) {
+            case REDIR_IN:
+                from = open(r[i].target, O_RDONLY | O_CLOEXEC);
+                opened = 1;
+                break;
+            case REDIR_OUT:
+                from = open(r[i].target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                opened = 1;
+                break;
+            case REDIR_APPEND:
+                from = open(r[i].target, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+                opened = 1;
+                break;
+            case REDIR_DUP_IN:
+            case REDIR_DUP_OUT:
+                if (strcmp(r[i].target, "-") == 0) {
+                    from = -2;  // n>&- closes n
+                } else {
+                    char *end;
+                    long number = strtol(r[i].target, &end, 10);
+                    if (*r[i].target == '\0' || *end != '\0' || number < 0 || number > 1023) {
+                        write_str(STDERR_FILENO, "mini_bash: ");
+                        write_str(STDERR_FILENO, r[i].target);
+                        write_str(STDERR_FILENO, ": ambiguous redirect\n");
+                        from = -3;  // Error already reported
+                        break;
+                    }
+                    from = (int)number;
+                    if (fcntl(from, F_GETFD) == -1) {
+                        from = -1;
+                    }
+                }
+                break;
+        }
+        if (from == -1 || from == -3) {
+            if (from == -1) {
+                perror(r[i].target);
+            }
+            if (r[i].saved != -1) {
+                close(r[i].saved);
+                r[i].saved = -1;
+            }
+            return i;
+        }
+
+        if (from == -2) {
+            close(fd);
+        } else if (from == fd) {
+            fcntl(fd, F_SETFD, 0);  // open() reused the target number
+        } else {
+            dup2(from, fd);
+            if (opened) {
+                close(from);
+            }
+        }
+        if (save) {
+            if (redirections_active < MAX_KEPT_FDS) {
+                redirect_stack[redirections_active] = fd;
+            }
+            redirections_active++;
+        }
+    }
+    return n;
+}
+
+/*
+ * Function: redirect_restore
+ * --------------------------
+ * Undoes the first n of 'total' redirections applied with save = 1 (in
+ * reverse order), then closes the here-document fds
+ */
+void redirect_restore(redirect_t *r, int n, int total) {
+    if (n > 0) {
+        out_flush();  // Reports of commands inside "{ ...; } >file" go to the file
+    }
+    redirections_active -= n;
+    for (int i = n - 1; i >= 0; i--) {
+        if (r[i].saved != -1) {
+            // dup2() would clear close-on-exec: internal fds keep it
+            dup3(r[i].saved, r[i].fd, r[i].saved_cloexec ? O_CLOEXEC : 0);
+            close(r[i].saved);
+        } else {
+            close(r[i].fd);  // Was not open before
+        }
+    }
+    redirect_close(r, total);
+}
+
+/*
+ * Function: redirect_keep
+ * -----------------------
+ * Makes the first n of 'total' redirections applied with save = 1
+ * permanent ("exec >log 3<input"): drops the saved copies and records
+ * the fds above 2, which commands inherit from now on
+ */
+void redirect_keep(redirect_t *r, int n, int total) {
+    redirections_active -= n;
+    for (int i = 0; i < n; i++) {
+        if (r[i].saved != -1) {
+            close(r[i].saved);
+            r[i].saved = -1;
+        }
+        int fd = r[i].fd;
+        int k = 0;
+        while (k < nexec_fds && exec_fds[k] != fd) {
+            k++;
+        }
+        int open_now = (fcntl(fd, F_GETFD) != -1);
+        if (k < nexec_fds && !open_now) {
+            exec_fds[k] = exec_fds[--nexec_fds];    // "exec 3<&-"
+        } else if (k == nexec_fds && open_now && fd > 2 && nexec_fds < MAX_KEPT_FDS) {
+            exec_fds[nexec_fds++] = fd;
+        }
+    }
+    shell_generation++;     // A parked standby child has the old fds
+    redirect_close(r, total);
+}
+
+/*
+ * Control groups (-o cgroup)
+ * --------------------------
+ * With -o cgroup every external command and background job runs in a
+ * cgroup v2 directory of its own (a "leaf"):
+ *
+ *   BASE/mini_bash.PID/shell     the shell itself
+ *   BASE/mini_bash.PID/cmd.N     one per command, removed after it
+ *
+ * BASE is $MINI_BASH_CGROUP, or the cgroup the shell was started in.
+ * The shell moves into "shell" because cgroup v2 hands controllers
+ * (cpu, memory) only to the children of a group without processes.
+ *
+ * clone3(CLONE_INTO_CGROUP) creates the child inside its leaf: its
+ * accounting starts with its first instruction and there is no window
+ * in which it could fork out of the leaf. After the wait the report
+ * gets the leaf's cpu.stat and memory.peak; cgroup.kill then ends
+ * whatever the command left behind (daemons, "cmd &" in a script)
+ * so that the leaf can be removed.
+ *
+ * "cgroup memory.max=100M cpu.max='50000 100000' cmd" is a command
+ * prefix: each FILE=VALUE is written to that file of the command's leaf
+ * before the command starts.
+ */
+
+#define CGROUP_FD           103     // mini_bash.PID directory; see redirect_shell_fd()
+#define MAX_CGROUP_SETTINGS 8       // FILE=VALUE words of one "cgroup" prefix
+#define MAX_STALE_CGROUPS   16      // Leaves still busy when their command ended
+
+int cgroup_fd = -1;         // BASE/mini_bash.PID, or -1 without -o cgroup
+int cgroup_base_fd = -1;    // BASE, where the shell goes back to at exit
+pid_t cgroup_owner = 0;     // Process that created the tree (atexit() runs in children too)
+unsigned cgroup_sequence = 0;   // Numbers the leaves
+unsigned cgroup_current = 0;    // Leaf of the command being started, or 0
+char *cgroup_settings[MAX_CGROUP_SETTINGS];    // From the "cgroup" prefix
+int ncgroup_settings = 0;
+unsigned cgroup_stale[MAX_STALE_CGROUPS];
+int ncgroup_stale = 0;
+char report_suffix[256];    // Appended to the next report line (statistics), or ""
+size_t report_suffix_len = 0;
+
+/*
+ * Function: report_append
+ * -----------------------
+ * Adds text to report_suffix (cut off when it is full)
+ */
+void report_append(const char *s) {
+    while (*s != '\0' && report_suffix_len + 1 < sizeof(report_suffix)) {
+        report_suffix[report_suffix_len++] = *s++;
+    }
+    report_suffix[report_suffix_len] = '\0';
+}
+
+/*
+ * Function: cgroup_write
+ * ----------------------
+ * Writes value to the control file 'file' of the cgroup directory dir
+ *
+ * Returns: 0 on success, -1 on error (errno set)
+ */
+int cgroup_write(int dir, const char *file, const char *value) {
+    int fd = openat(dir, file, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t n = write(fd, value, strlen(value));
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return (n == -1) ? -1 : 0;
+}
+
+/*
+ * Function: cgroup_read
+ * ---------------------
+ * Reads the control file 'file' of the cgroup directory dir (or any
+ * file, with an absolute path), up to size - 1 bytes
+ *
+ * Returns: The NUL-terminated contents, or NULL if it cannot be read
+ */
+char *cgroup_read(int dir, const char *file, char *buffer, size_t size) {
+    int fd = openat(dir, file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    // /proc hands out one page or one line per read()
+    size_t len = 0;
+    ssize_t n;
+    while (len + 1 < size && ((n = read(fd, buffer + len, size - 1 - len)) > 0 ||
+                              (n == -1 && errno == EINTR))) {
+        len += (n > 0) ? (size_t)n : 0;
+    }
+    close(fd);
+    buffer[len] = '\0';
+    return (len > 0) ? buffer : NULL;
+}
+
+/*
+ * Function: cgroup_leaf_name
+ * --------------------------
+ * Formats the name of leaf id ("cmd.N") into buffer
+ */
+char *cgroup_leaf_name(unsigned id, char *buffer) {
+    memcpy(buffer, "cmd.", 4);
+    int_to_string((int)id, buffer + 4);
+    return buffer;
+}
+
+/*
+ * Function: cgroup_base
+ * ---------------------
+ * Finds the directory of the cgroup the shell runs in: the cgroup2
+ * mount point from /proc/self/mountinfo, then the "0::" line of
+ * /proc/self/cgroup
+ *
+ * Returns: 0 with the path in 'path', or -1 if there is no cgroup v2
+ */
+int cgroup_base(char *path, size_t size) {
+    const char *env = getenv("MINI_BASH_CGROUP");
+    if (env != NULL && *env != '\0') {
+        if (strlen(env) >= size) {
+            return -1;
+        }
+        strcpy(path, env);
+        return 0;
+    }
+
+    // Lines: "ID PARENT MAJ:MIN ROOT MOUNTPOINT OPTIONS... - FSTYPE ..."
+    static char buffer[16384];
+    if (cgroup_read(AT_FDCWD, "/proc/self/mountinfo", buffer, sizeof(buffer)) == NULL) {
+        return -1;
+    }
+    size_t len = 0;
+    for (char *line = buffer; *line != '\0' && len == 0; ) {
+        char *end = strchr(line, '\n');
+        if (end != NULL) {
+            *end = '\0';
+        }
+        char *type = strstr(line, " - cgroup2 ");
+        if (type != NULL) {
+            char *mount = line;
+            for (int field = 0; field < 4 && mount != NULL; field++) {
+                mount = strchr(mount, ' ');
+                mount = (mount != NULL) ? mount + 1 : NULL;
+            }
+            char *mount_end = (mount != NULL) ? strchr(mount, ' ') : NULL;
+            if (mount_end != NULL && (size_t)(mount_end - mount) < size) {
+                len = (size_t)(mount_end - mount);
+                memcpy(path, mount, len);
+                path[len] = '\0';
+            }
+        }
+        line = (end != NULL) ? end + 1 : line + strlen(line);
+    }
+    if (len == 0) {
+        return -1;
+    }
+
+    // cgroup v2 is hierarchy 0: "0::/path"
+    if (cgroup_read(AT_FDCWD, "/proc/self/cgroup", buffer, sizeof(buffer)) == NULL) {
+        return -1;
+    }
+    char *own = strstr(buffer, "0::");
+    while (own != NULL && own != buffer && own[-1] != '\n') {
+        own = strstr(own + 3, "0::");
+    }
+    if (own == NULL) {
+        return -1;
+    }
+    own += 3;
+    size_t own_len = strcspn(own, "\n");
+    if (len + own_len >= size) {
+        return -1;
+    }
+    memcpy(path + len, own, own_len);
+    path[len + own_len] = '\0';
+    return 0;
+}
+
+/*
+ * Function: cgroup_remove
+ * -----------------------
+ * Kills whatever still runs in leaf id and removes it; a leaf whose
+ * processes have not died yet is kept in cgroup_stale[] and retried
+ *
+ * Returns: 0 if the leaf is gone, -1 if it is still there
+ */
+int cgroup_remove(unsigned id) {
+    if (cgroup_fd == -1 || id == 0) {
+        return 0;
+    }
+    char name[16];
+    cgroup_leaf_name(id, name);
+    if (unlinkat(cgroup_fd, name, AT_REMOVEDIR) == 0 || errno == ENOENT) {
+        return 0;
+    }
+    // Populated: processes that outlived the command (cgroup.kill: 5.14)
+    int dir = openat(cgroup_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir != -1) {
+        cgroup_write(dir, "cgroup.kill", "1");
+        close(dir);
+    }
+    if (unlinkat(cgroup_fd, name, AT_REMOVEDIR) == 0) {
+        return 0;
+    }
+    int known = 0;
+    for (int i = 0; i < ncgroup_stale; i++) {
+        known |= (cgroup_stale[i] == id);
+    }
+    if (!known && ncgroup_stale < MAX_STALE_CGROUPS) {
+        cgroup_stale[ncgroup_stale++] = id;
+    }
+    return -1;
+}
+
+/*
+ * Function: cgroup_sweep
+ * ----------------------
+ * Retries the removal of the leaves in cgroup_stale[]
+ */
+void cgroup_sweep(void) {
+    int kept = 0;
+    for (int i = 0; i < ncgroup_stale; i++) {
+        char name[16];
+        if (unlinkat(cgroup_fd, cgroup_leaf_name(cgroup_stale[i], name), AT_REMOVEDIR) == -1 &&
+            errno != ENOENT) {
+            cgroup_stale[kept++] = cgroup_stale[i];
+        }
+    }
+    ncgroup_stale = kept;
+}
+
+/*
+ * Function: cgroup_cleanup
+ * ------------------------
+ * atexit() handler: moves the shell back to BASE and removes the tree,
+ * giving killed leftovers a moment to die
+ */
+void cgroup_cleanup(void) {
+    if (cgroup_fd == -1 || getpid() != cgroup_owner) {
+        return;
+    }
+    standby_stop(1);    // Waits in the "shell" leaf
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].cgroup != 0) {
+            cgroup_remove(jobs[i].cgroup);
+        }
+    }
+    for (int tries = 0; ncgroup_stale > 0 && tries < 20; tries++) {
+        struct timespec pause = {0, 5 * 1000 * 1000};
+        nanosleep(&pause, NULL);
+        cgroup_sweep();
+    }
+    char number[12];
+    cgroup_write(cgroup_base_fd, "cgroup.procs", int_to_string((int)getpid(), number));
+    unlinkat(cgroup_fd, "shell", AT_REMOVEDIR);
+    close(cgroup_fd);
+    cgroup_fd = -1;
+
+    char name[32];
+    memcpy(name, "mini_bash.", 10);
+    int_to_string((int)cgroup_owner, name + 10);
+    unlinkat(cgroup_base_fd, name, AT_REMOVEDIR);
+    close(cgroup_base_fd);
+    cgroup_base_fd = -1;
+}
+
+/*
+ * Function: cgroup_init
+ * ---------------------
+ * Creates BASE/mini_bash.PID, moves the shell into its "shell" leaf
+ * and enables the cpu and memory controllers for the leaves (where
+ * BASE allows it; without them there is still cpu.stat)
+ *
+ * Returns: 0 on success, -1 if -o cgroup cannot work here
+ */
+int cgroup_init(void) {
+    char path[MAX_PATH];
+    if (cgroup_base(path, sizeof(path)) == -1) {
+        write_str(STDERR_FILENO, "mini_bash: cgroup: no cgroup v2 hierarchy\n");
+        return -1;
+    }
+    int base = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    char name[32];
+    memcpy(name, "mini_bash.", 10);
+    int_to_string((int)getpid(), name + 10);
+    if (base == -1 || (mkdirat(base, name, 0755) == -1 && errno != EEXIST)) {
+        write_str(STDERR_FILENO, "mini_bash: cgroup: ");
+        perror(path);
+        if (base != -1) {
+            close(base);
+        }
+        return -1;
+    }
+    int root = openat(base, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int shell = -1;
+    if (root != -1 && (mkdirat(root, "shell", 0755) == 0 || errno == EEXIST)) {
+        shell = openat(root, "shell", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (shell == -1 || cgroup_write(shell, "cgroup.procs", "0") == -1) {
+        write_str(STDERR_FILENO, "mini_bash: cgroup: ");
+        perror(name);
+        if (shell != -1) {
+            close(shell);
+            unlinkat(root, "shell", AT_REMOVEDIR);
+        }
+        if (root != -1) {
+            close(root);
+        }
+        unlinkat(base, name, AT_REMOVEDIR);
+        close(base);
+        return -1;
+    }
+    close(shell);
+
+    // One controller at a time: a missing one must not block the other
+    cgroup_write(base, "cgroup.subtree_control", "+cpu");
+    cgroup_write(base, "cgroup.subtree_control", "+memory");
+    cgroup_write(root, "cgroup.subtree_control", "+cpu");
+    cgroup_write(root, "cgroup.subtree_control", "+memory");
+
+    cgroup_fd = fcntl(root, F_DUPFD_CLOEXEC, CGROUP_FD);
+    close(root);
+    cgroup_base_fd = base;
+    cgroup_owner = getpid();
+    atexit(cgroup_cleanup);
+    return 0;
+}
+
+/*
+ * Function: cgroup_reset
+ * ----------------------
+ * Forgets the tree in a child that goes on running shell code: its
+ * commands stay in the child's own cgroup, and only the shell cleans up
+ */
+void cgroup_reset(void) {
+    if (spawn_cgroup != -1) {
+        close(spawn_cgroup);
+        spawn_cgroup = -1;
+    }
+    cgroup_current = 0;
+    if (cgroup_fd != -1) {
+        close(cgroup_fd);
+        close(cgroup_base_fd);
+        cgroup_fd = cgroup_base_fd = -1;
+    }
+}
+
+/*
+ * Function: cgroup_create
+ * -----------------------
+ * Creates the leaf for the next command and applies the settings of
+ * its "cgroup" prefix; process_spawn() puts the child there
+ *
+ * Returns: 0 with spawn_cgroup and cgroup_current set (or nothing to
+ *          do without -o cgroup), -1 if a setting was refused
+ */
+int cgroup_create(void) {
+    if (cgroup_fd == -1) {
+        return 0;
+    }
+    cgroup_sweep();
+    char name[16];
+    unsigned id = ++cgroup_sequence;
+    cgroup_leaf_name(id, name);
+    if (mkdirat(cgroup_fd, name, 0755) == -1) {
+        return 0;  // Run without one (e.g. cgroup.max.descendants)
+    }
+    int dir = openat(cgroup_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir == -1) {
+        unlinkat(cgroup_fd, name, AT_REMOVEDIR);
+        return 0;
+    }
+    for (int i = 0; i < ncgroup_settings; i++) {
+        char file[64];
+        char *eq = strchr(cgroup_settings[i], '=');
+        size_t len = (size_t)(eq - cgroup_settings[i]);
+        memcpy(file, cgroup_settings[i], len);
+        file[len] = '\0';
+        if (cgroup_write(dir, file, eq + 1) == -1) {
+            write_str(STDERR_FILENO, "cgroup: ");
+            perror(file);
+            close(dir);
+            unlinkat(cgroup_fd, name, AT_REMOVEDIR);
+            return -1;
+        }
+    }
+    spawn_cgroup = dir;
+    cgroup_current = id;
+    return 0;
+}
+
+/*
+ * Function: cgroup_stat_value
+ * ---------------------------
+ * Looks up "key VALUE" in the contents of a flat-keyed file (cpu.stat)
+ *
+ * Returns: VALUE, or -1 if key is missing
+ */
+long long cgroup_stat_value(const char *text, const char *key) {
+    size_t len = strlen(key);
+    for (const char *line = text; *line != '\0'; ) {
+        if (strncmp(line, key, len) == 0 && line[len] == ' ') {
+            return strtoll(line + len + 1, NULL, 10);
+        }
+        const char *end = strchr(line, '\n');
+        line = (end != NULL) ? end + 1 : line + strlen(line);
+    }
+    return -1;
+}
+
+/*
+ * Function: cgroup_report
+ * -----------------------
+ * Puts the usage of leaf id into report_suffix for command_status():
+ *
+ *   " (cgroup: cpu 12 ms, user 8 ms, system 4 ms, memory peak 1536 KiB)"
+ *
+ * (memory peak only with the memory controller, Linux 5.19+)
+ */
+void cgroup_report(unsigned id) {
+    char name[16];
+    int dir = (cgroup_fd == -1 || id == 0) ? -1 :
+              openat(cgroup_fd, cgroup_leaf_name(id, name), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir == -1) {
+        return;
+    }
+    char text[1024];
+    char number[12];
+    size_t start = report_suffix_len;
+    if (cgroup_read(dir, "cpu.stat", text, sizeof(text)) != NULL) {
+        static const char *const keys[] = {"usage_usec", "user_usec", "system_usec"};
+        static const char *const labels[] = {" (cgroup: cpu ", ", user ", ", system "};
+        for (int i = 0; i < 3; i++) {
+            long long usec = cgroup_stat_value(text, keys[i]);
+            if (usec < 0) {
+                break;
+            }
+            report_append(labels[i]);
+            report_append(int_to_string((int)(usec / 1000), number));
+            report_append(" ms");
+        }
+    }
+    if (cgroup_read(dir, "memory.peak", text, sizeof(text)) != NULL) {
+        report_append((report_suffix_len == start) ? " (cgroup: memory peak " : ", memory peak ");
+        report_append(int_to_string((int)(strtoll(text, NULL, 10) / 1024), number));
+        report_append(" KiB");
+    }
+    if (report_suffix_len > start) {
+        report_append(")");
+    }
+    close(dir);
+}
+
+/*
+ * Function: cgroup_finish
+ * -----------------------
+ * Ends the leaf of the command that has just been waited for: reports
+ * its usage (report: 1) and removes it, unless a job has taken it over
+ */
+void cgroup_finish(int report) {
+    if (spawn_cgroup != -1) {
+        close(spawn_cgroup);
+        spawn_cgroup = -1;
+    }
+    if (cgroup_current != 0) {
+        if (report) {
+            cgroup_report(cgroup_current);
+        }
+        cgroup_remove(cgroup_current);
+        cgroup_current = 0;
+    }
+}
+
+/*
+ * Background jobs
+ * ---------------
+ * "cmd &" forks a child that runs cmd and registers it in jobs[]; the
+ * event loop reaps it whenever its pidfd fires. At the next prompt an
+ * interactive shell reports finished jobs the way bash does:
+ *
+ *   [1]+  Done                    sleep 1
+ *   [2]+  Exit 3                  false_thing
+ */
+
+/*
+ * Function: job_describe_node
+ * ---------------------------
+ * Appends a short rendering of statement n to the scratch arena:
+ * simple commands word for word, compound commands by keyword
+ */
+void job_describe_node(program_t *p, int n) {
+    node_t *node = &p->nodes[n];
+    switch (node->type) {
+        case NODE_SIMPLE:
+            for (int i = 0; i < node->nwords; i++) {
+                if (i > 0) {
+                    arena_putc(&scratch, ' ');
+                }
+                append_string(word_text(p, node->word + i));
+            }
+            break;
+        case NODE_AND:
+        case NODE_OR:
+            job_describe_node(p, node->left);
+            append_string(node->type == NODE_AND ? " && " : " || ");
+            job_describe_node(p, node->right);
+            break;
+        case NODE_NOT:
+            append_string("! ");
+            job_describe_node(p, node->left);
+            break;
+        case NODE_IF:
+            append_string("if ...");
+            break;
+        case NODE_WHILE:
+            append_string((node->flags & LOOP_UNTIL) ? "until ..." : "while ...");
+            break;
+        case NODE_FOR:
+            append_string("for ...");
+            break;
+        case NODE_CASE:
+            append_string("case ...");
+            break;
+        default:
+            append_string("{ ...; }");
+            break;
+    }
+}
+
+/*
+ * Function: job_release
+ * ---------------------
+ * Frees the slot of a finished job
+ */
+void job_release(job_t *job) {
+    cgroup_remove(job->cgroup);
+    job->cgroup = 0;
+    free(job->text);
+    job->text = NULL;
+    job->process.pid = 0;
+    njobs--;
+}
+
+/*
+ * Function: job_add
+ * -----------------
+ * Registers a child as a job and watches its pidfd
+ *
+ * text: Command text, malloc()ed; the job owns it from now on
+ *
+ * Returns: The slot, or -1 if the table is full (text is freed)
+ */
+int job_add(process_t *child, char *text) {
+    // Scripts never report jobs, so finished ones can be dropped
+    int slot = 0;
+    while (slot < MAX_JOBS && jobs[slot].process.pid != 0 &&
+           !(jobs[slot].done && !jobs_report)) {
+        slot++;
+    }
+    if (slot < MAX_JOBS && jobs[slot].process.pid != 0) {
+        job_release(&jobs[slot]);
+    }
+    if (slot == MAX_JOBS || event_init(0) == -1) {
+        write_str(STDERR_FILENO, "mini_bash: too many jobs, waiting\n");
+        free(text);
+        return -1;
+    }
+
+    job_t *job = &jobs[slot];
+    job->text = text;
+    job->process = *child;
+    job->done = 0;
+    job->stopped = 0;
+    job->notify = 0;
+    job->has_modes = 0;
+    job->cgroup = cgroup_current;   // The job's leaf lives as long as the job
+    cgroup_current = 0;
+    job->order = ++job_sequence;
+    // A stopped foreground command started before it became a job
+    job->started_ns = (child->pid == command_pid) ? command_started_ns : trace_now();
+    njobs++;
+    jobs_running++;
+
+    if (child->pidfd != -1) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = EVENT_KEY(EVENT_CHILD, slot);
+        epoll_ctl(event_fd, EPOLL_CTL_ADD, child->pidfd, &ev);
+    }
+    return slot;
+}
+
+/*
+ * Function: job_start
+ * -------------------
+ * Registers a forked background child as a job
+ *
+ * Returns: The job number ([N]), or 0 if the table is full (the child
+ *          is then waited for at once)
+ */
+int job_start(process_t *child, program_t *p, int n) {
+    size_t scratch_mark = scratch.top;
+    job_describe_node(p, n);
+    arena_putc(&scratch, '\0');
+    int slot = job_add(child, strdup(scratch.base + scratch_mark));
+    scratch.top = scratch_mark;
+    if (slot == -1) {
+        int status;
+        process_wait(child, &status);
+        return 0;
+    }
+    return slot + 1;
+}
+
+/*
+ * Function: job_current
+ * ---------------------
+ * Finds the job that "fg" and "bg" use without an argument ("%+"): the
+ * most recently stopped one, else the most recently started one
+ *
+ * skip: A slot to pass over (-1: none); the result is then "%-"
+ *
+ * Returns: The slot, or -1 if there are no jobs
+ */
+int job_current(int skip) {
+    int best = -1;
+    for (int i = 0; i < MAX_JOBS; i++) {
+        job_t *job = &jobs[i];
+        if (job->process.pid == 0 || i == skip) {
+            continue;
+        }
+        if (best == -1 || job->stopped > jobs[best].stopped ||
+            (job->stopped == jobs[best].stopped && job->order > jobs[best].order)) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+/*
+ * Function: job_print
+ * -------------------
+ * Queues bash's line for job 'slot':
+ *
+ *   [1]+  Running                 sleep 10 &
+ *   [2]-  Stopped                 vi notes
+ */
+void job_print(int slot) {
+    job_t *job = &jobs[slot];
+    char line[64];
+    char number[12];
+    size_t len = 0;
+    line[len++] = '[';
+    const char *id = int_to_string(slot + 1, number);
+    memcpy(line + len, id, strlen(id));
+    len += strlen(id);
+    int current = job_current(-1);
+    line[len++] = ']';
+    line[len++] = (slot == current) ? '+' : (slot == job_current(current)) ? '-' : ' ';
+    line[len++] = ' ';
+    line[len++] = ' ';
+
+    int status = job->status;
+    const char *state;
+    if (!job->done) {
+        state = job->stopped ? "Stopped" : "Running";
+    } else if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        state = "Done";
+    } else if (WIFEXITED(status)) {
+        state = "Exit ";
+    } else {
+        state = "Killed by signal ";
+    }
+    memcpy(line + len, state, strlen(state));
+    len += strlen(state);
+    if (job->done && !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+        const char *code = int_to_string(WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status), number);
+        memcpy(line + len, code, strlen(code));
+        len += strlen(code);
+    }
+    // Pad the state column to bash's width
+    while (len < 30) {
+        line[len++] = ' ';
+    }
+    out_write(line, len);
+    out_str(job->text);
+    if (!job->done && !job->stopped) {
+        out_write(" &", 2);
+    }
+    out_write("\n", 1);
+}
+
+/*
+ * Function: jobs_notify
+ * ---------------------
+ * Reports finished jobs ("[1]+  Done  cmd"), freeing their slots, and
+ * jobs that stopped in the background. Called before each interactive
+ * prompt.
+ */
+void jobs_notify(void) {
+    for (int i = 0; i < MAX_JOBS && njobs > 0; i++) {
+        job_t *job = &jobs[i];
+        if (job->process.pid == 0 || !(job->done || job->notify)) {
+            continue;
+        }
+        job_print(i);
+        job->notify = 0;
+        if (job->done) {
+            job_release(job);
+        }
+    }
+}
+
+/*
+ * Job control
+ * -----------
+ * An interactive shell at a terminal puts itself in a process group of
+ * its own and hands the terminal (tcsetpgrp()) to the process group of
+ * each foreground command, taking it back when the command exits or
+ * stops. Ctrl+C and Ctrl+Z therefore reach the command, not the shell.
+ * A command stopped with Ctrl+Z becomes a job; "fg" gives it the
+ * terminal again, "bg" lets it run on in the background.
+ */
+
+/*
+ * Function: job_control_init
+ * --------------------------
+ * Turns job control on when stdin is a terminal
+ */
+void job_control_init(void) {
+    if (!isatty(STDIN_FILENO)) {
+        return;
+    }
+    // Started in the background ("mini_bash &"): wait to be brought back
+    pid_t pgid;
+    while (tcgetpgrp(STDIN_FILENO) != (pgid = getpgrp())) {
+        kill(-pgid, SIGTTIN);
+    }
+
+    terminal_fd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, TERMINAL_FD);
+    shell_pgid = getpid();
+    if (terminal_fd == -1 || (pgid != shell_pgid && setpgid(0, 0) == -1)) {
+        return;
+    }
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    tcsetpgrp(terminal_fd, shell_pgid);
+    tcgetattr(terminal_fd, &shell_modes);
+    job_control = 1;
+}
+
+/*
+ * Function: terminal_reclaim
+ * --------------------------
+ * Takes the terminal back after a foreground command. A command that
+ * stopped or was killed may have left the terminal in raw mode: the
+ * prompt's modes are restored then.
+ *
+ * status: Wait status of the command
+ */
+void terminal_reclaim(int status) {
+    if (!job_control) {
+        return;
+    }
+    tcsetpgrp(terminal_fd, shell_pgid);
+    if (WIFSTOPPED(status) || WIFSIGNALED(status)) {
+        tcsetattr(terminal_fd, TCSADRAIN, &shell_modes);
+    }
+}
+
+/*
+ * Function: job_suspend
+ * ---------------------
+ * Turns a foreground command that stopped (Ctrl+Z) into a job:
+ *
+ *   [1]+  Stopped                 sleep 10
+ *
+ * argv: The command's words, for "jobs"
+ * status: Its stop status
+ *
+ * Returns: 'status', or the exit status if the job table was full (the
+ *          command is then continued and waited for)
+ */
+int job_suspend(process_t *child, char **argv, int status) {
+    size_t scratch_mark = scratch.top;
+    for (char **a = argv; *a != NULL; a++) {
+        if (a != argv) {
+            arena_putc(&scratch, ' ');
+        }
+        append_string(*a);
+    }
+    arena_putc(&scratch, '\0');
+    int slot = job_add(child, strdup(scratch.base + scratch_mark));
+    scratch.top = scratch_mark;
+    if (slot == -1) {
+        kill(-child->pgid, SIGCONT);
+        child->pgid = 0;  // No more stops: wait for the exit
+        process_wait(child, &status);
+        return status;
+    }
+
+    job_t *job = &jobs[slot];
+    job->stopped = 1;
+    job->status = status;
+    job->has_modes = (tcgetattr(terminal_fd, &job->modes) == 0);
+    out_write("\n", 1);
+    job_print(slot);
+    return status;
+}
+
+/*
+ * Function: command_status
+ * ------------------------
+ * Reports how an external command ended and converts its wait status
+ *
+ * Returns: WEXITSTATUS() of the child, or 128 + signal number if the
+ *          child was killed or stopped by a signal (like bash)
+ */
+int command_status(int status) {
+    // Child finished successfully
+    // Extract exit code using WIFEXITED and WEXITSTATUS macros
+    if (WIFEXITED(status)) {
+        // Child exited normally
+        int exit_code = WEXITSTATUS(status);
+
+        // Print "Command completed with return code: X"
+        // (not inside $(...), where stdout is the captured output)
+        if (report_completion) {
+            out_write("Command completed with return code: ", 36);
+
+            // Convert exit code to string and print it
+            char code_str[12];  // Enough for 32-bit int
+            int_to_string(exit_code, code_str);
+            out_str(code_str);
+            out_str(report_suffix);
+            out_write("\n", 1);
+        }
+        report_suffix[report_suffix_len = 0] = '\0';
+        return exit_code;
+    }
+
+    // Stopped (Ctrl+Z): job_suspend() has printed the job instead
+    if (WIFSTOPPED(status)) {
+        report_suffix[report_suffix_len = 0] = '\0';
+        return 128 + WSTOPSIG(status);
+    }
+
+    // Child terminated abnormally (signal, etc.)
+    if (report_completion) {
+        out_write("Command terminated abnormally", 29);
+        out_str(report_suffix);
+        out_write("\n", 1);
+    }
+    report_suffix[report_suffix_len = 0] = '\0';
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return 1;
+}
+
+/*
+ * Resource limits
+ * ---------------
+ * "ulimit -n 256" stores a limit for every command the shell runs from
+ * then on; "ulimit -t 10 cmd" limits only cmd. Neither limits the shell
+ * itself: a small -v would otherwise stop it from growing its arenas.
+ *
+ * The limits are applied with prlimit() between fork and exec, in the
+ * child (fork, zygote: the request carries them). The standby child is
+ * already waiting when the command is known, so the parent applies
+ * them to its pid instead, before sending the request.
+ */
+#define MAX_LIMITS 16       // Covers every RLIMIT_* resource
+
+typedef struct {
+    uint32_t soft;          // Bit r: cur[r] is set
+    uint32_t hard;          // Bit r: max[r] is set
+    uint64_t cur[MAX_LIMITS];
+    uint64_t max[MAX_LIMITS];
+} limits_t;
+
+typedef struct {
+    char option;
+    int resource;
+    int unit;               // Bytes per unit of the value given
+    const char *name;       // For "ulimit -a"
+    const char *units;      // For "ulimit -a", or NULL
+} limit_info_t;
+
+limit_info_t limit_info[] = {
+    {'c', RLIMIT_CORE, 1024, "core file size", "blocks"},
+    {'d', RLIMIT_DATA, 1024, "data seg size", "kbytes"},
+    {'f', RLIMIT_FSIZE, 1024, "file size", "blocks"},
+    {'l', RLIMIT_MEMLOCK, 1024, "max locked memory", "kbytes"},
+    {'n', RLIMIT_NOFILE, 1, "open files", NULL},
+    {'s', RLIMIT_STACK, 1024, "stack size", "kbytes"},
+    {'t', RLIMIT_CPU, 1, "cpu time", "seconds"},
+    {'u', RLIMIT_NPROC, 1, "max user processes", NULL},
+    {'v', RLIMIT_AS, 1024, "virtual memory", "kbytes"},
+    {0, 0, 0, NULL, NULL}
+};
+
+limits_t shell_limits;      // "ulimit -n 256": every command from now on
+limits_t command_limits;    // "ulimit -n 256 cmd": this command only
+
+/*
+ * Function: limits_merge
+ * ----------------------
+ * Overlays the limits in 'from' on 'to'
+ */
+void limits_merge(limits_t *to, const limits_t *from) {
+    for (int r = 0; r < MAX_LIMITS; r++) {
+        if (from->soft & (1u << r)) {
+            to->cur[r] = from->cur[r];
+        }
+        if (from->hard & (1u << r)) {
+            to->max[r] = from->max[r];
+        }
+    }
+    to->soft |= from->soft;
+    to->hard |= from->hard;
+}
+
+/*
+ * Function: limits_apply
+ * ----------------------
+ * Sets the limits of process 'pid' (0: the calling process); the half
+ * of a limit that is not given keeps its value
+ *
+ * Returns: 0 on success, -1 if prlimit() refused one (errno set)
+ */
+int limits_apply(pid_t pid, const limits_t *limits) {
+    for (int r = 0; r < MAX_LIMITS; r++) {
+        if (!((limits->soft | limits->hard) & (1u << r))) {
+            continue;
+        }
+        struct rlimit rl;
+        if (prlimit(pid, (__rlimit_resource_t)r, NULL, &rl) == -1) {
+            return -1;
+        }
+        if (limits->soft & (1u << r)) {
+            rl.rlim_cur = (rlim_t)limits->cur[r];
+        }
+        if (limits->hard & (1u << r)) {
+            rl.rlim_max = (rlim_t)limits->max[r];
+        }
+        if (prlimit(pid, (__rlimit_resource_t)r, &rl, NULL) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Function: command_limits_apply
+ * ------------------------------
+ * Gives process 'pid' (0: the calling process) the limits of the
+ * command being run: shell_limits, overlaid with command_limits
+ *
+ * Returns: 0 on success, -1 on error (errno set)
+ */
+int command_limits_apply(pid_t pid) {
+    if ((shell_limits.soft | shell_limits.hard | command_limits.soft | command_limits.hard) == 0) {
+        return 0;
+    }
+    limits_t merged = shell_limits;
+    limits_merge(&merged, &command_limits);
+    return limits_apply(pid, &merged);
+}
+
+/*
+ * Function: ulimit_parse
+ * ----------------------
+ * Parses "[-S|-H] -X VALUE..." (VALUE: a number or "unlimited") into
+ * 'limits'. An option that is the last word, or is followed by another
+ * option, asks for the current value; any other word after it must be
+ * a value.
+ *
+ * query: Receives the limit_info index of an option given without a
+ *        value (-1 if none); -a gives MAX_LIMITS
+ * hard_query: Receives 1 if -H asks for hard limits
+ *
+ * Returns: Index of the first word after the options, -1 after an
+ *          invalid option or -2 after an invalid number (reported)
+ */
+int ulimit_parse(int argc, char **argv, limits_t *limits, int *query, int *hard_query) {
+    int soft = 1;
+    int hard = 1;
+    int i = 1;
+    *query = -1;
+    *hard_query = 0;
+    memset(limits, 0, sizeof(*limits));
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0' && argv[i][2] == '\0'; i++) {
+        char option = argv[i][1];
+        if (option == 'S' || option == 'H') {
+            soft = (option == 'S');
+            hard = (option == 'H');
+            *hard_query = hard;
+            continue;
+        }
+        if (option == 'a') {
+            *query = MAX_LIMITS;
+            continue;
+        }
+        int k = 0;
+        while (limit_info[k].option != 0 && limit_info[k].option != option) {
+            k++;
+        }
+        if (limit_info[k].option == 0) {
+            write_str(STDOUT_FILENO, "ulimit: ");
+            write_str(STDOUT_FILENO, argv[i]);
+            write_str(STDOUT_FILENO, ": invalid option\n");
+            return -1;
+        }
+
+        // The value is the next word, unless there is none or it is
+        // another option
+        if (i + 1 == argc || (argv[i + 1][0] == '-' && argv[i + 1][1] != '\0')) {
+            *query = k;
+            continue;
+        }
+        const char *value = argv[i + 1];
+        uint64_t v = (uint64_t)RLIM_INFINITY;
+        if (strcmp(value, "unlimited") != 0) {
+            char *end;
+            v = strtoull(value, &end, 10) * (uint64_t)limit_info[k].unit;
+            if (*value < '0' || *value > '9' || *end != '\0') {
+                write_str(STDOUT_FILENO, "ulimit: ");
+                write_str(STDOUT_FILENO, value);
+                write_str(STDOUT_FILENO, ": invalid number\n");
+                return -2;
+            }
+        }
+        int r = limit_info[k].resource;
+        if (soft) {
+            limits->soft |= 1u << r;
+            limits->cur[r] = v;
+        }
+        if (hard) {
+            limits->hard |= 1u << r;
+            limits->max[r] = v;
+        }
+        i++;
+    }
+    return i;
+}
+
+/*
+ * Function: limits_check
+ * ----------------------
+ * Checks that a child could apply these limits: without privilege the
+ * hard limits cannot go up, and even root cannot go past some ceilings
+ * (fs.nr_open for -n), which only trying finds out. The try is undone.
+ *
+ * Returns: -1 if the limits can be applied, else the limit_info index
+ *          of one that cannot (reported)
+ */
+int limits_check(const limits_t *limits) {
+    for (int k = 0; limit_info[k].option != 0; k++) {
+        int r = limit_info[k].resource;
+        struct rlimit old;
+        if (!((limits->soft | limits->hard) & (1u << r)) ||
+            getrlimit((__rlimit_resource_t)r, &old) == -1) {
+            continue;
+        }
+        struct rlimit rl = old;
+        if (limits->soft & (1u << r)) {
+            rl.rlim_cur = (rlim_t)limits->cur[r];
+        }
+        if (limits->hard & (1u << r)) {
+            rl.rlim_max = (rlim_t)limits->max[r];
+        }
+
+        const char *error = NULL;
+        if (rl.rlim_cur > rl.rlim_max) {
+            error = ": soft limit above the hard limit\n";
+        } else if (rl.rlim_max > old.rlim_max &&
+                   (geteuid() != 0 || setrlimit((__rlimit_resource_t)r, &rl) == -1)) {
+            error = ": cannot raise the hard limit\n";
+        } else if (rl.rlim_max > old.rlim_max) {
+            setrlimit((__rlimit_resource_t)r, &old);
+        }
+        if (error != NULL) {
+            char option[3] = {'-', limit_info[k].option, '\0'};
+            write_str(STDOUT_FILENO, "ulimit: ");
+            write_str(STDOUT_FILENO, option);
+            write_str(STDOUT_FILENO, error);
+            return k;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Function: ulimit_print
+ * ----------------------
+ * Prints the limit commands would get: the stored one, else the
+ * shell's own
+ *
+ * k: limit_info index
+ * hard: 1 for the hard limit (-H)
+ * label: 1 for the "ulimit -a" layout:
+ *
+ *   open files              (-n) 1024
+ */
+void ulimit_print(int k, int hard, int label) {
+    int r = limit_info[k].resource;
+    struct rlimit rl;
+    getrlimit((__rlimit_resource_t)r, &rl);
+    uint64_t v = hard ? rl.rlim_max : rl.rlim_cur;
+    if (hard && (shell_limits.hard & (1u << r))) {
+        v = shell_limits.max[r];
+    } else if (!hard && (shell_limits.soft & (1u << r))) {
+        v = shell_limits.cur[r];
+    }
+
+    if (label) {
+        char line[48];
+        size_t len = strlen(limit_info[k].name);
+        memcpy(line, limit_info[k].name, len);
+        while (len < 24) {
+            line[len++] = ' ';
+        }
+        line[len++] = '(';
+        if (limit_info[k].units != NULL) {
+            memcpy(line + len, limit_info[k].units, strlen(limit_info[k].units));
+            len += strlen(limit_info[k].units);
+            line[len++] = ',';
+            line[len++] = ' ';
+        }
+        line[len++] = '-';
+        line[len++] = limit_info[k].option;
+        line[len++] = ')';
+        line[len++] = ' ';
+        out_write(line, len);
+    }
+    if (v == (uint64_t)RLIM_INFINITY) {
+        out_str("unlimited\n");
+        return;
+    }
+    char digits[24];
+    size_t n = sizeof(digits);
+    digits[--n] = '\n';
+    v /= (uint64_t)limit_info[k].unit;
+    do {
+        digits[--n] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v > 0);
+    out_write(digits + n, sizeof(digits) - n);
+}
+
+/*
+ * CPU placement and priorities
+ * ----------------------------
+ * Four more command prefixes, named and used like the util-linux and
+ * coreutils programs, set how the kernel schedules one command:
+ *
+ *   taskset MASK cmd, taskset -c 0-3,8 cmd      CPU affinity
+ *   nice [-n N] cmd                             nice value (default +10)
+ *   chrt -b|-i|-o|-f|-r PRIORITY cmd            policy (SCHED_BATCH, ...)
+ *   ionice -c CLASS [-n LEVEL] cmd              I/O priority
+ *
+ * Like resource limits they are collected in command_sched and applied
+ * between fork and exec (fork, zygote) or to the standby child's pid.
+ *
+ * With -o batch every background job ("cmd &") is pinned to one CPU,
+ * taken round-robin from $BATCH_CPUS (a CPU list, default: every CPU
+ * the shell may use), so parallel jobs spread over the set instead of
+ * crowding the CPUs the scheduler happens to prefer.
+ */
+#define SCHED_SET_CPUS   0x1
+#define SCHED_SET_NICE   0x2
+#define SCHED_SET_POLICY 0x4
+#define SCHED_SET_IOPRIO 0x8
+
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+
+typedef struct {
+    uint32_t set;           // SCHED_SET_* bits
+    int32_t nice;           // Nice value (absolute)
+    int32_t policy;         // SCHED_OTHER, SCHED_BATCH, SCHED_IDLE, SCHED_FIFO, SCHED_RR
+    int32_t priority;       // Real-time priority (FIFO, RR), else 0
+    int32_t ioprio;         // Class << IOPRIO_CLASS_SHIFT | level
+    cpu_set_t cpus;
+} sched_t;
+
+sched_t command_sched;      // Prefixes of the command being run
+unsigned batch_sequence = 0;    // Picks the CPU of the next job (-o batch)
+
+/*
+ * Function: sched_apply
+ * ---------------------
+ * Applies the settings in s to process 'pid' (0: the calling process)
+ *
+ * Returns: NULL on success, else the name of the prefix whose setting
+ *          the kernel refused (errno set)
+ */
+const char *sched_apply(pid_t pid, const sched_t *s) {
+    // The policy first: SCHED_IDLE ignores the nice value, others keep it
+    if (s->set & SCHED_SET_POLICY) {
+        struct sched_param param;
+        param.sched_priority = s->priority;
+        if (sched_setscheduler(pid, s->policy, &param) == -1) {
+            return "chrt";
+        }
+    }
+    if ((s->set & SCHED_SET_NICE) && setpriority(PRIO_PROCESS, (id_t)pid, s->nice) == -1) {
+        return "nice";
+    }
+    if ((s->set & SCHED_SET_CPUS) && sched_setaffinity(pid, sizeof(cpu_set_t), &s->cpus) == -1) {
+        return "taskset";
+    }
+    if ((s->set & SCHED_SET_IOPRIO) &&
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, (int)pid, s->ioprio) == -1) {
+        return "ionice";
+    }
+    return NULL;
+}
+
+/*
+ * Function: cpulist_parse
+ * -----------------------
+ * Parses a CPU list ("0-3,8,10-15:2", as in taskset -c) or, with
+ * mask set, a hexadecimal CPU mask ("f", "0x30")
+ *
+ * Returns: 0 with the CPUs in 'cpus', -1 if s is malformed or empty
+ */
+int cpulist_parse(const char *s, int mask, cpu_set_t *cpus) {
+    CPU_ZERO(cpus);
+    if (mask) {
+        if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+            s += 2;
+        }
+        size_t len = strlen(s);
+        if (len == 0 || len * 4 > CPU_SETSIZE) {
+            return -1;
+        }
+        for (size_t i = 0; i < len; i++) {
+            char c = s[len - 1 - i];
+            int digit = (c >= '0' && c <= '9') ? c - '0' :
+                        (c >= 'a' && c <= 'f') ? c - 'a' + 10 :
+                        (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+            if (digit == -1) {
+                return -1;
+            }
+            for (int bit = 0; bit < 4; bit++) {
+                if (digit & (1 << bit)) {
+                    CPU_SET(i * 4 + (size_t)bit, cpus);
+                }
+            }
+        }
+        return CPU_COUNT(cpus) > 0 ? 0 : -1;
+    }
+
+    while (*s != '\0') {
+        char *end;
+        long first = strtol(s, &end, 10);
+        long last = first;
+        long stride = 1;
+        if (end == s || first < 0) {
+            return -1;
+        }
+        if (*end == '-') {
+            s = end + 1;
+            last = strtol(s, &end, 10);
+            if (end == s || last < first) {
+                return -1;
+            }
+            if (*end == ':') {
+                s = end + 1;
+                stride = strtol(s, &end, 10);
+                if (end == s || stride < 1) {
+                    return -1;
+                }
+            }
+        }
+        if (last >= CPU_SETSIZE || (*end != ',' && *end != '\0')) {
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu += stride) {
+            CPU_SET((size_t)cpu, cpus);
+        }
+        s = (*end == ',') ? end + 1 : end;
+    }
+    return CPU_COUNT(cpus) > 0 ? 0 : -1;
+}
+
+/*
+ * Function: parse_int
+ * -------------------
+ * Parses a whole decimal number with an optional sign
+ *
+ * Returns: 0 with the number in *value, -1 if s is not one
+ */
+int parse_int(const char *s, int *value) {
+    char *end;
+    errno = 0;
+    long v = strtol(s, &end, 10);
+    if (end == s || *end != '\0' || errno != 0 || v < -1000000 || v > 1000000) {
+        return -1;
+    }
+    *value = (int)v;
+    return 0;
+}
+
+/*
+ * Function: sched_prefix
+ * ----------------------
+ * Strips a "taskset", "nice", "chrt" or "ionice" prefix from the front
+ * of argv into command_sched (see command_prefix())
+ *
+ * Returns: Number of words consumed: 0 if there is no such prefix, or
+ *          a form it does not handle (then /bin/taskset etc. runs), -1
+ *          if taskset names no usable CPU
+ */
+int sched_prefix(int argc, char **argv) {
+    if (argc == 0) {
+        return 0;
+    }
+    sched_t *s = &command_sched;
+    int i = 1;
+    int handled = 1;        // 0: a form only the real program knows
+
+    if (strcmp(argv[0], "taskset") == 0) {
+        int list = (i < argc && (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--cpu-list") == 0));
+        i += list;
+        cpu_set_t allowed;
+        if (i + 1 >= argc || cpulist_parse(argv[i], !list, &s->cpus) == -1) {
+            handled = 0;
+        } else if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0 &&
+                   (CPU_AND(&allowed, &allowed, &s->cpus), CPU_COUNT(&allowed) == 0)) {
+            write_str(STDOUT_FILENO, "taskset: no usable CPU in ");
+            write_str(STDOUT_FILENO, argv[i]);
+            write_str(STDOUT_FILENO, "\n");
+            return -1;
+        } else {
+            s->set |= SCHED_SET_CPUS;
+            i++;
+        }
+    } else if (strcmp(argv[0], "nice") == 0) {
+        // Relative to the shell's value (or an earlier nice prefix)
+        int adjustment = 10;
+        int ok = 1;
+        if (i + 1 < argc && strcmp(argv[i], "-n") == 0) {
+            ok = (parse_int(argv[i + 1], &adjustment) == 0);
+            i += 2;
+        } else if (i < argc && argv[i][0] == '-' && parse_int(argv[i] + 1, &adjustment) == 0) {
+            i++;   // Historical "nice -5 cmd"
+        }
+        if (ok && i < argc) {
+            int base = (s->set & SCHED_SET_NICE) ? s->nice : getpriority(PRIO_PROCESS, 0);
+            int value = base + adjustment;
+            s->nice = (value < -20) ? -20 : (value > 19) ? 19 : value;
+            s->set |= SCHED_SET_NICE;
+        } else {
+            handled = 0;
+        }
+    } else if (strcmp(argv[0], "chrt") == 0) {
+        static const struct { const char *flag; int policy; } policies[] = {
+            {"-o", SCHED_OTHER}, {"-b", SCHED_BATCH}, {"-i", SCHED_IDLE},
+            {"-f", SCHED_FIFO}, {"-r", SCHED_RR}, {NULL, 0}
+        };
+        int policy = SCHED_RR;  // Like chrt(1)
+        for (int k = 0; i < argc && policies[k].flag != NULL; k++) {
+            if (strcmp(argv[i], policies[k].flag) == 0) {
+                policy = policies[k].policy;
+                i++;
+                break;
+            }
+        }
+        int priority;
+        if (i + 1 >= argc || parse_int(argv[i], &priority) == -1 ||
+            priority < sched_get_priority_min(policy) || priority > sched_get_priority_max(policy)) {
+            handled = 0;
+        } else {
+            s->policy = policy;
+            s->priority = priority;
+            s->set |= SCHED_SET_POLICY;
+            i++;
+        }
+    } else if (strcmp(argv[0], "ionice") == 0) {
+        // Classes: 1 realtime, 2 best-effort, 3 idle; levels 0 (high) - 7
+        int class = 2;
+        int level = 4;
+        int ok = 1;
+        while (ok && i + 1 < argc && argv[i][0] == '-') {
+            int *target = (strcmp(argv[i], "-c") == 0) ? &class :
+                          (strcmp(argv[i], "-n") == 0) ? &level : NULL;
+            ok = (target != NULL && parse_int(argv[i + 1], target) == 0);
+            i += 2;
+        }
+        if (!ok || i >= argc || class < 1 || class > 3 || level < 0 || level > 7) {
+            handled = 0;
+        } else {
+            s->ioprio = (class << IOPRIO_CLASS_SHIFT) | (class == 3 ? 0 : level);
+            s->set |= SCHED_SET_IOPRIO;
+        }
+    } else {
+        return 0;
+    }
+
+    // "taskset -p PID", "nice" alone, "chrt -m"...: the program runs
+    return handled ? i : 0;
+}
+
+/*
+ * Function: batch_cpu
+ * -------------------
+ * Picks the CPU for the next background job with -o batch: the next
+ * one of $BATCH_CPUS, else of the CPUs the shell may run on
+ *
+ * Returns: The CPU number, or -1 without -o batch
+ */
+int batch_cpu(void) {
+    if (!option_batch) {
+        return -1;
+    }
+    cpu_set_t cpus;
+    const char *list = var_get("BATCH_CPUS", 10);
+    if ((list == NULL || cpulist_parse(list, 0, &cpus) == -1) &&
+        sched_getaffinity(0, sizeof(cpus), &cpus) == -1) {
+        return -1;
+    }
+    int count = CPU_COUNT(&cpus);
+    if (count == 0) {
+        return -1;
+    }
+    int n = (int)(batch_sequence++ % (unsigned)count);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &cpus) && n-- == 0) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Performance counters (perf stat prefix)
+ * ---------------------------------------
+ * "perf stat [-e EVENT,...] command" counts events of the command with
+ * perf_event_open() and adds them to its completion report:
+ *
+ *   Command completed with return code: 0 (perf: task-clock 1.204 ms,
+ *   context-switches 1, page-faults 98, cycles 3519812, ...)
+ *
+ * The counters are opened disabled, with enable_on_exec and inherit:
+ * they start counting when the child execs the program, so the
+ * shell's own work before the exec is left out, and every process the
+ * program forks counts into them too. The kernel adds the counts of
+ * exited children to the counter the shell holds, so one read() after
+ * the wait gives the total.
+ *
+ * With a fork() the counters are opened on the shell itself just
+ * before it forks (the shell never execs, so its own copy stays off),
+ * and the child inherits them. The standby child already exists and is
+ * blocked until it gets its command, so they are opened on it instead.
+ * The zygote's children are neither, so a perf prefix bypasses it.
+ *
+ * Virtual machines often have no hardware counters. Hardware events
+ * that cannot be opened are dropped from the default set; when none of
+ * an explicit -e list can be counted, the software defaults are used.
+ */
+#define MAX_PERF_EVENTS 8
+
+typedef struct {
+    const char *name;
+    uint32_t type;          // PERF_TYPE_HARDWARE or PERF_TYPE_SOFTWARE
+    uint64_t config;
+} perf_kind_t;
+
+static const perf_kind_t perf_kinds[] = {
+    {"task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+    {"context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+    {"page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    // Only by name (-e)
+    {"cpu-migrations", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS},
+    {"minor-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MIN},
+    {"major-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MAJ},
+    {"cache-references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+    {"branches", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+    {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {NULL, 0, 0}
+};
+#define PERF_DEFAULT_EVENTS 6   // The first six: software first (the fallback)
+#define PERF_SOFTWARE_EVENTS 3
+
+typedef struct {
+    int n;                          // Events to count; 0: no perf prefix
+    int listed;                     // Chosen with -e (failures are reported)
+    int kinds[MAX_PERF_EVENTS];     // Index into perf_kinds
+    int fds[MAX_PERF_EVENTS];       // Open counters (-1: could not be opened)
+    int open;                       // The fds are valid
+} perf_t;
+
+perf_t command_perf;            // perf stat prefix of the current command
+
+/*
+ * Function: perf_prefix
+ * ---------------------
+ * Strips a "perf stat [-e EVENT,...]" prefix from the front of argv
+ * into command_perf (see command_prefix())
+ *
+ * Returns: Number of words consumed (0 if there is no such prefix), or
+ *          -1 after a usage error
+ */
+int perf_prefix(int argc, char **argv) {
+    if (argc < 2 || strcmp(argv[0], "perf") != 0 || strcmp(argv[1], "stat") != 0) {
+        return 0;
+    }
+    perf_t *p = &command_perf;
+    int i = 2;
+    p->n = 0;
+    p->listed = 0;
+    if (i + 1 < argc && strcmp(argv[i], "-e") == 0) {
+        // Comma-separated names, like perf(1)
+        const char *s = argv[i + 1];
+        while (*s != '\0') {
+            size_t len = strcspn(s, ",");
+            int k = 0;
+            while (perf_kinds[k].name != NULL &&
+                   !(strlen(perf_kinds[k].name) == len && strncmp(perf_kinds[k].name, s, len) == 0)) {
+                k++;
+            }
+            if (perf_kinds[k].name == NULL || p->n == MAX_PERF_EVENTS) {
+                write_str(STDOUT_FILENO, "perf: unknown or too many events: ");
+                write_str(STDOUT_FILENO, argv[i + 1]);
+                write_str(STDOUT_FILENO, "\n");
+                p->n = 0;
+                return -1;
+            }
+            p->kinds[p->n++] = k;
+            s += len + (s[len] == ',');
+        }
+        p->listed = 1;
+        i += 2;
+    }
+    if (i == argc || p->n == 0) {
+        if (i == argc) {
+            write_str(STDOUT_FILENO, "Usage: perf stat [-e EVENT[,EVENT...]] command [args...]\n");
+            p->n = 0;
+            return -1;
+        }
+        for (int k = 0; k < PERF_DEFAULT_EVENTS; k++) {
+            p->kinds[p->n++] = k;
+        }
+    }
+    return i;
+}
+
+/*
+ * Function: perf_close
+ * --------------------
+ * Closes the counters of command_perf
+ */
+void perf_close(void) {
+    perf_t *p = &command_perf;
+    for (int i = 0; p->open && i < p->n; i++) {
+        if (p->fds[i] != -1) {
+            close(p->fds[i]);
+        }
+    }
+    p->open = 0;
+}
+
+/*
+ * Function: perf_open_one
+ * -----------------------
+ * Opens one disabled, inherited counter that starts at exec
+ *
+ * Returns: Its fd, or -1 (errno set)
+ */
+int perf_open_one(const perf_kind_t *kind, pid_t pid) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = kind->type;
+    attr.config = kind->config;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.enable_on_exec = 1;
+    int fd = (int)syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    if (fd == -1 && (errno == EACCES || errno == EPERM)) {
+        // perf_event_paranoid 2: user space only
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = (int)syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    }
+    return fd;
+}
+
+/*
+ * Function: perf_open
+ * -------------------
+ * Opens the counters of command_perf for process pid (0: the shell,
+ * whose next child inherits them), replacing any still open
+ *
+ * Returns: 0 if at least one counter is open, -1 otherwise (errno set)
+ */
+int perf_open(pid_t pid) {
+    perf_t *p = &command_perf;
+    perf_close();
+    int opened = 0;
+    int error = 0;
+    for (int i = 0; i < p->n; i++) {
+        p->fds[i] = perf_open_one(&perf_kinds[p->kinds[i]], pid);
+        if (p->fds[i] != -1) {
+            opened++;
+        } else {
+            error = errno;
+        }
+    }
+    p->open = 1;
+    if (opened == 0 && p->listed) {
+        // No hardware counters here: count what software can
+        perf_close();
+        p->n = 0;
+        for (int k = 0; k < PERF_SOFTWARE_EVENTS; k++) {
+            p->kinds[p->n] = k;
+            p->fds[p->n++] = perf_open_one(&perf_kinds[k], pid);
+            opened += (p->fds[p->n - 1] != -1);
+        }
+        p->listed = 0;
+        p->open = 1;
+    }
+    if (opened == 0) {
+        perf_close();
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Function: perf_finish
+ * ---------------------
+ * Reads the counters after the command was reaped, appends them to
+ * report_suffix (if 'report') and closes them. A counter that had to
+ * share the PMU with others ran only part of the time; its value is
+ * scaled up to the whole time, as perf(1) does.
+ */
+void perf_finish(int report) {
+    perf_t *p = &command_perf;
+    if (!p->open) {
+        return;
+    }
+    int first = 1;
+    for (int i = 0; report && i < p->n; i++) {
+        const perf_kind_t *kind = &perf_kinds[p->kinds[i]];
+        uint64_t values[3];     // value, time enabled, time running
+        if (p->fds[i] == -1) {
+            if (!p->listed) {
+                continue;       // A default the machine lacks
+            }
+        } else if (read(p->fds[i], values, sizeof(values)) != (ssize_t)sizeof(values)) {
+            continue;
+        }
+        report_append(first ? " (perf: " : ", ");
+        first = 0;
+        report_append(kind->name);
+        report_append(" ");
+        if (p->fds[i] == -1) {
+            report_append("not supported");
+            continue;
+        }
+        uint64_t value = values[0];
+        if (values[2] != 0 && values[2] < values[1]) {
+            value = (uint64_t)((double)value * (double)values[1] / (double)values[2]);
+        }
+        char number[24];
+        if (kind->type == PERF_TYPE_SOFTWARE && kind->config == PERF_COUNT_SW_TASK_CLOCK) {
+            // Nanoseconds, shown as milliseconds with three decimals
+            number[trace_number(number, (int64_t)(value / 1000), 1)] = '\0';
+            report_append(number);
+            report_append(" ms");
+        } else {
+            number[trace_number(number, (int64_t)value, 0)] = '\0';
+            report_append(number);
+        }
+    }
+    if (!first) {
+        report_append(")");
+    }
+    perf_close();
+}
+
+/*
+ * Command statistics (stats)
+ * --------------------------
+ * For every external program the shell keeps three latency histograms,
+ * keyed by the path find_command() resolved:
+ *
+ *   spawn   from run_external() until the child exists
+ *   run     from then until it is reaped
+ *   total   the whole round trip, including the cgroup leaf
+ *
+ * The histograms are log-bucketed like HdrHistogram: values below
+ * 2 * STATS_SUB_BUCKETS microseconds get a bucket each, and every
+ * power of two above that is split into STATS_SUB_BUCKETS buckets. A
+ * percentile is then off by at most 1/STATS_SUB_BUCKETS (6%), whatever
+ * the magnitude, and every command costs the same fixed memory.
+ *
+ * At most STATS_MAX_COMMANDS programs are tracked; a new one takes the
+ * slot of the one used least recently.
+ */
+#define STATS_SUB_BITS      4
+#define STATS_SUB_BUCKETS   (1 << STATS_SUB_BITS)
+#define STATS_MAX_BITS      36      // Values are clamped below 2^36 us (19 hours)
+#define STATS_BUCKETS       ((STATS_MAX_BITS - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS)
+#define STATS_MAX_COMMANDS  32
+
+enum { STATS_SPAWN, STATS_RUN, STATS_TOTAL, STATS_KINDS };
+
+typedef struct {
+    uint64_t max;                       // Exact largest value (us)
+    uint32_t counts[STATS_BUCKETS];
+} histogram_t;
+
+typedef struct {
+    char path[MAX_PATH];                // "" if the slot is free
+    uint64_t used;                      // stats_clock when last run (LRU)
+    uint64_t count;                     // Runs recorded
+    histogram_t histograms[STATS_KINDS];
+} command_stats_t;
+
+command_stats_t command_stats[STATS_MAX_COMMANDS];
+uint64_t stats_clock = 0;
+
+/*
+ * Function: histogram_bucket
+ * --------------------------
+ * Returns: The bucket of value v (us)
+ */
+int histogram_bucket(uint64_t v) {
+    if (v >= (uint64_t)1 << STATS_MAX_BITS) {
+        v = ((uint64_t)1 << STATS_MAX_BITS) - 1;
+    }
+    if (v < 2 * STATS_SUB_BUCKETS) {
+        return (int)v;
+    }
+    // Keep the top STATS_SUB_BITS + 1 bits: the leading 1 picks the
+    // power of two, the bits below it the sub-bucket
+    int shift = 63 - __builtin_clzll(v) - STATS_SUB_BITS;
+    return (shift + 1) * STATS_SUB_BUCKETS + (int)(v >> shift) - STATS_SUB_BUCKETS;
+}
+
+/*
+ * Function: histogram_value
+ * -------------------------
+ * Returns: The largest value that falls into bucket b (us)
+ */
+uint64_t histogram_value(int b) {
+    if (b < 2 * STATS_SUB_BUCKETS) {
+        return (uint64_t)b;
+    }
+    int shift = b / STATS_SUB_BUCKETS - 1;
+    uint64_t base = (uint64_t)(b % STATS_SUB_BUCKETS + STATS_SUB_BUCKETS) << shift;
+    return base + ((uint64_t)1 << shift) - 1;
+}
+
+/*
+ * Function: histogram_percentile
+ * ------------------------------
+ * Returns: The value below which 'percent' of the recorded values lie
+ *          (the top of its bucket, but never above the exact maximum)
+ */
+uint64_t histogram_percentile(const histogram_t *h, uint64_t count, int percent) {
+    uint64_t rank = (count * (uint64_t)percent + 99) / 100;  // 1-based, rounded up
+    uint64_t seen = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        seen += h->counts[b];
+        if (seen >= rank && seen > 0) {
+            uint64_t v = histogram_value(b);
+            return (v < h->max) ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+/*
+ * Function: stats_record
+ * ----------------------
+ * Adds one run of the program at 'path' to its histograms
+ *
+ * Times are CLOCK_MONOTONIC ns (trace_now()): when run_external() was
+ * entered, when it began to spawn, when the child existed, and when it
+ * was reaped
+ */
+void stats_record(const char *path, int64_t entered, int64_t spawn, int64_t started,
+                  int64_t reaped) {
+    command_stats_t *entry = NULL;
+    command_stats_t *oldest = &command_stats[0];
+    for (int i = 0; i < STATS_MAX_COMMANDS && entry == NULL; i++) {
+        command_stats_t *c = &command_stats[i];
+        if (c->path[0] != '\0' && strcmp(c->path, path) == 0) {
+            entry = c;
+        } else if (c->used < oldest->used) {
+            oldest = c;     // Free slots have used == 0: they go first
+        }
+    }
+    if (entry == NULL) {
+        if (strlen(path) >= MAX_PATH) {
+            return;
+        }
+        entry = oldest;
+        memset(entry, 0, sizeof(*entry));
+        strcpy(entry->path, path);
+    }
+    entry->used = ++stats_clock;
+    entry->count++;
+
+    int64_t values[STATS_KINDS] = {started - spawn, reaped - started, reaped - entered};
+    for (int k = 0; k < STATS_KINDS; k++) {
+        uint64_t us = (values[k] > 0) ? (uint64_t)values[k] / 1000 : 0;
+        histogram_t *h = &entry->histograms[k];
+        h->counts[histogram_bucket(us)]++;
+        if (us > h->max) {
+            h->max = us;
+        }
+    }
+}
+
+/*
+ * Function: stats_column
+ * ----------------------
+ * Queues n right-aligned in a column 'width' characters wide
+ */
+void stats_column(uint64_t n, int width) {
+    char digits[24];
+    int len = 0;
+    do {
+        digits[len++] = (char)('0' + n % 10);
+        n /= 10;
+    } while (n != 0);
+    for (int pad = width - len; pad > 0; pad--) {
+        out_write(" ", 1);
+    }
+    while (len > 0) {
+        out_write(&digits[--len], 1);
+    }
+}
+
+/*
+ * Function: stats_print
+ * ---------------------
+ * Queues the table of one program:
+ *
+ *   /bin/ls: 12 runs
+ *               p50       p90       p99       max (us)
+ *     spawn     112       130       180       201
+ *     run      1020      1300      1500      1610
+ *     total    1150      1440      1700      1800
+ */
+void stats_print(const command_stats_t *c) {
+    static const char *labels[STATS_KINDS] = {"  spawn", "  run  ", "  total"};
+    static const int percents[3] = {50, 90, 99};
+    out_str(c->path);
+    out_write(": ", 2);
+    stats_column(c->count, 0);
+    out_str(c->count == 1 ? " run\n" : " runs\n");
+    out_str("            p50       p90       p99       max (us)\n");
+    for (int k = 0; k < STATS_KINDS; k++) {
+        const histogram_t *h = &c->histograms[k];
+        out_str(labels[k]);
+        for (int i = 0; i < 3; i++) {
+            stats_column(histogram_percentile(h, c->count, percents[i]), (i == 0) ? 8 : 10);
+        }
+        stats_column(h->max, 10);
+        out_write("\n", 1);
+    }
+}
+
+/*
+ * Built-in commands
+ * -----------------
+ * Each built-in runs inside the shell process and returns an exit status.
+ */
+typedef struct {
+    const char *name;
+    int (*run)(int argc, char **argv);
+} builtin_t;
+
+/*
+ * Function: builtin_exit
+ * ----------------------
+ * exit [N] - stops the shell with status N (default: last status).
+ * Like bash, a non-numeric N still exits, with status 2.
+ */
+int builtin_exit(int argc, char **argv) {
+    // Like bash: stopped jobs would be left behind, so warn once
+    static int warned = 0;
+    for (int i = 0; i < MAX_JOBS && !warned; i++) {
+        if (jobs[i].process.pid != 0 && jobs[i].stopped && !jobs[i].done) {
+            write_str(STDOUT_FILENO, "There are stopped jobs.\n");
+            warned = 1;
+            return 1;
+        }
+    }
+    exit_requested = 1;  // Every running loop and list stops
+    if (argc > 1) {
+        char *end;
+        long n = strtol(argv[1], &end, 10);
+        if (end == argv[1] || *end != '\0') {
+            write_str(STDOUT_FILENO, "exit: ");
+            write_str(STDOUT_FILENO, argv[1]);
+            write_str(STDOUT_FILENO, ": numeric argument required\n");
+            return 2;
+        }
+        return (int)(n & 0xff);
+    }
+    return last_status;
+}
+
+/*
+ * Function: builtin_cd
+ * --------------------
+ * cd DIR - changes the current working directory using chdir()
+ */
+int builtin_cd(int argc, char **argv) {
+    // Check if directory argument was provided
+    if (argc < 2) {
+        write(STDOUT_FILENO, "cd: missing argument\n", 21);
+        return 1;
+    }
+
+    // chdir() system call - changes current working directory
+    // Returns: 0 on success, -1 on error
+    if (chdir(argv[1]) == -1) {
+        // Failed to change directory - print error
+        perror("cd");
+        return 1;
+    }
+    // If successful, chdir() silently changes directory.
+    // Children forked in advance now have the wrong one.
+    shell_generation++;
+    return 0;
+}
+
+/*
+ * Function: loop_levels
+ * ---------------------
+ * Parses the optional N of "break N" / "continue N", capped at the
+ * number of enclosing loops
+ */
+int loop_levels(int argc, char **argv) {
+    int levels = (argc > 1) ? atoi(argv[1]) : 1;
+    if (levels < 1) {
+        levels = 1;
+    }
+    return levels < loop_depth ? levels : loop_depth;
+}
+
+/*
+ * Function: builtin_break
+ * -----------------------
+ * break [N] - leaves N enclosing loops
+ */
+int builtin_break(int argc, char **argv) {
+    loop_break = loop_levels(argc, argv);
+    return 0;
+}
+
+/*
+ * Function: builtin_continue
+ * --------------------------
+ * continue [N] - starts the next iteration of the Nth enclosing loop
+ */
+int builtin_continue(int argc, char **argv) {
+    loop_continue = loop_levels(argc, argv);
+    return 0;
+}
+
+/*
+ * Function: builtin_return
+ * ------------------------
+ * return [N] - leaves the current function with status N
+ * (default: status of the last command)
+ */
+int builtin_return(int argc, char **argv) {
+    if (frame_depth == 0) {
+        write_str(STDOUT_FILENO, "return: can only return from a function\n");
+        return 1;
+    }
+    function_return = 1;  // execute_list() unwinds up to the call
+    return (argc > 1) ? (atoi(argv[1]) & 0xff) : last_status;
+}
+
+/*
+ * Function: builtin_shift
+ * -----------------------
+ * shift [N] - drops the first N positional parameters ($2 becomes $1)
+ * Only the frame's pointer moves; nothing is copied.
+ */
+int builtin_shift(int argc, char **argv) {
+    frame_t *frame = &frames[frame_depth];
+    int n = (argc > 1) ? atoi(argv[1]) : 1;
+    if (n < 0 || n > frame->nparams) {
+        return 1;
+    }
+    frame->params += n;
+    frame->nparams -= n;
+    return 0;
+}
+
+/*
+ * Function: wait_job
+ * ------------------
+ * Runs the event loop until job 'slot' has finished, then frees it
+ *
+ * Returns: The job's status ($? style), or 130 if Ctrl+C interrupted
+ *          the wait (the job keeps running)
+ */
+int wait_job(int slot) {
+    job_t *job = &jobs[slot];
+    while (!job->done) {
+        int event = event_run(EVENT_CHILD);
+        if (event == EVENT_SIGNAL) {
+            return 130;
+        }
+        if (event == -1) {
+            job_finished(slot);  // Block on this job alone
+        }
+    }
+    int status = job->status;
+    job_release(job);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/*
+ * Function: builtin_wait
+ * ----------------------
+ * wait [%N | PID]... - waits for the given background jobs, or for all
+ * of them, while the event loop keeps running
+ *
+ * Returns: Status of the last job named (127 if it is unknown),
+ *          0 without arguments
+ */
+int builtin_wait(int argc, char **argv) {
+    if (argc == 1) {
+        for (int slot = 0; slot < MAX_JOBS; slot++) {
+            if (jobs[slot].process.pid != 0 && wait_job(slot) == 130 && jobs[slot].process.pid != 0) {
+                return 130;
+            }
+        }
+        return 0;
+    }
+
+    int status = 0;
+    for (int i = 1; i < argc; i++) {
+        // %N names a job, anything else a pid
+        int slot = -1;
+        if (argv[i][0] == '%') {
+            int id = atoi(argv[i] + 1);
+            if (id >= 1 && id <= MAX_JOBS && jobs[id - 1].process.pid != 0) {
+                slot = id - 1;
+            }
+        } else {
+            pid_t pid = (pid_t)atoi(argv[i]);
+            for (int j = 0; j < MAX_JOBS && pid > 0; j++) {
+                if (jobs[j].process.pid == pid) {
+                    slot = j;
+                    break;
+                }
+            }
+        }
+        if (slot == -1) {
+            write_str(STDOUT_FILENO, "wait: ");
+            write_str(STDOUT_FILENO, argv[i]);
+            write_str(STDOUT_FILENO, ": no such job\n");
+            status = 127;
+            continue;
+        }
+        status = wait_job(slot);
+        if (status == 130 && jobs[slot].process.pid != 0) {
+            return 130;
+        }
+    }
+    return status;
+}
+
+/*
+ * Function: job_find
+ * ------------------
+ * Looks up a job spec: %N, %+ or %% (the current job), %- (the one
+ * before), or NULL for the current job. Reports unknown jobs.
+ *
+ * Returns: The slot, or -1
+ */
+int job_find(const char *spec, const char *builtin) {
+    int slot = -1;
+    if (spec == NULL || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0) {
+        slot = job_current(-1);
+    } else if (strcmp(spec, "%-") == 0) {
+        slot = job_current(job_current(-1));
+    } else if (spec[0] == '%') {
+        int id = atoi(spec + 1);
+        if (id >= 1 && id <= MAX_JOBS && jobs[id - 1].process.pid != 0) {
+            slot = id - 1;
+        }
+    }
+    if (slot == -1) {
+        write_str(STDOUT_FILENO, builtin);
+        write_str(STDOUT_FILENO, ": ");
+        write_str(STDOUT_FILENO, spec != NULL ? spec : "current");
+        write_str(STDOUT_FILENO, ": no such job\n");
+    }
+    return slot;
+}
+
+/*
+ * Function: builtin_jobs
+ * ----------------------
+ * jobs - lists the jobs; finished ones are reported once and dropped
+ */
+int builtin_jobs(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    for (int slot = 0; slot < MAX_JOBS; slot++) {
+        job_t *job = &jobs[slot];
+        if (job->process.pid == 0) {
+            continue;
+        }
+        job_print(slot);
+        job->notify = 0;
+    }
+    for (int slot = 0; slot < MAX_JOBS; slot++) {
+        if (jobs[slot].process.pid != 0 && jobs[slot].done) {
+            job_release(&jobs[slot]);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Function: builtin_fg
+ * --------------------
+ * fg [%N] - continues a job in the foreground: it gets the terminal
+ * (and the modes it had when it stopped) and the shell waits for it
+ *
+ * Returns: The job's status, reported like any external command
+ */
+int builtin_fg(int argc, char **argv) {
+    if (!job_control) {
+        write_str(STDOUT_FILENO, "fg: no job control\n");
+        return 1;
+    }
+    int slot = job_find(argc > 1 ? argv[1] : NULL, "fg");
+    if (slot == -1) {
+        return 1;
+    }
+    job_t *job = &jobs[slot];
+    out_str(job->text);
+    out_write("\n", 1);
+    out_flush();
+
+    if (!job->done) {
+        tcsetpgrp(terminal_fd, job->process.pgid);
+        if (job->has_modes) {
+            tcsetattr(terminal_fd, TCSADRAIN, &job->modes);
+        }
+        job->notify = 0;
+        if (job->stopped) {
+            job->stopped = 0;
+            kill(-job->process.pgid, SIGCONT);
+        }
+    }
+    // The job stays in its slot: the event loop reaps it or sees it stop
+    while (!job->done && !job->stopped) {
+        if (event_run(EVENT_CHILD) == -1) {
+            job_finished(slot);
+        }
+    }
+
+    if (job->stopped) {
+        job->has_modes = (tcgetattr(terminal_fd, &job->modes) == 0);
+        job->order = ++job_sequence;
+        job->notify = 0;
+        terminal_reclaim(job->status);
+        out_write("\n", 1);
+        job_print(slot);
+        return 128 + WSTOPSIG(job->status);
+    }
+    int status = job->status;
+    cgroup_report(job->cgroup);
+    job_release(job);
+    terminal_reclaim(status);
+    return command_status(status);
+}
+
+/*
+ * Function: builtin_bg
+ * --------------------
+ * bg [%N] - lets a stopped job run on in the background
+ */
+int builtin_bg(int argc, char **argv) {
+    if (!job_control) {
+        write_str(STDOUT_FILENO, "bg: no job control\n");
+        return 1;
+    }
+    int slot = job_find(argc > 1 ? argv[1] : NULL, "bg");
+    if (slot == -1) {
+        return 1;
+    }
+    job_t *job = &jobs[slot];
+    if (job->stopped) {
+        job->stopped = 0;
+        job->notify = 0;
+        kill(-job->process.pgid, SIGCONT);
+    }
+    job_print(slot);
+    return 0;
+}
+
+/*
+ * Signal names for "kill"
+ */
+typedef struct {
+    const char *name;
+    int number;
+} signal_name_t;
+
+signal_name_t signal_names[] = {
+    {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL},
+    {"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"PIPE", SIGPIPE}, {"ALRM", SIGALRM},
+    {"TERM", SIGTERM}, {"CHLD", SIGCHLD}, {"CONT", SIGCONT}, {"STOP", SIGSTOP},
+    {"TSTP", SIGTSTP}, {"TTIN", SIGTTIN}, {"TTOU", SIGTTOU}, {"WINCH", SIGWINCH},
+    {NULL, 0}
+};
+
+/*
+ * Function: signal_number
+ * -----------------------
+ * Parses a signal as a number, a name or a SIG-prefixed name
+ *
+ * Returns: The signal number, or -1
+ */
+int signal_number(const char *s) {
+    if (*s >= '0' && *s <= '9') {
+        int n = atoi(s);
+        return (n < NSIG) ? n : -1;
+    }
+    if (strncmp(s, "SIG", 3) == 0) {
+        s += 3;
+    }
+    for (signal_name_t *sn = signal_names; sn->name != NULL; sn++) {
+        if (strcmp(sn->name, s) == 0) {
+            return sn->number;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Function: builtin_kill
+ * ----------------------
+ * kill [-SIGNAL | -s SIGNAL] %N|PID... - signals jobs (their whole
+ * process group with job control) or processes; kill -l lists signals
+ *
+ * Returns: 0, or 1 if a target could not be signalled
+ */
+int builtin_kill(int argc, char **argv) {
+    int i = 1;
+    int sig = SIGTERM;
+    if (i < argc && strcmp(argv[i], "-l") == 0) {
+        for (signal_name_t *sn = signal_names; sn->name != NULL; sn++) {
+            char number[12];
+            out_str(int_to_string(sn->number, number));
+            out_write(") SIG", 5);
+            out_str(sn->name);
+            out_write("\n", 1);
+        }
+        return 0;
+    }
+    if (i + 1 < argc && strcmp(argv[i], "-s") == 0) {
+        sig = signal_number(argv[i + 1]);
+        i += 2;
+    } else if (i < argc && argv[i][0] == '-' && argv[i][1] != '\0') {
+        sig = signal_number(argv[i] + 1);
+        i++;
+    }
+    if (sig == -1 || i == argc) {
+        write_str(STDOUT_FILENO, "Usage: kill [-SIGNAL | -s SIGNAL] %N|PID...\n");
+        return 2;
+    }
+
+    int status = 0;
+    for (; i < argc; i++) {
+        int result;
+        if (argv[i][0] == '%') {
+            int slot = job_find(argv[i], "kill");
+            if (slot == -1) {
+                status = 1;
+                continue;
+            }
+            job_t *job = &jobs[slot];
+            if (job->done) {
+                continue;  // Already gone, only not reported yet
+            }
+            if (job->process.pgid != 0) {
+                result = kill(-job->process.pgid, sig);
+                // A stopped job would only see the signal once continued
+                if (result == 0 && job->stopped && (sig == SIGTERM || sig == SIGHUP)) {
+                    kill(-job->process.pgid, SIGCONT);
+                }
+            } else {
+                result = process_signal(&job->process, sig);
+            }
+        } else {
+            char *end;
+            long pid = strtol(argv[i], &end, 10);
+            if (*end != '\0' || end == argv[i]) {
+                write_str(STDOUT_FILENO, "kill: ");
+                write_str(STDOUT_FILENO, argv[i]);
+                write_str(STDOUT_FILENO, ": no such job or process\n");
+                status = 1;
+                continue;
+            }
+            result = kill((pid_t)pid, sig);
+        }
+        if (result == -1) {
+            perror("kill");
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/*
+ * Function: builtin_ulimit
+ * ------------------------
+ * ulimit [-S|-H] [-a | -X [VALUE]...] - shows limits, or stores them
+ * for every command run from now on. With a command after the limits
+ * ("ulimit -t 5 cmd") it is a prefix, handled by command_prefix().
+ *
+ * Returns: 0, 1 if a limit cannot be applied or a value is no number,
+ *          2 on a usage error
+ */
+int builtin_ulimit(int argc, char **argv) {
+    limits_t limits;
+    int query;
+    int hard;
+    int i = ulimit_parse(argc, argv, &limits, &query, &hard);
+    if (i < 0) {
+        return (i == -1) ? 2 : 1;
+    }
+    if (query == MAX_LIMITS) {
+        for (int k = 0; limit_info[k].option != 0; k++) {
+            ulimit_print(k, hard, 1);
+        }
+    } else if (query >= 0) {
+        ulimit_print(query, hard, 0);
+    } else if ((limits.soft | limits.hard) == 0) {
+        ulimit_print(2, hard, 0);  // Plain "ulimit": the file size limit (-f)
+    }
+
+    limits_t merged = shell_limits;
+    limits_merge(&merged, &limits);
+    if (limits_check(&merged) != -1) {
+        return 1;
+    }
+    shell_limits = merged;
+    return 0;
+}
+
+void zygote_start(void);
+
+char **builtin_assignments;     // Prefix assignments of the running built-in
+
+/*
+ * Function: exec_replace
+ * ----------------------
+ * Replaces the shell with the program 'full_path'. The helpers, the
+ * cgroup tree and the metrics socket are torn down first, since the
+ * atexit() handlers will not run; the environment gets the prefix
+ * assignments, and signals and limits are those of any other command.
+ * If execv() fails anyway, all of that is put back.
+ *
+ * Returns: 126 (only when execv() failed)
+ */
+int exec_replace(const char *full_path, char **argv) {
+    // The entries the assignments replace, to put back
+    int nassign = 0;
+    while (builtin_assignments[nassign] != NULL) {
+        nassign++;
+    }
+    char **replaced = arena_alloc(&scratch, (size_t)nassign * sizeof(char *));
+    for (int i = 0; i < nassign; i++) {
+        char *eq = strchr(builtin_assignments[i], '=');
+        *eq = '\0';
+        char *value = getenv(builtin_assignments[i]);
+        *eq = '=';
+        // getenv() points into the "NAME=value" entry itself
+        replaced[i] = (value != NULL) ? value - (eq - builtin_assignments[i]) - 1 : NULL;
+        putenv(builtin_assignments[i]);
+    }
+    struct rlimit limits[MAX_LIMITS];
+    for (int r = 0; r < MAX_LIMITS; r++) {
+        getrlimit((__rlimit_resource_t)r, &limits[r]);
+    }
+
+    // No helper, cgroup or queued output may outlive the shell, and the
+    // program starts with the signal state of any other command
+    int had_zygote = (zygote_fd != -1);
+    int had_cgroup = (cgroup_fd != -1 && getpid() == cgroup_owner);
+    int had_metrics = (metrics_fd != -1 && getpid() == metrics_owner);
+    out_flush();
+    zygote_stop();
+    if (zygote_pid > 0) {
+        waitpid(zygote_pid, NULL, 0);   // EOF ends it; the program would not reap it
+        zygote_pid = -1;
+    }
+    standby_stop(1);
+    cgroup_cleanup();
+    trace_flush();      // The trace ends here: atexit() will not run
+    metrics_close();    // and so does the metrics socket
+    if (job_control) {
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+    }
+    sigset_t mask;
+    sigprocmask(SIG_SETMASK, child_signal_reset ? &child_signal_mask : NULL, &mask);
+    if (command_limits_apply(0) == -1) {
+        perror("ulimit");
+    } else {
+        exec_fds_prepare(full_path, NULL, 0);
+        execv(full_path, argv);
+        PROBE2(exec_failed, full_path, errno);
+        write_str(STDERR_FILENO, "exec: ");
+        perror(full_path);
+    }
+
+    // Still the shell: undo the above (the standby child comes back at
+    // the next prompt by itself)
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    if (job_control) {
+        signal(SIGTSTP, SIG_IGN);
+        signal(SIGTTIN, SIG_IGN);
+        signal(SIGTTOU, SIG_IGN);
+    }
+    for (int r = 0; r < MAX_LIMITS; r++) {
+        setrlimit((__rlimit_resource_t)r, &limits[r]);  // A lowered hard limit stays
+    }
+    for (int i = 0; i < nassign; i++) {
+        if (replaced[i] != NULL) {
+            putenv(replaced[i]);
+        } else {
+            char *eq = strchr(builtin_assignments[i], '=');
+            *eq = '\0';
+            unsetenv(builtin_assignments[i]);
+            *eq = '=';
+        }
+    }
+    if (had_zygote) {
+        zygote_start();
+    }
+    if (had_cgroup) {
+        cgroup_init();
+    }
+    if (had_metrics) {
+        char path[sizeof(metrics_path)];
+        strcpy(path, metrics_path);
+        if (metrics_open(path) == 0 && event_fd != -1) {
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.u64 = EVENT_KEY(EVENT_METRICS, METRICS_LISTENER);
+            epoll_ctl(event_fd, EPOLL_CTL_ADD, metrics_fd, &ev);
+        }
+    }
+    return 126;
+}
+
+/*
+ * Function: builtin_exec
+ * ----------------------
+ * exec [command [args...]] - replaces the shell with command. Without
+ * a command, the redirections of the line stay in effect for the rest
+ * of the shell ("exec >log 2>&1", "exec 3<input"). Prefix assignments
+ * ("LANG=C exec sort") go to the command's environment.
+ *
+ * The command is found and checked before anything is torn down. When
+ * it cannot be run, an interactive shell carries on; any other shell
+ * exits with the status, like bash.
+ *
+ * Returns: 0 without a command, 127 if command is not found, 126 if it
+ *          cannot be executed; it does not return otherwise
+ */
+int builtin_exec(int argc, char **argv) {
+    if (argc == 1) {
+        redirect_persist = 1;   // execute_simple() keeps them
+        return 0;
+    }
+    char full_path[MAX_PATH];
+    int status;
+    if (!find_command(argv[1], full_path)) {
+        write_str(STDERR_FILENO, "exec: ");
+        write_str(STDERR_FILENO, argv[1]);
+        write_str(STDERR_FILENO, ": not found\n");
+        status = 127;
+    } else if (access(full_path, X_OK) == -1) {
+        write_str(STDERR_FILENO, "exec: ");
+        perror(full_path);
+        status = 126;
+    } else {
+        status = exec_replace(full_path, argv + 1);
+    }
+    if (!shell_interactive || getpid() != shell_pid) {
+        exit_requested = 1;  // $(...) and & children are not interactive
+    }
+    return status;
+}
+
+/*
+ * Function: builtin_stats
+ * -----------------------
+ * stats [-r] [name...] - shows the latency percentiles of the programs
+ * run so far, or only of those named (by path or by last component);
+ * -r forgets them instead
+ */
+int builtin_stats(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "-r") == 0) {
+        memset(command_stats, 0, sizeof(command_stats));
+        stats_clock = 0;
+        return 0;
+    }
+    int status = (argc > 1);    // 1 until a named program is found
+    // Most recently used first
+    uint64_t below = UINT64_MAX;
+    while (1) {
+        command_stats_t *next = NULL;
+        for (int i = 0; i < STATS_MAX_COMMANDS; i++) {
+            command_stats_t *c = &command_stats[i];
+            if (c->path[0] != '\0' && c->used < below && (next == NULL || c->used > next->used)) {
+                next = c;
+            }
+        }
+        if (next == NULL) {
+            break;
+        }
+        below = next->used;
+        const char *base = strrchr(next->path, '/');
+        base = (base != NULL) ? base + 1 : next->path;
+        int wanted = (argc == 1);
+        for (int i = 1; i < argc && !wanted; i++) {
+            wanted = strcmp(argv[i], next->path) == 0 || strcmp(argv[i], base) == 0;
+        }
+        if (wanted) {
+            stats_print(next);
+            status = 0;
+        }
+    }
+    return status;
+}
+
+builtin_t builtins[] = {
+    {"exit", builtin_exit},
+    {"cd", builtin_cd},
+    {"break", builtin_break},
+    {"continue", builtin_continue},
+    {"return", builtin_return},
+    {"shift", builtin_shift},
+    {"wait", builtin_wait},
+    {"jobs", builtin_jobs},
+    {"fg", builtin_fg},
+    {"bg", builtin_bg},
+    {"kill", builtin_kill},
+    {"ulimit", builtin_ulimit},
+    {"exec", builtin_exec},
+    {"stats", builtin_stats},
+    {NULL, NULL}
+};
+
+/*
+ * Function: find_builtin
+ * ----------------------
+ * Returns the built-in called 'name', or NULL
+ */
+builtin_t *find_builtin(const char *name) {
+    for (builtin_t *b = builtins; b->name != NULL; b++) {
+        if (strcmp(b->name, name) == 0) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+int execute_node(program_t *p, int n);
+
+/*
+ * Function: execute_list
+ * ----------------------
+ * Executes a list of statements linked through 'next'
+ *
+ * Returns: Status of the last statement (0 for an empty list)
+ */
+int execute_list(program_t *p, int n) {
+    int status = 0;
+    int tail = tail_position;   // Only the last statement inherits it
+    tail_position = 0;
+    while (n != -1 && !exit_requested && !loop_break && !loop_continue && !function_return) {
+        tail_position = tail && p->nodes[n].next == -1;
+        status = execute_node(p, n);
+        n = p->nodes[n].next;
+    }
+    return status;
+}
+
+/*
+ * Fork server ("zygote")
+ * ----------------------
+ * fork() copies the page tables of the whole shell, so its cost grows
+ * with everything the shell has allocated (arenas touched by a big
+ * $(...), variables, cached programs). With "-o zygote" the shell forks
+ * a helper at startup, before any of that exists, and asks it to spawn
+ * external commands instead:
+ *
+ *   shell --[request: path, argv, env + fds (SCM_RIGHTS)]--> zygote
+ *   shell <--[ZYGOTE_STARTED pid] ... [ZYGOTE_EXITED pid, status]--
+ *
+ * The zygote forks from its own tiny image, so spawning costs the same
+ * whatever the size of the shell. The child gets the shell's current
+ * working directory and its fds 0, 1, 2 and redirected fds: the shell
+ * applies the redirections to itself, passes the fds, and undoes them
+ * right after sendmsg() (the message holds its own references).
+ *
+ * Requests that do not fit (huge argument lists, fds numbered 64 or
+ * more) simply use fork() in the shell.
+ */
+#define ZYGOTE_MAX_FDS     16               // fds passed per request
+#define ZYGOTE_MAX_REQUEST (128 * 1024)     // Strings per request
+#define ZYGOTE_FD_BASE     64               // Child moves received fds here first
+#define ZYGOTE_SOCKET_FD   100              // Shell's end: high, guarded by redirect_shell_fd()
+
+#define ZYGOTE_STARTED 1    // Child forked: pid
+#define ZYGOTE_EXITED  2    // Child finished: pid + wait status
+#define ZYGOTE_FAILED  3    // fork() failed: errno in status
+
+typedef struct {
+    uint32_t argc;
+    uint32_t nenv;          // "NAME=value" strings after argv
+    uint32_t nfds;          // Passed fds (after the cwd fd)
+    uint32_t nclose;        // fds the child must close
+    int32_t pgid;           // Process group to join (the shell's)
+    limits_t limits;        // Resource limits ("ulimit")
+    sched_t sched;          // CPUs and priorities ("taskset", "nice", ...)
+    int32_t targets[ZYGOTE_MAX_FDS];    // Child fd number of each passed fd
+    int32_t closes[ZYGOTE_MAX_FDS];
+    // Followed by: path\0 argv[0]\0 ... argv[argc-1]\0 env[0]\0 ...
+} zygote_request_t;
+
+typedef struct {
+    int32_t type;           // ZYGOTE_*
+    int32_t pid;
+    int32_t status;         // Wait status (EXITED) or errno (FAILED)
+    int64_t utime_us;       // EXITED: CPU time and peak RSS of the child
+    int64_t stime_us;
+    int64_t maxrss_kb;
+} zygote_reply_t;
+
+/*
+ * Function: zygote_exec
+ * ---------------------
+ * Runs in a child of the zygote: installs the passed fds, working
+ * directory and environment, then execs the program. Never returns.
+ *
+ * fds: fds[0] is the working directory, fds[1..nfds] the passed fds
+ */
+void zygote_exec(zygote_request_t *req, char *data, int *fds) {
+    trace_exec_mark(0);
+    if (fchdir(fds[0]) == -1) {
+        perror("fchdir");
+    }
+
+    // The zygote has a process group of its own; the command belongs in
+    // the shell's. Job control never comes here (see run_external()).
+    setpgid(0, req->pgid);
+    if (limits_apply(0, &req->limits) == -1) {
+        perror("ulimit");
+        _exit(1);
+    }
+    const char *refused = sched_apply(0, &req->sched);
+    if (refused != NULL) {
+        perror(refused);
+        _exit(1);
+    }
+
+    // Move the received fds out of the way first, so installing one
+    // target cannot overwrite another received fd
+    for (uint32_t i = 0; i <= req->nfds; i++) {
+        int high = fcntl(fds[i], F_DUPFD_CLOEXEC, ZYGOTE_FD_BASE);
+        close(fds[i]);
+        fds[i] = high;
+    }
+    for (uint32_t i = 0; i < req->nfds; i++) {
+        dup2(fds[i + 1], req->targets[i]);  // dup2() clears close-on-exec
+    }
+    for (uint32_t i = 0; i < req->nclose; i++) {
+        close(req->closes[i]);
+    }
+
+    char **argv = malloc((req->argc + 1) * sizeof(char *));
+    if (argv == NULL) {
+        _exit(1);
+    }
+    char *path = data;
+    char *s = data + strlen(data) + 1;
+    for (uint32_t i = 0; i < req->argc; i++) {
+        argv[i] = s;
+        s += strlen(s) + 1;
+    }
+    argv[req->argc] = NULL;
+    for (uint32_t i = 0; i < req->nenv; i++) {
+        putenv(s);
+        s += strlen(s) + 1;
+    }
+
+    exec_fds_prepare(path, req->targets, (int)req->nfds);
+    trace_exec_mark(1);
+    execv(path, argv);
+    PROBE2(exec_failed, path, errno);
+    perror("execv");
+    _exit(1);
+}
+
+/*
+ * Function: zygote_serve
+ * ----------------------
+ * Main loop of the zygote process. Never returns.
+ *
+ * poll() waits for requests on the socket and for SIGCHLD on a
+ * signalfd, so several children can run at once; every exit is
+ * reported with the child's pid. EOF on the socket (the shell exited)
+ * ends the zygote.
+ */
+void zygote_serve(int sock) {
+    // Out of the terminal's reach: Ctrl+C at the prompt is not for us
+    setpgid(0, 0);
+
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &old_mask);
+    int sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+
+    size_t buf_size = sizeof(zygote_request_t) + ZYGOTE_MAX_REQUEST;
+    char *buf = malloc(buf_size);
+    if (buf == NULL || sfd == -1) {
+        _exit(1);
+    }
+
+    struct pollfd pfd[2] = {{sock, POLLIN, 0}, {sfd, POLLIN, 0}};
+    while (1) {
+        if (poll(pfd, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            _exit(1);
+        }
+
+        if (pfd[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            read(sfd, &info, sizeof(info));
+            // One signal may stand for several exits
+            int status;
+            pid_t pid;
+            struct rusage ru;
+            while ((pid = wait4(-1, &status, WNOHANG, &ru)) > 0) {
+                zygote_reply_t reply = {ZYGOTE_EXITED, pid, status,
+                                        ru.ru_utime.tv_sec * 1000000LL + ru.ru_utime.tv_usec,
+                                        ru.ru_stime.tv_sec * 1000000LL + ru.ru_stime.tv_usec,
+                                        ru.ru_maxrss};
+                send(sock, &reply, sizeof(reply), MSG_NOSIGNAL);
+            }
+        }
+
+        if (!(pfd[0].revents & (POLLIN | POLLHUP))) {
+            continue;
+        }
+
+        // One request = one message (SOCK_SEQPACKET keeps boundaries)
+        union {
+            struct cmsghdr align;
+            char space[CMSG_SPACE(sizeof(int) * (ZYGOTE_MAX_FDS + 1))];
+        } control;
+        struct iovec iov = {buf, buf_size - 1};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.space;
+        msg.msg_controllen = sizeof(control.space);
+
+        ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (n <= 0) {
+            _exit(0);  // The shell is gone
+        }
+        buf[n] = '\0';
+
+        int fds[ZYGOTE_MAX_FDS + 1];
+        int nfds = 0;
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            nfds = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            memcpy(fds, CMSG_DATA(cmsg), (size_t)nfds * sizeof(int));
+        }
+
+        zygote_request_t *req = (zygote_request_t *)buf;
+        zygote_reply_t reply = {ZYGOTE_FAILED, 0, EINVAL, 0, 0, 0};
+        if ((size_t)n >= sizeof(zygote_request_t) && req->nfds <= ZYGOTE_MAX_FDS &&
+            req->nclose <= ZYGOTE_MAX_FDS && (int)req->nfds + 1 == nfds &&
+            !(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                // Restore the signal mask: it survives execv()
+                sigprocmask(SIG_SETMASK, &old_mask, NULL);
+                close(sock);
+                close(sfd);
+                zygote_exec(req, buf + sizeof(zygote_request_t), fds);
+            }
+            reply.type = (pid == -1) ? ZYGOTE_FAILED : ZYGOTE_STARTED;
+            reply.pid = pid;
+            reply.status = (pid == -1) ? errno : 0;
+        }
+        for (int i = 0; i < nfds; i++) {
+            close(fds[i]);
+        }
+        send(sock, &reply, sizeof(reply), MSG_NOSIGNAL);
+    }
+}
+
+/*
+ * Function: zygote_start
+ * ----------------------
+ * Forks the zygote; called by main() before the arenas exist, so the
+ * zygote's image is as small as the shell ever is
+ */
+void zygote_start(void) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+        perror("socketpair");
+        return;
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close(sv[0]);
+        close(sv[1]);
+        return;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        zygote_serve(sv[1]);
+    }
+    close(sv[1]);
+    zygote_pid = pid;
+
+    // "3<file" must not replace the socket: keep it on a high fd
+    zygote_fd = fcntl(sv[0], F_DUPFD_CLOEXEC, ZYGOTE_SOCKET_FD);
+    close(sv[0]);
+}
+
+/*
+ * Function: zygote_stop
+ * ---------------------
+ * Stops using the zygote (after an error, or in a $(...) child that
+ * must not read replies meant for the shell)
+ */
+void zygote_stop(void) {
+    if (zygote_fd != -1) {
+        close(zygote_fd);
+        zygote_fd = -1;
+    }
+}
+
+/*
+ * Function: zygote_recv
+ * ---------------------
+ * Receives the next reply from the zygote. The wait goes through
+ * event_wait_fd(), so jobs are reaped and scrapes answered while the
+ * command runs.
+ *
+ * Returns: 0 on success, -1 if the zygote is gone
+ */
+int zygote_recv(zygote_reply_t *reply) {
+    event_wait_fd(zygote_fd);
+    return (recv(zygote_fd, reply, sizeof(*reply), 0) == (ssize_t)sizeof(*reply)) ? 0 : -1;
+}
+
+/*
+ * Function: zygote_spawn
+ * ----------------------
+ * Runs an external program through the zygote and waits for it
+ *
+ * status: Receives the wait status of the program
+ *
+ * Returns: 0 if the program ran (or a redirection failed: status 1),
+ *          -1 if the request cannot go through the zygote and the
+ *          caller must fork() itself
+ */
+int zygote_spawn(const char *full_path, char **argv, char **assignments,
+                 redirect_t *redirects, int nredirs, int *status) {
+    size_t scratch_mark = scratch.top;
+
+    // Strings: path, argv, env - all NUL-terminated, back to back
+    zygote_request_t *req = arena_alloc(&scratch, sizeof(zygote_request_t));
+    memset(req, 0, sizeof(zygote_request_t));
+    req->pgid = getpgrp();
+    req->limits = shell_limits;
+    limits_merge(&req->limits, &command_limits);
+    req->sched = command_sched;
+    append_string(full_path);
+    arena_putc(&scratch, '\0');
+    for (char **a = argv; *a != NULL; a++) {
+        append_string(*a);
+        arena_putc(&scratch, '\0');
+        req->argc++;
+    }
+    for (char **e = assignments; *e != NULL; e++) {
+        append_string(*e);
+        arena_putc(&scratch, '\0');
+        req->nenv++;
+    }
+    size_t len = scratch.top - ((char *)req - scratch.base);
+    if (len > sizeof(zygote_request_t) + ZYGOTE_MAX_REQUEST) {
+        scratch.top = scratch_mark;
+        return -1;
+    }
+
+    // The working directory goes first, on an fd no redirection uses
+    int fds[ZYGOTE_MAX_FDS + 1];
+    int ok = 1;
+    int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    fds[0] = (cwd == -1) ? -1 : fcntl(cwd, F_DUPFD_CLOEXEC, ZYGOTE_FD_BASE);
+    if (cwd != -1) {
+        close(cwd);
+    }
+
+    // Apply the redirections to the shell itself, just for the send
+    int applied = redirect_apply(redirects, nredirs, 1);
+    if (applied != nredirs) {
+        redirect_restore(redirects, applied, 0);
+        if (fds[0] != -1) {
+            close(fds[0]);
+        }
+        scratch.top = scratch_mark;
+        *status = 1 << 8;  // Like a child that exit(1)s
+        return 0;
+    }
+
+    // Pass fds 0, 1, 2, those of "exec 3<file" and every redirected fd;
+    // close those not open
+    for (int t = 0; t < 3 + nexec_fds + nredirs && ok; t++) {
+        int fd = (t < 3) ? t : (t < 3 + nexec_fds) ? exec_fds[t - 3] : redirects[t - 3 - nexec_fds].fd;
+        int seen = 0;
+        for (uint32_t i = 0; i < req->nfds; i++) {
+            seen |= (req->targets[i] == fd);
+        }
+        for (uint32_t i = 0; i < req->nclose; i++) {
+            seen |= (req->closes[i] == fd);
+        }
+        if (seen) {
+            continue;
+        }
+        if (fd >= ZYGOTE_FD_BASE || req->nfds == ZYGOTE_MAX_FDS || req->nclose == ZYGOTE_MAX_FDS) {
+            ok = 0;
+        } else if (fcntl(fd, F_GETFD) == -1) {
+            req->closes[req->nclose++] = fd;
+        } else {
+            fds[req->nfds + 1] = fd;
+            req->targets[req->nfds++] = fd;
+        }
+    }
+
+    ssize_t sent = -1;
+    if (ok && fds[0] != -1) {
+        union {
+            struct cmsghdr align;
+            char space[CMSG_SPACE(sizeof(int) * (ZYGOTE_MAX_FDS + 1))];
+        } control;
+        memset(&control, 0, sizeof(control));
+        struct iovec iov = {req, len};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.space;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * (req->nfds + 1));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * (req->nfds + 1));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * (req->nfds + 1));
+        sent = sendmsg(zygote_fd, &msg, MSG_NOSIGNAL);
+    }
+
+    // The message holds its own references: undo everything now
+    if (fds[0] != -1) {
+        close(fds[0]);
+    }
+    redirect_restore(redirects, applied, 0);
+    scratch.top = scratch_mark;
+
+    if (sent == -1) {
+        if (ok && errno != EMSGSIZE && errno != ENOBUFS) {
+            zygote_stop();  // The zygote is gone
+        }
+        return -1;
+    }
+
+    // Wait for "started", then for the exit of that pid
+    pid_t pid = -1;
+    while (1) {
+        zygote_reply_t reply;
+        if (zygote_recv(&reply) == -1) {
+            zygote_stop();
+            if (pid == -1) {
+                return -1;  // Nothing was started: fork() instead
+            }
+            *status = 1 << 8;
+            return 0;
+        }
+        if (reply.type == ZYGOTE_FAILED) {
+            errno = reply.status;
+            metrics.fork_failures++;
+            perror("fork");
+            *status = 1 << 8;
+            return 0;
+        }
+        if (reply.type == ZYGOTE_STARTED) {
+            pid = reply.pid;
+            command_started(pid, full_path);
+        } else if (reply.type == ZYGOTE_EXITED && reply.pid == pid) {
+            *status = reply.status;
+            memset(&process_usage, 0, sizeof(process_usage));
+            process_usage.ru_utime.tv_sec = (time_t)(reply.utime_us / 1000000);
+            process_usage.ru_utime.tv_usec = (suseconds_t)(reply.utime_us % 1000000);
+            process_usage.ru_stime.tv_sec = (time_t)(reply.stime_us / 1000000);
+            process_usage.ru_stime.tv_usec = (suseconds_t)(reply.stime_us % 1000000);
+            process_usage.ru_maxrss = (long)reply.maxrss_kb;
+            metrics_child_cpu(&process_usage);
+            return 0;
+        }
+    }
+}
+
+/*
+ * Standby child (-o standby)
+ * --------------------------
+ * An interactive shell spends most of its time blocked in read(). With
+ * "-o standby" it uses that time to fork() the next child in advance:
+ * the child waits on a socket, and when a line arrives and names an
+ * external program, the shell only sends it the path, argv and prefix
+ * assignments. The child execs at once, so the fork() is no longer part
+ * of the delay the user sees. A new standby child is forked before the
+ * next prompt.
+ *
+ * The child was forked before the command was read, so it only fits
+ * commands that need nothing the shell changed since: no redirections,
+ * and the same working directory (shell_generation).
+ */
+#define STANDBY_SOCKET_FD 101       // Shell's end: high, guarded by redirect_shell_fd()
+
+typedef struct {
+    uint32_t argc;
+    uint32_t nenv;
+    uint32_t len;           // Bytes of strings that follow
+} standby_request_t;
+
+typedef struct {
+    process_t process;      // Parked child (pid -1: none)
+    int fd;                 // Socket to the child
+    int generation;         // shell_generation when it was forked
+} standby_t;
+
+standby_t standby = {{-1, -1, 0}, -1, 0};
+
+/*
+ * Function: read_all
+ * ------------------
+ * Reads exactly 'len' bytes (the counterpart of write_all())
+ *
+ * Returns: 0 on success, -1 on error or EOF
+ */
+int read_all(int fd, char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, data, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/*
+ * Function: standby_child
+ * -----------------------
+ * Body of the standby child: waits for one request, then execs it.
+ * EOF (the shell exited or dropped this child) ends it quietly.
+ * Nothing in here uses the arenas.
+ */
+void standby_child(int fd) {
+    // Unmap the arenas while parked, so that execv() has less to tear down
+    munmap(scratch.base, scratch.size);
+    munmap(fields.base, fields.size);
+
+    standby_request_t req;
+    if (read_all(fd, (char *)&req, sizeof(req)) == -1) {
+        _exit(0);
+    }
+    trace_exec_mark(0);
+    char *data = malloc(req.len + 1);
+    char **argv = malloc(((size_t)req.argc + 1) * sizeof(char *));
+    if (data == NULL || argv == NULL || read_all(fd, data, req.len) == -1) {
+        _exit(1);
+    }
+    data[req.len] = '\0';
+    close(fd);
+
+    char *path = data;
+    char *s = data + strlen(data) + 1;
+    for (uint32_t i = 0; i < req.argc; i++) {
+        argv[i] = s;
+        s += strlen(s) + 1;
+    }
+    argv[req.argc] = NULL;
+    for (uint32_t i = 0; i < req.nenv; i++) {
+        putenv(s);
+        s += strlen(s) + 1;
+    }
+
+    // Forked at the prompt, with no redirections applied
+    exec_fds_prepare(path, NULL, 0);
+    trace_exec_mark(1);
+    execv(path, argv);
+    PROBE2(exec_failed, path, errno);
+    perror("execv");
+    _exit(1);
+}
+
+/*
+ * Function: standby_start
+ * -----------------------
+ * Forks a standby child unless one is already parked
+ */
+void standby_start(void) {
+    if (standby.process.pid != -1) {
+        return;
+    }
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+        return;  // Commands simply fork() as usual
+    }
+    pid_t pid = process_spawn(&standby.process, SPAWN_BACKGROUND);
+    if (pid == -1) {
+        standby.process.pid = -1;
+        close(sv[0]);
+        close(sv[1]);
+        return;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        standby_child(sv[1]);
+    }
+    close(sv[1]);
+    standby.fd = fcntl(sv[0], F_DUPFD_CLOEXEC, STANDBY_SOCKET_FD);
+    standby.generation = shell_generation;
+    close(sv[0]);
+}
+
+/*
+ * Function: standby_stop
+ * ----------------------
+ * Drops the parked child: it is killed through its pidfd and reaped
+ *
+ * reap: 0 in a $(...) child, where the standby is the shell's child
+ *       and only the socket and pidfd are closed
+ */
+void standby_stop(int reap) {
+    if (standby.process.pid == -1) {
+        return;
+    }
+    close(standby.fd);
+    if (reap) {
+        int status;
+        process_signal(&standby.process, SIGKILL);
+        process_wait(&standby.process, &status);
+    } else if (standby.process.pidfd != -1) {
+        close(standby.process.pidfd);
+    }
+    standby.process.pid = -1;
+    standby.process.pidfd = -1;
+    standby.process.pgid = 0;
+    standby.fd = -1;
+}
+
+/*
+ * Function: standby_spawn
+ * -----------------------
+ * Runs an external program in the parked child and waits for it
+ *
+ * Returns: 0 if the program ran (status receives its wait status),
+ *          -1 if there is no usable standby child
+ */
+int standby_spawn(const char *full_path, char **argv, char **assignments,
+                  int nredirs, int *status) {
+    if (standby.process.pid == -1 || nredirs > 0 || redirections_active > 0 ||
+        standby.generation != shell_generation) {
+        return -1;
+    }
+
+    size_t scratch_mark = scratch.top;
+    standby_request_t *req = arena_alloc(&scratch, sizeof(standby_request_t));
+    req->argc = 0;
+    req->nenv = 0;
+    append_string(full_path);
+    arena_putc(&scratch, '\0');
+    for (char **a = argv; *a != NULL; a++) {
+        append_string(*a);
+        arena_putc(&scratch, '\0');
+        req->argc++;
+    }
+    for (char **e = assignments; *e != NULL; e++) {
+        append_string(*e);
+        arena_putc(&scratch, '\0');
+        req->nenv++;
+    }
+    size_t len = scratch.top - ((char *)req - scratch.base);
+    req->len = (uint32_t)(len - sizeof(standby_request_t));
+
+    // It cannot run code for us: its limits, priorities and cgroup are
+    // set from here
+    char number[12];
+    if (command_limits_apply(standby.process.pid) == -1 ||
+        sched_apply(standby.process.pid, &command_sched) != NULL ||
+        (command_perf.n > 0 && perf_open(standby.process.pid) == -1) ||
+        (spawn_cgroup != -1 &&
+         cgroup_write(spawn_cgroup, "cgroup.procs",
+                      int_to_string((int)standby.process.pid, number)) == -1)) {
+        scratch.top = scratch_mark;
+        standby_stop(1);
+        return -1;
+    }
+    if (standby.process.pgid != 0) {
+        // Before it can exec: the program may read the terminal at once
+        tcsetpgrp(terminal_fd, standby.process.pgid);
+    }
+
+    // send() with MSG_NOSIGNAL: a dead child gives EPIPE, not SIGPIPE
+    const char *data = (const char *)req;
+    while (len > 0) {
+        ssize_t n = send(standby.fd, data, len, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            scratch.top = scratch_mark;
+            standby_stop(1);
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    scratch.top = scratch_mark;
+
+    // The child is now the command; the next prompt forks a new one
+    process_t child = standby.process;
+    command_started(child.pid, full_path);
+    close(standby.fd);
+    standby.process.pid = -1;
+    standby.process.pidfd = -1;
+    standby.process.pgid = 0;
+    standby.fd = -1;
+    if (event_wait_child(&child, status) == -1) {
+        perror("waitid");
+        *status = 1 << 8;
+    } else if (WIFSTOPPED(*status)) {
+        *status = job_suspend(&child, argv, *status);
+    }
+    return 0;
+}
+
+/*
+ * Function: exec_program
+ * ----------------------
+ * Turns the calling process into the program: prefix assignments,
+ * limits, priorities and redirections are applied to it, then execv().
+ * Runs in the fork()ed child, or in a shell process that has nothing
+ * left to do after the command (see tail_position). Never returns.
+ */
+void exec_program(const char *full_path, char **argv, char **assignments,
+                  redirect_t *redirects, int nredirs) {
+    trace_exec_mark(0);
+
+    // Prefix assignments only affect this child's environment
+    // putenv() keeps the pointer, which is fine: exec copies the strings
+    for (int i = 0; assignments[i] != NULL; i++) {
+        putenv(assignments[i]);
+    }
+
+    // Resource limits ("ulimit") only bind this child, too
+    if (command_limits_apply(0) == -1) {
+        perror("ulimit");
+        _exit(1);
+    }
+    const char *refused = sched_apply(0, &command_sched);
+    if (refused != NULL) {
+        perror(refused);
+        _exit(1);
+    }
+
+    // Redirections only change the child's fds, so the shell's own
+    // stdin/stdout never need saving and restoring
+    if (redirect_apply(redirects, nredirs, 0) != nredirs) {
+        _exit(1);
+    }
+    int keep[MAX_KEPT_FDS];
+    for (int i = 0; i < nredirs && i < MAX_KEPT_FDS; i++) {
+        keep[i] = redirects[i].fd;
+    }
+    exec_fds_prepare(full_path, keep, nredirs);
+    trace_exec_mark(1);
+
+    // execv() replaces the child process with the new program
+    // If successful, this function NEVER returns
+    // Parameters:
+    //   - full_path: path to executable
+    //   - argv: array of arguments (NULL-terminated)
+    execv(full_path, argv);
+
+    // If we reach here, execv() failed
+    PROBE2(exec_failed, full_path, errno);
+    perror("execv");
+    exit(1);  // Child must exit (don't continue shell loop in child!)
+}
+
+/*
+ * Function: fork_exec_wait
+ * ------------------------
+ * Runs an external program in a child of the shell itself
+ *
+ * status: Receives the wait status of the child
+ *
+ * Returns: 0 on success, -1 if fork() or wait() failed
+ */
+int fork_exec_wait(const char *full_path, char **argv, char **assignments,
+                   redirect_t *redirects, int nredirs, int *status) {
+    // process_spawn() creates a child process, like fork(), and a pidfd
+    // that refers to it; with job control the child gets the terminal
+    // Returns: PID of child in parent, 0 in child, -1 on error
+    process_t child;
+    if (command_perf.n > 0 && perf_open(0) == -1) {
+        perror("perf_event_open");
+        return -1;
+    }
+    pid_t pid = process_spawn(&child, SPAWN_FOREGROUND);
+
+    if (pid == -1) {
+        // Fork failed - print error and continue shell
+        perror("fork");
+        return -1;
+    } else if (pid == 0) {
+        // ===== CHILD PROCESS =====
+        // This code runs ONLY in the child process
+        exec_program(full_path, argv, assignments, redirects, nredirs);
+    }
+
+    // ===== PARENT PROCESS =====
+    // This code runs ONLY in the parent process
+    // pid contains the child's process ID
+    command_started(pid, full_path);
+
+    // event_wait_child() blocks parent until this child terminates:
+    // waitid() on the pidfd cannot return the fork server, the standby
+    // child or a background job instead (those are reaped on the side)
+    // Returns: 0, or -1 on error
+    // Parameter: pointer to int where exit status is stored
+    if (event_wait_child(&child, status) == -1) {
+        perror("waitid");
+        return -1;
+    }
+    if (WIFSTOPPED(*status)) {
+        *status = job_suspend(&child, argv, *status);
+    }
+    return 0;
+}
+
+/*
+ * Completion records (--records)
+ * ------------------------------
+ * With --records FILE or --records-fd N every foreground external
+ * command leaves one JSON line behind when it finishes: what ran, its
+ * pid, how it ended, and the time and memory it used (from the rusage
+ * the wait returned).
+ */
+#define RECORDS_FD  104     // --records target; see redirect_shell_fd()
+
+/*
+ * Function: record_number
+ * -----------------------
+ * Appends the decimal form of n to the scratch arena
+ */
+void record_number(long long n) {
+    char digits[24];
+    int len = 0;
+    unsigned long long u = (n < 0) ? 0 - (unsigned long long)n : (unsigned long long)n;
+    do {
+        digits[len++] = (char)('0' + u % 10);
+        u /= 10;
+    } while (u != 0);
+    if (n < 0) {
+        arena_putc(&scratch, '-');
+    }
+    while (len > 0) {
+        arena_putc(&scratch, digits[--len]);
+    }
+}
+
+/*
+ * Function: record_string
+ * -----------------------
+ * Appends s to the scratch arena as a JSON string: quotes, backslashes
+ * and control characters escaped, other bytes (UTF-8) as they are
+ */
+void record_string(const char *s) {
+    static const char hex[] = "0123456789abcdef";
+    arena_putc(&scratch, '"');
+    for (; *s != '\0'; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            arena_putc(&scratch, '\\');
+            arena_putc(&scratch, (char)c);
+        } else if (c < 0x20 || c == 0x7f) {
+            arena_putc(&scratch, '\\');
+            arena_putc(&scratch, 'u');
+            arena_putc(&scratch, '0');
+            arena_putc(&scratch, '0');
+            arena_putc(&scratch, hex[c >> 4]);
+            arena_putc(&scratch, hex[c & 15]);
+        } else {
+            arena_putc(&scratch, (char)c);
+        }
+    }
+    arena_putc(&scratch, '"');
+}
+
+/*
+ * Function: record_field
+ * ----------------------
+ * Appends ',"name":' to the scratch arena (separator: '{' for the first field)
+ */
+void record_field(char separator, const char *name) {
+    arena_putc(&scratch, separator);
+    arena_putc(&scratch, '"');
+    append_string(name);
+    arena_putc(&scratch, '"');
+    arena_putc(&scratch, ':');
+}
+
+/*
+ * Function: records_open
+ * ----------------------
+ * Sets up --records FILE (path != NULL) or --records-fd N
+ *
+ * The descriptor is moved to RECORDS_FD, close-on-exec. A file is opened
+ * O_APPEND, so records of several shells sharing it never overwrite
+ * each other.
+ *
+ * Returns: 0 on success, -1 on error (message printed)
+ */
+int records_open(const char *path, const char *fd_text) {
+    int fd;
+    if (path != NULL) {
+        fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    } else {
+        char *end;
+        long n = strtol(fd_text, &end, 10);
+        if (*fd_text == '\0' || *end != '\0' || n < 0 || n >= RECORDS_FD) {
+            errno = EBADF;
+            fd = -1;
+        } else {
+            fd = (int)n;
+        }
+    }
+    if (fd != -1) {
+        // The original is closed either way: a file's temporary number, or
+        // the caller's, which is then free for the script again
+        int high = fcntl(fd, F_DUPFD_CLOEXEC, RECORDS_FD);
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        fd = high;
+    }
+    if (fd == -1) {
+        write_str(STDERR_FILENO, "mini_bash: ");
+        write_str(STDERR_FILENO, (path != NULL) ? path : fd_text);
+        write_str(STDERR_FILENO, ": ");
+        write_str(STDERR_FILENO, strerror(errno));
+        write_str(STDERR_FILENO, "\n");
+        return -1;
+    }
+    if (records_fd != -1) {
+        close(records_fd);   // The last --records wins
+    }
+    records_fd = fd;
+    return 0;
+}
+
+/*
+ * Function: record_write
+ * ----------------------
+ * Writes the completion record of a foreground command to records_fd:
+ * one JSON object per line, built in the scratch arena and handed to
+ * the kernel in a single write() so concurrent writers (background
+ * shells, several mini_bash processes) never interleave inside a line
+ *
+ * start: CLOCK_REALTIME when the command was started (start_us)
+ * started: CLOCK_MONOTONIC at the same moment (for wall_us)
+ * status: Its wait status, before a time limit turns it into 124
+ *         (command_timed_out); process_usage holds its rusage
+ */
+void record_write(const char *full_path, char **argv, const struct timespec *start,
+                  const struct timespec *started, int status) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    size_t scratch_mark = scratch.top;
+
+    record_field('{', "argv0");
+    record_string(argv[0]);
+    record_field(',', "path");
+    record_string(full_path);
+    record_field(',', "pid");
+    record_number(command_pid);
+    record_field(',', "exit");
+    if (WIFEXITED(status)) {
+        record_number(WEXITSTATUS(status));
+    } else {
+        append_string("null");
+    }
+    record_field(',', "signal");
+    if (WIFSIGNALED(status)) {
+        record_number(WTERMSIG(status));
+    } else {
+        append_string("null");
+    }
+    record_field(',', "timed_out");
+    append_string(command_timed_out ? "true" : "false");
+    record_field(',', "start_us");
+    record_number(start->tv_sec * 1000000LL + start->tv_nsec / 1000);
+    record_field(',', "wall_us");
+    record_number((now.tv_sec - started->tv_sec) * 1000000LL +
+                  (now.tv_nsec - started->tv_nsec) / 1000);
+    record_field(',', "user_us");
+    record_number(process_usage.ru_utime.tv_sec * 1000000LL + process_usage.ru_utime.tv_usec);
+    record_field(',', "sys_us");
+    record_number(process_usage.ru_stime.tv_sec * 1000000LL + process_usage.ru_stime.tv_usec);
+    record_field(',', "maxrss_kb");
+    record_number(process_usage.ru_maxrss);
+    arena_putc(&scratch, '}');
+    arena_putc(&scratch, '\n');
+
+    // A short write to a pipe or file would split the line: drop the
+    // record rather than finish it with a second write()
+    write(records_fd, scratch.base + scratch_mark, scratch.top - scratch_mark);
+    scratch.top = scratch_mark;
+}
+
+/*
+ * Function: run_external
+ * ----------------------
+ * Runs an external program with the fork-exec-wait pattern (through the
+ * fork server with -o zygote)
+ *
+ * full_path: Executable found by find_command()
+ * argv: NULL-terminated argument vector
+ * assignments: NULL-terminated "NAME=value" strings for the child's
+ *              environment (prefix assignments such as "LANG=C ls")
+ * redirects: Prepared redirections, applied in the child before exec
+ *
+ * Returns: WEXITSTATUS() of the child, or 128 + signal number if the
+ *          child was killed by a signal (like bash), or TIMEOUT_STATUS
+ *          if it ran out of time (command_timeout_ms)
+ */
+int run_external(const char *full_path, char **argv, char **assignments,
+                 redirect_t *redirects, int nredirs) {
+    // Cheapest first: a child forked in advance, the fork server, fork()
+    // A time limit needs the child's pidfd, which the zygote's children
+    // do not have in the shell
+    // A cgroup leaf, too: the zygote cannot clone into one; nor can
+    // perf counters be opened on its children before they exec
+    // With job control the shell must be the parent to see a stop
+    int status;
+    int64_t entered_ns = trace_now();
+    command_timed_out = 0;
+    if (cgroup_create() == -1) {
+        return 1;
+    }
+    struct timespec start, started;
+    if (records_fd != -1) {
+        clock_gettime(CLOCK_REALTIME, &start);
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        memset(&process_usage, 0, sizeof(process_usage));
+    }
+    int64_t spawn_ns = trace_now();
+    if (standby_spawn(full_path, argv, assignments, nredirs, &status) == -1 &&
+        (zygote_fd == -1 || command_timeout_ms > 0 || spawn_cgroup != -1 || command_perf.n > 0 ||
+         job_control ||
+         zygote_spawn(full_path, argv, assignments, redirects, nredirs, &status) == -1) &&
+        fork_exec_wait(full_path, argv, assignments, redirects, nredirs, &status) == -1) {
+        cgroup_finish(0);
+        perf_close();
+        return 1;
+    }
+    int64_t reaped_ns = trace_now();
+    PROBE4(reap, command_pid, status, command_started_ns - spawn_ns, reaped_ns - command_started_ns);
+    if (trace_fd != -1) {
+        // fork: until the child existed (forked, or handed to the zygote
+        // or standby child); wait: until it was reaped
+        trace_span("fork", spawn_ns, command_started_ns);
+        trace_span("wait", command_started_ns, reaped_ns);
+        if (!WIFSTOPPED(status)) {
+            trace_child(command_pid, argv[0], command_started_ns, status);
+        }
+    }
+    cgroup_finish(1);   // Unless a stopped job has taken the leaf over
+    perf_finish(!WIFSTOPPED(status));
+    terminal_reclaim(status);
+    if (!WIFSTOPPED(status)) {
+        stats_record(full_path, entered_ns, spawn_ns, command_started_ns, reaped_ns);
+    }
+    if (records_fd != -1 && !WIFSTOPPED(status)) {
+        // The real status: a record says which signal ended a timed-out command
+        record_write(full_path, argv, &start, &started, status);
+    }
+    if (command_timed_out) {
+        // Whatever the signal did to it: report it like an exit(124)
+        status = TIMEOUT_STATUS << 8;
+    }
+    if (!WIFSTOPPED(status)) {
+        metrics.commands++;
+        metrics.failures += (status != 0);
+    }
+    return command_status(status);
+}
+
+/*
+ * Function: call_function
+ * -----------------------
+ * Runs a shell function inside the shell process - no fork, no exec
+ *
+ * A new frame binds $1..$N to argv[1..argc-1] (pointers only). Loop
+ * state is saved so "break" inside the function cannot leave a loop
+ * of the caller.
+ *
+ * Returns: The function's status ("return N" or its last command)
+ */
+int call_function(function_t *function, int argc, char **argv) {
+    if (frame_depth + 1 >= MAX_FRAMES) {
+        write_str(STDOUT_FILENO, "Error: Maximum function nesting depth exceeded\n");
+        return 1;
+    }
+
+    // Hold a reference so redefining the function while it runs
+    // cannot free the code being executed
+    program_t *fp = function->program;
+    int body = function->body;
+    fp->refs++;
+
+    frame_depth++;
+    frames[frame_depth].params = argv + 1;
+    frames[frame_depth].nparams = argc - 1;
+    int saved_loop_depth = loop_depth;
+    loop_depth = 0;
+
+    int status = execute_node(fp, body);
+    if (function_return) {
+        status = last_status;  // Set by "return N"
+        function_return = 0;
+    }
+
+    loop_depth = saved_loop_depth;
+    frame_depth--;
+    program_release(fp);
+    return status;
+}
+
+/*
+ * Command prefixes
+ * ----------------
+ * "timeout DURATION cmd args..." is not a program here: the shell
+ * strips the prefix and runs cmd itself, with a time limit on its wait
+ * (see event_wait_child()). $TMOUT_CMD gives the same limit to every
+ * external command that has no prefix of its own.
+ *
+ * Like the timeout(1) program, the prefix only runs external programs;
+ * it is no built-in, so "timeout 5 cd" looks for a program called cd.
+ *
+ * "ulimit -X VALUE... cmd" works the same way with command_limits; a
+ * ulimit without a command is the built-in. "cgroup", "taskset",
+ * "nice", "chrt" and "ionice" are prefixes as well. They can be
+ * chained: "timeout 5 ulimit -v 100000 nice cmd".
+ */
+/*
+ * Function: parse_duration
+ * ------------------------
+ * Parses a time like timeout(1) does: a number with an optional
+ * fraction and an optional unit (ms, s, m, h, d; default s)
+ *
+ * Returns: Milliseconds, or -1 if 's' is not a duration
+ */
+long parse_duration(const char *s) {
+    long whole = 0;
+    long fraction = 0;         // Milliseconds of the part after '.'
+    int digits = 0;
+    for (; *s >= '0' && *s <= '9'; s++, digits++) {
+        if (whole > 100000000) {
+            return -1;
+        }
+        whole = whole * 10 + (*s - '0');
+    }
+    if (*s == '.') {
+        long scale = 100;
+        for (s++; *s >= '0' && *s <= '9'; s++, digits++) {
+            fraction += (*s - '0') * scale;
+            scale /= 10;
+        }
+    }
+    if (digits == 0) {
+        return -1;
+    }
+
+    long unit;
+    if (strcmp(s, "ms") == 0) {
+        return whole + fraction / 1000;
+    } else if (*s == '\0' || strcmp(s, "s") == 0) {
+        unit = 1;
+    } else if (strcmp(s, "m") == 0) {
+        unit = 60;
+    } else if (strcmp(s, "h") == 0) {
+        unit = 3600;
+    } else if (strcmp(s, "d") == 0) {
+        unit = 86400;
+    } else {
+        return -1;
+    }
+    return whole * 1000 * unit + fraction * unit;
+}
+
+/*
+ * Function: command_prefix
+ * ------------------------
+ * Strips one prefix from the front of argv: "timeout [-k GRACE]
+ * DURATION" sets command_timeout_ms and command_kill_ms, "ulimit
+ * OPTIONS" sets command_limits, "cgroup FILE=VALUE..." the leaf's
+ * settings, sched_prefix() command_sched and perf_prefix()
+ * command_perf, for the command that follows. A timeout, nice, taskset,
+ * chrt or ionice form the shell does not handle is no prefix: the
+ * program of that name runs instead.
+ *
+ * Returns: Number of words consumed (0 if there is no prefix), -1
+ *          after a usage error, -2 after an invalid value
+ */
+int command_prefix(int argc, char **argv) {
+    int consumed = sched_prefix(argc, argv);
+    if (consumed == 0) {
+        consumed = perf_prefix(argc, argv);
+    }
+    if (consumed != 0) {
+        return consumed;
+    }
+    if (argc > 0 && strcmp(argv[0], "cgroup") == 0) {
+        // FILE=VALUE: a control file of the leaf, never cgroup.procs etc.
+        int i = 1;
+        while (i < argc && ncgroup_settings < MAX_CGROUP_SETTINGS) {
+            char *eq = strchr(argv[i], '=');
+            size_t len = (eq != NULL) ? (size_t)(eq - argv[i]) : 0;
+            if (len == 0 || len >= 64 || memchr(argv[i], '.', len) == NULL ||
+                memchr(argv[i], '/', len) != NULL || strncmp(argv[i], "cgroup.", 7) == 0) {
+                break;
+            }
+            cgroup_settings[ncgroup_settings++] = argv[i++];
+        }
+        if (i == 1 || i == argc) {
+            write_str(STDOUT_FILENO, "Usage: cgroup FILE=VALUE... command [args...]\n");
+            return -1;
+        }
+        if (cgroup_fd == -1) {
+            write_str(STDOUT_FILENO, "cgroup: needs -o cgroup\n");
+            return -1;
+        }
+        return i;
+    }
+    if (argc > 0 && strcmp(argv[0], "ulimit") == 0) {
+        limits_t limits;
+        int query;
+        int hard;
+        int i = ulimit_parse(argc, argv, &limits, &query, &hard);
+        if (i < 0) {
+            return i;
+        }
+        if (i == argc || query != -1) {
+            return 0;  // No command: the built-in
+        }
+        limits_merge(&command_limits, &limits);
+        limits_t merged = shell_limits;
+        limits_merge(&merged, &command_limits);
+        return (limits_check(&merged) == -1) ? i : -1;
+    }
+    if (argc == 0 || strcmp(argv[0], "timeout") != 0) {
+        return 0;
+    }
+    int i = 1;
+    long kill_ms = TIMEOUT_GRACE_MS;
+    if (i + 1 < argc && strcmp(argv[i], "-k") == 0) {
+        kill_ms = parse_duration(argv[i + 1]);
+        i += 2;
+    }
+    long timeout_ms = (i < argc) ? parse_duration(argv[i]) : -1;
+    if (timeout_ms == -1 || kill_ms == -1 || i + 1 >= argc) {
+        return 0;  // "-s KILL", "--preserve-status"...: /bin/timeout runs
+    }
+    command_timeout_ms = timeout_ms;
+    command_kill_ms = kill_ms;
+    return i + 1;
+}
+
+/*
+ * Function: execute_simple
+ * ------------------------
+ * Executes a simple command: expands its words, then runs a built-in,
+ * a shell function, or an external program - in that order
+ *
+ * Redirections of an external program are applied in its child; for
+ * everything that runs in the shell they are applied around the command
+ * and undone afterwards.
+ *
+ * Returns: The command's exit status
+ * - Unknown commands: 127
+ * - A command consisting only of assignments: 0
+ */
+int execute_simple(program_t *p, int n) {
+    out_flush();  // The previous report goes before anything this command prints
+    int tail = tail_position;
+    tail_position = 0;
+    node_t *node = &p->nodes[n];
+    size_t scratch_mark = scratch.top;
+    size_t fields_mark = fields.top;
+    int status;
+
+    // Leading NAME=value words are assignments
+    int first = node->word;
+    int end = node->word + node->nwords;
+    int nassign = 0;
+    while (first + nassign < end && (p->words[first + nassign].flags & WORD_ASSIGN)) {
+        nassign++;
+    }
+
+    // Expand the assignments into "NAME=value" strings
+    subst_status = -1;
+    char **assignments = arena_alloc(&fields, 0);
+    for (int w = first; w < first + nassign; w++) {
+        push_field(expand_single(p, w));
+    }
+    push_field(NULL);
+
+    // Expand the command words into a NULL-terminated argv
+    char **argv = arena_alloc(&fields, 0);
+    int argc = expand_words(p, first + nassign, end - first - nassign);
+    push_field(NULL);
+
+    // A prefix ("timeout 5 cmd") only leaves the external program
+    // $TMOUT_CMD limits every external command without one
+    const char *tmout_cmd = var_get("TMOUT_CMD", 9);
+    command_timeout_ms = (tmout_cmd != NULL) ? parse_duration(tmout_cmd) : 0;
+    command_timeout_ms = (command_timeout_ms > 0) ? command_timeout_ms : 0;
+    command_kill_ms = TIMEOUT_GRACE_MS;
+    command_limits.soft = command_limits.hard = 0;
+    ncgroup_settings = 0;
+    command_sched.set = 0;
+    command_perf.n = 0;
+    int prefix = 0;
+    int step;
+    while ((step = command_prefix(argc, argv)) > 0) {
+        argv += step;
+        argc -= step;
+        prefix += step;
+    }
+    if (step < 0) {
+        scratch.top = scratch_mark;
+        fields.top = fields_mark;
+        return (step == -1) ? 2 : 1;
+    }
+
+    builtin_t *builtin = NULL;
+    function_t *function = NULL;
+    char full_path[MAX_PATH];
+    int external = 0;
+    if (argc > 0) {
+        builtin = (prefix == 0) ? find_builtin(argv[0]) : NULL;
+        function = (builtin == NULL && prefix == 0) ? function_find(argv[0]) : NULL;
+        if (builtin == NULL && function == NULL) {
+            trace_begin("find_command");
+            external = find_command(argv[0], full_path);
+            trace_end("find_command");
+            PROBE4(resolve, argv[0], full_path, external, argc);
+            metrics.lookups_found += (uint64_t)external;
+            metrics.lookups_missed += (uint64_t)!external;
+        }
+    }
+
+    redirect_t *redirects = NULL;
+    int nredirs = node->nredirs;
+    if (nredirs > 0 && (redirects = redirect_prepare(p, node)) == NULL) {
+        status = 1;  // A here-document could not be created
+    } else if (external && tail && command_timeout_ms == 0 && command_perf.n == 0 &&
+               records_fd == -1) {
+        // Nothing is left to do after it: no need to fork and wait (but
+        // a completion record needs the wait)
+        exec_program(full_path, argv, assignments, redirects, nredirs);
+    } else if (external) {
+        status = run_external(full_path, argv, assignments, redirects, nredirs);
+        redirect_close(redirects, nredirs);
+    } else {
+        int applied = redirect_apply(redirects, nredirs, 1);
+        if (applied != nredirs) {
+            status = 1;
+        } else if (argc == 0) {
+            // Only assignments: set shell variables
+            for (int i = 0; assignments[i] != NULL; i++) {
+                char *eq = strchr(assignments[i], '=');
+                var_set(assignments[i], (size_t)(eq - assignments[i]), eq + 1);
+            }
+            // "x=$(cmd)" has the status of cmd
+            status = (subst_status != -1) ? subst_status : 0;
+        } else if (builtin != NULL) {
+            // Internal command - runs inside the shell process
+            builtin_assignments = assignments;
+            status = builtin->run(argc, argv);
+        } else if (function != NULL) {
+            status = call_function(function, argc, argv);
+        } else {
+            // Command not found in HOME or /bin
+            // Print error message: "[command]: Unknown Command"
+            write(STDOUT_FILENO, "[", 1);
+            write(STDOUT_FILENO, argv[0], strlen(argv[0]));
+            write(STDOUT_FILENO, "]: Unknown Command\n", 19);
+            metrics.unknown++;
+            status = 127;
+        }
+        if (redirect_persist) {
+            redirect_persist = 0;
+            redirect_keep(redirects, applied, nredirs);
+        } else {
+            redirect_restore(redirects, applied, nredirs);
+        }
+    }
+
+    // Release everything this command expanded
+    scratch.top = scratch_mark;
+    fields.top = fields_mark;
+    return status;
+}
+
+/*
+ * Function: loop_should_stop
+ * --------------------------
+ * Consumes pending break/continue levels at the end of a loop iteration
+ *
+ * Returns: 1 if the loop must stop, 0 to run the next iteration
+ */
+int loop_should_stop(void) {
+    if (exit_requested || function_return) {
+        return 1;
+    }
+    if (loop_break > 0) {
+        loop_break--;
+        return 1;
+    }
+    if (loop_continue > 1) {
+        loop_continue--;    // "continue 2": leave this loop, continue outer
+        return 1;
+    }
+    loop_continue = 0;
+    return 0;
+}
+
+/*
+ * Function: execute_for
+ * ---------------------
+ * for NAME in WORDS; do BODY; done
+ * The word list is expanded once, before the first iteration.
+ */
+int execute_for(program_t *p, node_t *node) {
+    size_t scratch_mark = scratch.top;
+    size_t fields_mark = fields.top;
+    int status = 0;
+    const char *name = word_text(p, node->word);
+
+    // "for x" without "in" iterates over the positional parameters
+    char **values = frames[frame_depth].params;
+    int count = frames[frame_depth].nparams;
+    if (!(node->flags & FOR_ARGS)) {
+        values = arena_alloc(&fields, 0);
+        count = expand_words(p, node->word + 1, node->nwords - 1);
+    }
+
+    loop_depth++;
+    for (int i = 0; i < count; i++) {
+        var_set(name, strlen(name), values[i]);
+        status = execute_list(p, node->right);
+        if (loop_should_stop()) {
+            break;
+        }
+    }
+    loop_depth--;
+
+    scratch.top = scratch_mark;
+    fields.top = fields_mark;
+    return status;
+}
+
+/*
+ * Function: execute_case
+ * ----------------------
+ * case WORD in PATTERN) BODY;; ... esac
+ * Runs the body of the first item with a matching pattern.
+ */
+int execute_case(program_t *p, node_t *node) {
+    size_t scratch_mark = scratch.top;
+    int status = 0;
+    char *subject = expand_single(p, node->word);
+
+    for (int item = node->left; item != -1; item = p->nodes[item].next) {
+        node_t *it = &p->nodes[item];
+        int matched = 0;
+        for (int w = it->word; w < it->word + it->nwords && !matched; w++) {
+            matched = pattern_match(expand_single(p, w), subject);
+        }
+        if (matched) {
+            status = execute_list(p, it->right);
+            break;
+        }
+    }
+
+    scratch.top = scratch_mark;
+    return status;
+}
+
+/*
+ * Function: execute_background
+ * ----------------------------
+ * Runs "cmd &": forks a child for the statement and returns at once
+ *
+ * Without job control the child ignores SIGINT/SIGQUIT (Ctrl+C is for
+ * the foreground) and reads /dev/null instead of the terminal, as
+ * POSIX asks for asynchronous lists.
+ *
+ * Returns: 0, or 1 if the child could not be created
+ */
+int execute_background(program_t *p, node_t *node) {
+    // With job control the job's own process group keeps the terminal's
+    // signals away, and reading the terminal stops it (SIGTTIN) until fg
+    int isolated = job_control;
+    int cpu = batch_cpu();
+    process_t child;
+    if (cgroup_create() == -1) {
+        return 1;
+    }
+    pid_t pid = process_spawn(&child, SPAWN_BACKGROUND);
+    if (pid == -1) {
+        perror("fork");
+        cgroup_finish(0);
+        return 1;
+    }
+    if (pid == 0) {
+        report_completion = 0;
+        zygote_stop();
+        standby_stop(0);
+        event_reset();
+        uring_reset();
+        cgroup_reset();
+        trace_reset();
+        metrics_close();
+        if (cpu != -1) {
+            // The job's commands inherit the CPU (a taskset prefix wins)
+            cpu_set_t one;
+            CPU_ZERO(&one);
+            CPU_SET(cpu, &one);
+            sched_setaffinity(0, sizeof(one), &one);
+        }
+        if (!isolated) {
+            signal(SIGINT, SIG_IGN);
+            signal(SIGQUIT, SIG_IGN);
+            int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            if (null_fd != -1 && null_fd != STDIN_FILENO) {
+                dup2(null_fd, STDIN_FILENO);
+                close(null_fd);
+            }
+        }
+        tail_position = 1;
+        _exit(execute_node(p, node->left));
+    }
+
+    last_background_pid = pid;
+    int id = job_start(&child, p, node->left);
+    cgroup_finish(0);   // Removes the leaf only if the job was waited for
+    if (id > 0 && jobs_report) {
+        // "[1] 12345", like bash
+        char number[12];
+        out_write("[", 1);
+        out_str(int_to_string(id, number));
+        out_write("] ", 2);
+        out_str(int_to_string((int)pid, number));
+        out_write("\n", 1);
+    }
+    return 0;
+}
+
+/*
+ * Function: execute_command
+ * -------------------------
+ * Executes one statement of the syntax tree, ignoring the redirections
+ * of compound commands (execute_node() applies those)
+ *
+ * Returns: The statement's exit status
+ */
+int execute_command(program_t *p, int n) {
+    node_t *node = &p->nodes[n];
+    int status = 0;
+    if (node->type != NODE_SIMPLE) {
+        tail_position = 0;  // Only a simple command can be exec()ed in place
+    }
+
+    switch (node->type) {
+        case NODE_SIMPLE:
+            status = execute_simple(p, n);
+            break;
+
+        case NODE_AND:
+        case NODE_OR:
+            // Short-circuit: the right side is only executed (and
+            // forked) if the left side's status asks for it
+            status = execute_node(p, node->left);
+            if ((node->type == NODE_AND) == (status == 0) && !exit_requested &&
+                !loop_break && !loop_continue && !function_return) {
+                status = execute_node(p, node->right);
+            }
+            break;
+
+        case NODE_NOT:
+            status = !execute_node(p, node->left);
+            break;
+
+        case NODE_IF:
+            if (execute_list(p, node->left) == 0) {
+                status = execute_list(p, node->right);
+            } else if (node->extra != -1) {
+                status = execute_list(p, node->extra);
+            }
+            break;
+
+        case NODE_WHILE:
+            loop_depth++;
+            while (1) {
+                int cond = execute_list(p, node->left);
+                if (exit_requested || function_return || loop_break || loop_continue) {
+                    loop_should_stop();  // break/continue in the condition
+                    break;
+                }
+                if ((cond == 0) == ((node->flags & LOOP_UNTIL) != 0)) {
+                    break;
+                }
+                status = execute_list(p, node->right);
+                if (loop_should_stop()) {
+                    break;
+                }
+            }
+            loop_depth--;
+            break;
+
+        case NODE_FOR:
+            status = execute_for(p, node);
+            break;
+
+        case NODE_CASE:
+            status = execute_case(p, node);
+            break;
+
+        case NODE_FUNCDEF:
+            function_define(p, n);
+            break;
+
+        case NODE_GROUP:
+            status = execute_list(p, node->left);
+            break;
+
+        case NODE_BACKGROUND:
+            status = execute_background(p, node);
+            break;
+    }
+    return status;
+}
+
+/*
+ * Function: execute_node
+ * ----------------------
+ * Executes one statement of the syntax tree. Redirections of a compound
+ * command ("while read x; do ...; done <file") are applied once around
+ * the whole command.
+ *
+ * Returns: The statement's exit status (also stored in last_status,
+ *          so "$?", "&&" and "||" see it)
+ */
+int execute_node(program_t *p, int n) {
+    node_t *node = &p->nodes[n];
+    int status;
+
+    if (node->nredirs > 0 && node->type != NODE_SIMPLE) {
+        size_t scratch_mark = scratch.top;
+        size_t fields_mark = fields.top;
+        redirect_t *redirects = redirect_prepare(p, node);
+        status = 1;
+        if (redirects != NULL) {
+            int applied = redirect_apply(redirects, node->nredirs, 1);
+            if (applied == node->nredirs) {
+                status = execute_command(p, n);
+            }
+            redirect_restore(redirects, applied, node->nredirs);
+        }
+        scratch.top = scratch_mark;
+        fields.top = fields_mark;
+    } else {
+        status = execute_command(p, n);
+    }
+
+    last_status = status;
+    return status;
+}
+
+/*
+ * Structure: input_t
+ * ------------------
+ * Buffered line reader for standard input. One read() may return
+ * several lines (piped input) or part of one; lines are handed out one
+ * at a time from the buffer.
+ */
+typedef struct {
+    char *buffer;
+    size_t start;           // First unconsumed byte
+    size_t end;             // End of valid data
+    size_t cap;
+    int interrupted;        // EVENT_SIGNAL / EVENT_TIMER if read_line() gave up
+} input_t;
+
+/*
+ * Function: read_line
+ * -------------------
+ * Reads the next line from standard input
+ *
+ * line: Receives a pointer to the line (inside the input buffer,
+ *       including its '\n' if there was one)
+ *
+ * While no input is available the event loop runs, so background jobs
+ * are reaped meanwhile. Ctrl+C or $TMOUT ends the wait early.
+ *
+ * Returns: Length of the line, 0 on EOF or when in->interrupted is set
+ */
+size_t read_line(input_t *in, char **line) {
+    in->interrupted = 0;
+    while (1) {
+        // Complete line already in the buffer?
+        char *newline = memchr(in->buffer + in->start, '\n', in->end - in->start);
+        if (newline != NULL) {
+            size_t len = (size_t)(newline - (in->buffer + in->start)) + 1;
+            *line = in->buffer + in->start;
+            in->start += len;
+            return len;
+        }
+
+        // Move the partial line to the front, grow the buffer if full
+        if (in->start > 0) {
+            memmove(in->buffer, in->buffer + in->start, in->end - in->start);
+            in->end -= in->start;
+            in->start = 0;
+        }
+        if (in->end == in->cap) {
+            in->cap *= 2;
+            in->buffer = realloc(in->buffer, in->cap);
+            if (in->buffer == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+
+        // Only wait in the event loop if something else can happen
+        // meanwhile (a job, a timer, Ctrl+C at a terminal, a scrape)
+        if (input_pollable && (jobs_running > 0 || timers_armed > 0 || metrics_fd != -1 ||
+                               sigismember(&event_signals, SIGINT))) {
+            out_flush();
+            int event = event_run(EVENT_INPUT);
+            if (event == EVENT_SIGNAL || event == EVENT_TIMER) {
+                in->start = in->end;  // Drop a partial line
+                in->interrupted = event;
+                return 0;
+            }
+        }
+
+        // read(fd, buffer, count) - reads up to 'count' bytes into 'buffer' from file descriptor 'fd'
+        // STDIN_FILENO (0) is the standard input (keyboard)
+        // Returns: number of bytes read, 0 on EOF, or -1 on error
+        // out_flush_read() writes the queued prompt first (same call with io_uring)
+        ssize_t bytes_read = out_flush_read(STDIN_FILENO, in->buffer + in->end, in->cap - in->end);
+
+        // Check if read() failed
+        if (bytes_read == -1) {
+            perror("read");
+            exit(1);
+        }
+
+        if (bytes_read == 0) {
+            // EOF: hand out a final line without '\n', if any
+            size_t len = in->end - in->start;
+            *line = in->buffer + in->start;
+            in->start = in->end;
+            return len;
+        }
+        in->end += (size_t)bytes_read;
+    }
+}
+
+/*
+ * Function: run_program
+ * ---------------------
+ * Parses and executes one piece of source text
+ *
+ * text: malloc()ed text (ownership passes to the program)
+ * len: Length of text (text[len] must be '\0')
+ *
+ * Returns: The parse result (PARSE_OK, PARSE_SYNTAX, PARSE_INCOMPLETE).
+ *          Nothing is executed unless the whole text parsed.
+ */
+int run_program(char *text, size_t len) {
+    program_t *program = program_new(text, len);
+    trace_begin("parse");
+    int result = parse_input(program);
+    trace_end("parse");
+    PROBE2(parse, result, program->nnodes);
+    if (result == PARSE_OK) {
+        execute_list(program, program->root);
+    }
+    program_release(program);
+    return result;
+}
+
+/*
+ * Function: report_parse_error
+ * ----------------------------
+ * Prints a parse error to parse_error_fd and sets $? like bash does for
+ * syntax errors
+ */
+void report_parse_error(int result) {
+    out_flush();
+    if (result == PARSE_INCOMPLETE) {
+        write_str(parse_error_fd, "Error: Syntax error: unexpected end of file\n");
+    } else {
+        write(parse_error_fd, "Error: Syntax error\n", 20);
+    }
+    last_status = 2;
+}
+
+/*
+ * Compiled-script cache
+ * ---------------------
+ * After a script is parsed, its program (tokenized text + node table +
+ * word table) is written to $HOME/.cache/mini_bash/<key>.ast. Because a
+ * program contains no pointers, the next run can mmap() that file and
+ * execute it directly: no read(), no lexing, no parsing.
+ *
+ * The key hashes the script path, device, inode, size and mtime, and the
+ * header repeats them, so an edited script never uses a stale cache.
+ * Setting MINI_BASH_NO_CACHE disables the cache.
+ *
+ * File layout (all sections 8-byte aligned):
+ *   cache_header_t | path | node_t[nnodes] | word_t[nwords] |
+ *   redir_t[nredirs] | text + '\0'
+ *
+ * Here-document bodies are part of the text, so they are cached too.
+ */
+#define CACHE_MAGIC "MBAST003"
+#define CACHE_DIR "/.cache/mini_bash"
+
+typedef struct {
+    char magic[8];          // CACHE_MAGIC (bumped when the format changes)
+    uint32_t node_size;     // sizeof(node_t): rejects caches from other builds
+    uint32_t path_len;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t text_len;
+    uint32_t nnodes;
+    uint32_t nwords;
+    int32_t root;
+    uint32_t nredirs;
+} cache_header_t;
+
+/*
+ * Function: align8
+ * ----------------
+ * Rounds a section size up to a multiple of 8 bytes
+ */
+size_t align8(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+
+/*
+ * Function: cache_file_for
+ * ------------------------
+ * Builds the cache file name for a script
+ *
+ * Key: FNV-1a hash of the path and the script's dev/inode/size/mtime
+ * Result: "$HOME/.cache/mini_bash/" + 16 hex digits + ".ast"
+ *
+ * Returns: 1 if a name was built, 0 if caching is disabled or $HOME is
+ *          unset or too long
+ */
+int cache_file_for(const char *script, const struct stat *st, char *cache_file) {
+    char *home = getenv("HOME");
+    if (home == NULL || getenv("MINI_BASH_NO_CACHE") != NULL) {
+        return 0;
+    }
+    size_t home_len = strlen(home);
+    if (home_len + sizeof(CACHE_DIR) + 22 > MAX_PATH) {
+        return 0;
+    }
+
+    uint64_t key[4] = {
+        (uint64_t)st->st_dev, (uint64_t)st->st_ino, (uint64_t)st->st_size,
+        (uint64_t)st->st_mtim.tv_sec * 1000000000u + (uint64_t)st->st_mtim.tv_nsec
+    };
+    uint64_t hash = fnv1a(FNV_OFFSET, script, strlen(script));
+    hash = fnv1a(hash, key, sizeof(key));
+
+    // Manual string building: HOME + CACHE_DIR + "/" + hex + ".ast"
+    size_t i = 0;
+    memcpy(cache_file, home, home_len);
+    i += home_len;
+    memcpy(cache_file + i, CACHE_DIR "/", sizeof(CACHE_DIR));
+    i += sizeof(CACHE_DIR);
+    for (int shift = 60; shift >= 0; shift -= 4) {
+        cache_file[i++] = "0123456789abcdef"[(hash >> shift) & 0xf];
+    }
+    memcpy(cache_file + i, ".ast", 5);
+    return 1;
+}
+
+/*
+ * Function: cache_load
+ * --------------------
+ * Maps a cache file and turns it into a ready-to-run program
+ *
+ * The header must match the script exactly, and every index in the
+ * tables is bounds-checked, so a truncated or corrupted cache file is
+ * rejected instead of crashing the shell.
+ *
+ * Returns: The program, or NULL if there is no usable cache file
+ */
+program_t *cache_load(const char *cache_file, const char *script, const struct stat *st) {
+    int fd = open(cache_file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;  // Cold start: no cache yet
+    }
+    struct stat cst;
+    if (fstat(fd, &cst) == -1 || (size_t)cst.st_size < sizeof(cache_header_t)) {
+        close(fd);
+        return NULL;
+    }
+
+    // mmap() maps the file read-only; the mapping outlives the fd
+    size_t map_len = (size_t)cst.st_size;
+    char *map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    cache_header_t *h = (cache_header_t *)map;
+    size_t path_len = strlen(script);
+    size_t nodes_at = sizeof(cache_header_t) + align8(path_len);
+    size_t words_at = nodes_at + (size_t)h->nnodes * sizeof(node_t);
+    size_t redirs_at = words_at + align8((size_t)h->nwords * sizeof(word_t));
+    size_t text_at = redirs_at + (size_t)h->nredirs * sizeof(redir_t);
+
+    int valid = memcmp(h->magic, CACHE_MAGIC, 8) == 0 &&
+                h->node_size == sizeof(node_t) &&
+                h->path_len == path_len &&
+                h->dev == (uint64_t)st->st_dev && h->ino == (uint64_t)st->st_ino &&
+                h->size == (uint64_t)st->st_size &&
+                h->mtime_sec == (int64_t)st->st_mtim.tv_sec &&
+                h->mtime_nsec == (int64_t)st->st_mtim.tv_nsec &&
+                h->nnodes < (1u << 30) && h->nwords < (1u << 30) &&
+                h->nredirs < (1u << 30) &&
+                text_at + h->text_len + 1 == map_len &&
+                memcmp(map + sizeof(cache_header_t), script, path_len) == 0 &&
+                map[map_len - 1] == '\0' &&
+                h->root >= -1 && h->root < (int32_t)h->nnodes;
+
+    node_t *nodes = (node_t *)(map + nodes_at);
+    word_t *words = (word_t *)(map + words_at);
+    int32_t nnodes = (int32_t)h->nnodes;
+    int32_t nwords = (int32_t)h->nwords;
+    redir_t *redirs = (redir_t *)(map + redirs_at);
+    int32_t nredirs = (int32_t)h->nredirs;
+    for (int32_t n = 0; valid && n < nnodes; n++) {
+        node_t *node = &nodes[n];
+        valid = node->left >= -1 && node->left < nnodes &&
+                node->right >= -1 && node->right < nnodes &&
+                node->extra >= -1 && node->extra < nnodes &&
+                node->next >= -1 && node->next < nnodes &&
+                node->word >= 0 && node->nwords >= 0 &&
+                node->word <= nwords - node->nwords &&
+                node->redir >= 0 && node->nredirs >= 0 &&
+                node->redir <= nredirs - node->nredirs;
+    }
+    for (int32_t w = 0; valid && w < nwords; w++) {
+        valid = words[w].offset < h->text_len;
+    }
+    for (int32_t r = 0; valid && r < nredirs; r++) {
+        valid = redirs[r].type >= REDIR_IN && redirs[r].type <= REDIR_HERESTRING &&
+                redirs[r].fd >= 0 &&
+                redirs[r].offset < h->text_len && redirs[r].body <= h->text_len;
+    }
+    if (!valid) {
+        munmap(map, map_len);
+        return NULL;
+    }
+
+    program_t *p = program_new(map + text_at, (size_t)h->text_len);
+    p->nodes = nodes;
+    p->nnodes = nnodes;
+    p->words = words;
+    p->nwords = nwords;
+    p->redirs = redirs;
+    p->nredirs = nredirs;
+    p->root = h->root;
+    p->map = map;
+    p->map_len = map_len;
+    return p;
+}
+
+/*
+ * Function: cache_store
+ * ---------------------
+ * Writes a freshly parsed program to the cache
+ *
+ * The file is written under a temporary name with one writev() and then
+ * rename()d into place, so concurrent shells never see a partial file.
+ * Failures are ignored: the cache is only an optimization.
+ */
+void cache_store(const char *cache_file, const char *script, const struct stat *st, program_t *p) {
+    // Create $HOME/.cache and $HOME/.cache/mini_bash (mkdir -p)
+    char dir[MAX_PATH];
+    size_t dir_len = strlen(cache_file) - 21;  // Strip "/" + 16 hex + ".ast"
+    memcpy(dir, cache_file, dir_len);
+    dir[dir_len] = '\0';
+    char *slash = strrchr(dir, '/');
+    *slash = '\0';
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+        return;
+    }
+    *slash = '/';
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+        return;
+    }
+
+    // Temporary name: cache file + "." + pid
+    char tmp[MAX_PATH + 16];
+    size_t len = strlen(cache_file);
+    memcpy(tmp, cache_file, len);
+    tmp[len++] = '.';
+    int_to_string((int)getpid(), tmp + len);
+
+    cache_header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CACHE_MAGIC, 8);
+    h.node_size = sizeof(node_t);
+    h.path_len = (uint32_t)strlen(script);
+    h.dev = (uint64_t)st->st_dev;
+    h.ino = (uint64_t)st->st_ino;
+    h.size = (uint64_t)st->st_size;
+    h.mtime_sec = (int64_t)st->st_mtim.tv_sec;
+    h.mtime_nsec = (int64_t)st->st_mtim.tv_nsec;
+    h.text_len = p->text_len;
+    h.nnodes = (uint32_t)p->nnodes;
+    h.nwords = (uint32_t)p->nwords;
+    h.root = p->root;
+    h.nredirs = (uint32_t)p->nredirs;
+
+    static const char padding[8] = {0};
+    size_t words_size = (size_t)p->nwords * sizeof(word_t);
+    struct iovec iov[7] = {
+        {&h, sizeof(h)},
+        {(void *)script, h.path_len},
+        {(void *)padding, align8(h.path_len) - h.path_len},
+        {p->nodes, (size_t)p->nnodes * sizeof(node_t)},
+        {p->words, words_size},
+        {(void *)padding, align8(words_size) - words_size},
+        {p->redirs, (size_t)p->nredirs * sizeof(redir_t)},
+    };
+    size_t total = 0;
+    for (int i = 0; i < 7; i++) {
+        total += iov[i].iov_len;
+    }
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        return;
+    }
+    // writev() writes all sections with a single system call; the text
+    // (including its final '\0') is written with one more write()
+    int ok = writev(fd, iov, 7) == (ssize_t)total &&
+             write(fd, p->text, p->text_len + 1) == (ssize_t)(p->text_len + 1);
+    close(fd);
+    if (!ok || rename(tmp, cache_file) == -1) {
+        unlink(tmp);
+    }
+}
+
+/*
+ * Function: run_script
+ * --------------------
+ * Runs a script file (mini_bash FILE)
+ *
+ * Warm start: the compiled program is mmap()ed from the script cache.
+ * Cold start: the file is read with one read() into a buffer of its
+ * exact size (from fstat()), parsed once, stored in the cache, then
+ * executed.
+ *
+ * Returns: Exit status of the script
+ */
+int run_script(const char *path) {
+    // open() returns a file descriptor, or -1 on error
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror(path);
+        return 127;
+    }
+
+    // fstat() fills 'st' with file metadata; st_size is the file length
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        close(fd);
+        return 1;
+    }
+
+    char cache_file[MAX_PATH];
+    int use_cache = cache_file_for(path, &st, cache_file);
+    trace_begin("read");
+    program_t *program = use_cache ? cache_load(cache_file, path, &st) : NULL;
+
+    if (program == NULL) {
+        size_t size = (size_t)st.st_size;
+        char *text = malloc(size + 1);
+        if (text == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+
+        // Read the whole file (read() may return less than asked)
+        size_t total = 0;
+        while (total < size) {
+            ssize_t n = read(fd, text + total, size - total);
+            if (n == -1) {
+                perror("read");
+                trace_end("read");
+                close(fd);
+                free(text);
+                return 1;
+            }
+            if (n == 0) {
+                break;  // File shrank while reading
+            }
+            total += (size_t)n;
+        }
+        text[total] = '\0';
+        trace_end("read");
+        PROBE1(read, total);
+
+        program = program_new(text, total);
+        trace_begin("parse");
+        int result = parse_input(program);
+        trace_end("parse");
+        PROBE2(parse, result, program->nnodes);
+        if (result != PARSE_OK) {
+            close(fd);
+            program_release(program);
+            report_parse_error(result);
+            return last_status;
+        }
+        if (use_cache && total == size) {
+            cache_store(cache_file, path, &st, program);
+        }
+    } else {
+        trace_end("read");  // The cached program needs no parse
+    }
+    close(fd);
+
+    execute_list(program, program->root);
+    program_release(program);
+    return last_status;
+}
+
+/*
+ * Function: run_interactive
+ * -------------------------
+ * The interactive shell loop:
+ * 1. Displays a prompt
+ * 2. Reads a line of input
+ * 3. Parses it; if an if/while/for/case/quote is still open, shows the
+ *    continuation prompt and reads more lines
+ * 4. Executes the parsed program
+ *
+ * Returns: Exit status of the shell
+ */
+int run_interactive(void) {
+    // Buffered reader for standard input - reused across iterations
+    input_t in;
+    in.cap = BUFFER_SIZE;
+    in.start = in.end = 0;
+    in.buffer = malloc(in.cap);
+
+    // Text of the command being entered (may span several lines)
+    size_t pending_len = 0;
+    size_t pending_cap = BUFFER_SIZE;
+    char *pending = malloc(pending_cap);
+
+    if (in.buffer == NULL || pending == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    // Input, Ctrl+C, jobs and timers all arrive through the event loop;
+    // at a terminal, commands get process groups of their own
+    job_control_init();
+    event_init(1);
+    jobs_report = 1;
+    shell_interactive = isatty(STDIN_FILENO);
+
+    // Main shell loop - runs until "exit" or EOF
+    while (!exit_requested) {
+        // Fork the next command's child while the user is typing
+        if (option_standby) {
+            if (standby.generation != shell_generation) {
+                standby_stop(1);  // Forked in another directory
+            }
+            standby_start();
+        }
+
+        // Report background jobs that finished since the last prompt
+        jobs_notify();
+
+        // STEP 1: Display the prompt
+        // It is queued behind the last report and written by read_line(),
+        // as one write() - or, with -o uring, together with the read
+        if (pending_len == 0) {
+            out_write(PROMPT, PROMPT_LEN);
+        } else {
+            out_write(PROMPT2, PROMPT2_LEN);
+        }
+        PROBE1(prompt, pending_len > 0);
+
+        // STEP 2: Read one line of input
+        // $TMOUT (seconds): log out after that long without a command
+        const char *tmout = var_get("TMOUT", 5);
+        long timeout_ms = (pending_len == 0 && tmout != NULL) ? atol(tmout) * 1000 : 0;
+        if (timeout_ms > 0) {
+            event_timer(TIMER_TMOUT, timeout_ms);
+        }
+        char *line;
+        trace_begin("read");
+        size_t len = read_line(&in, &line);
+        trace_end("read");
+        PROBE1(read, len);
+        if (timeout_ms > 0) {
+            event_timer(TIMER_TMOUT, 0);
+        }
+
+        if (in.interrupted == EVENT_TIMER) {
+            out_str("\ntimed out waiting for input: auto-logout\n");
+            break;
+        }
+        if (in.interrupted == EVENT_SIGNAL) {
+            // Ctrl+C abandons the line being typed, like bash
+            out_write("\n", 1);
+            pending_len = 0;
+            last_status = 130;
+            continue;
+        }
+
+        // Check if we got EOF (Ctrl+D) - exit gracefully
+        if (len == 0) {
+            out_write("\n", 1);  // Print newline for clean exit
+            if (pending_len > 0) {
+                report_parse_error(PARSE_INCOMPLETE);
+            }
+            break;
+        }
+
+        // Append the line to the pending command text
+        if (pending_len + len + 1 > pending_cap) {
+            while (pending_len + len + 1 > pending_cap) {
+                pending_cap *= 2;
+            }
+            pending = realloc(pending, pending_cap);
+            if (pending == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        memcpy(pending + pending_len, line, len);
+        pending_len += len;
+        pending[pending_len] = '\0';
+
+        // STEP 3 + 4: Parse and execute.
+        // The parser modifies its text in place, so it gets its own copy
+        // and 'pending' stays intact in case more lines are needed.
+        char *text = malloc(pending_len + 1);
+        if (text == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        memcpy(text, pending, pending_len + 1);
+
+        int result = run_program(text, pending_len);
+        if (result == PARSE_INCOMPLETE) {
+            continue;  // Show "> " and read the rest of the command
+        }
+        if (result == PARSE_SYNTAX) {
+            report_parse_error(result);
+        }
+        pending_len = 0;
+    }
+
+    free(in.buffer);
+    free(pending);
+    return last_status;
+}
+
+/*
+ * Main function - Entry point of the shell
+ *
+ * Usage:
+ *   mini_bash                        Interactive shell (reads commands from stdin)
+ *   mini_bash -c STRING [NAME ARG...] Runs STRING ($0 = NAME, $1... = ARGs) and exits
+ *   mini_bash FILE [ARG...]          Runs the script FILE ($1... = ARGs) and exits
+ */
+int main(int argc, char *argv[]) {
+    // Before any fd of our own: the caller's fds are passed on to commands
+    fds_inherited_init();
+    shell_pid = getpid();
+
+    // -o NAME turns on an option (may be repeated); --records FILE and
+    // --records-fd N choose where completion records go, --trace FILE
+    // where the trace is written at exit, --metrics SOCKET where the
+    // counters are served
+    while (argc >= 3 && (strcmp(argv[1], "-o") == 0 || strcmp(argv[1], "--records") == 0 ||
+                         strcmp(argv[1], "--records-fd") == 0 || strcmp(argv[1], "--trace") == 0 ||
+                         strcmp(argv[1], "--metrics") == 0)) {
+        if (strcmp(argv[1], "--trace") == 0) {
+            if (trace_open(argv[2]) == -1) {
+                return 2;
+            }
+        } else if (strcmp(argv[1], "--metrics") == 0) {
+            if (metrics_open(argv[2]) == -1) {
+                return 2;
+            }
+        } else if (argv[1][1] == '-') {
+            if (records_open((argv[1][9] == '\0') ? argv[2] : NULL, argv[2]) == -1) {
+                return 2;
+            }
+        } else if (!option_set(argv[2])) {
+            write_str(STDERR_FILENO, "mini_bash: ");
+            write_str(STDERR_FILENO, argv[2]);
+            write_str(STDERR_FILENO, ": invalid option name\n");
+            return 2;
+        }
+        argv += 2;
+        argc -= 2;
+    }
+
+    fd_check = (getenv("MINI_BASH_FD_CHECK") != NULL);
+
+    // The fork server is started first, while the shell is still small
+    if (option_zygote) {
+        zygote_start();
+    }
+
+    // Reserve the expansion arenas once; they are reused by every command
+    arena_init(&scratch, ARENA_SIZE);
+    arena_init(&fields, ARENA_SIZE);
+
+    // Reports and prompts are queued; whatever is left goes out at exit
+    atexit(out_flush);
+    atexit(trace_flush);
+    atexit(metrics_finish);
+    if (option_cgroup) {
+        cgroup_init();  // Commands run without leaves if this fails
+    }
+#ifdef HAVE_IO_URING
+    if (option_uring) {
+        uring_init();
+    }
+#endif
+
+    if (argc >= 3 && strcmp(argv[1], "-c") == 0) {
+        // Like sh -c: the first argument after STRING is $0
+        if (argc >= 4) {
+            script_name = argv[3];
+            frames[0].params = argv + 4;
+            frames[0].nparams = argc - 4;
+        }
+
+        size_t len = strlen(argv[2]);
+        char *text = malloc(len + 1);
+        if (text == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        memcpy(text, argv[2], len + 1);
+
+        int result = run_program(text, len);
+        if (result != PARSE_OK) {
+            report_parse_error(result);
+        }
+        return last_status;
+    }
+
+    if (argc >= 2) {
+        script_name = argv[1];
+        frames[0].params = argv + 2;
+        frames[0].nparams = argc - 2;
+        return run_script(argv[1]);
+    }
+
+    return run_interactive();
+}
@@ -0,0 +1,35 @@
+#!/bin/bash
+#
+# glob.sh - Pathname expansion compared with bash (globstar on)
+#
+# Builds a small tree and expands each pattern with mini_bash and with
+# bash; the words must be the same. Prints one line per mismatch and
+# exits non-zero if there was any.
+#
+# Usage: make && tests/glob.sh
+
+SHELL_BIN=$(realpath "${SHELL_BIN:-./mini_bash}")
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+mkdir -p "$WORK/a/b/c" "$WORK/a/d" "$WORK/a/.hidden"
+touch "$WORK/a/f" "$WORK/a/b/g" "$WORK/a/b/c/h.txt" "$WORK/top" "$WORK/a/.dot"
+ln -s .. "$WORK/a/b/up"     # Symlinks to directories: listed, not entered
+ln -s a "$WORK/link"
+cd "$WORK" || exit 1
+
+failed=0
+for pattern in '*' '*/' 'a/*' 'a/**' 'a/**/' '**' '**/' 'a/**/g' 'a/b/**' \
+               '**/*.txt' 'a/b/**/' "$WORK/a/**" 'none/**' 'link/*' '*/b/'; do
+    # mini_bash prints its cwd notice on exit; only the words count
+    mini=$("$SHELL_BIN" -c "echo $pattern" 2>/dev/null | head -1)
+    want=$(bash -c "shopt -s globstar; echo $pattern")
+    if [ "$mini" != "$want" ]; then
+        echo "FAIL $pattern"
+        echo "  mini_bash: $mini"
+        echo "  bash:      $want"
+        failed=1
+    fi
+done
+[ $failed = 0 ] && echo "glob: all patterns match bash"
+exit $failed